@@ -25,34 +25,127 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdbool.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "lexer.h"
+#include "lexer_ctype.h"
+
+#ifdef BMXLEXER_USE_SDT
+#include <sys/sdt.h>
+#define LEXER_PROBE2(name, a, b) DTRACE_PROBE2(bmxlexer, name, a, b)
+#define LEXER_PROBE3(name, a, b, c) DTRACE_PROBE3(bmxlexer, name, a, b, c)
+#define LEXER_PROBE4(name, a, b, c, d) DTRACE_PROBE4(bmxlexer, name, a, b, c, d)
+#else
+#define LEXER_PROBE2(name, a, b)
+#define LEXER_PROBE3(name, a, b, c)
+#define LEXER_PROBE4(name, a, b, c, d)
+#endif
+
+#define LEXER_OFFSET(lexer, ptr) ((size_t)((ptr)-(lexer)->source_begin))
 
-const int LEXER_INITIAL_CAPACITY = 500;
+const size_t LEXER_INITIAL_CAPACITY = 500;
+/* tokens per segment with LEXER_OPT_SEGMENTED_TOKENS - 4096 tokens, 160KB on 64-bit targets */
+#define LEXER_SEGMENT_SHIFT 12
+#define LEXER_SEGMENT_SIZE ((size_t)1 << LEXER_SEGMENT_SHIFT)
 
 typedef struct s_token_mark {
 	const char *place;
-	int line, column;
-	int token;
+	int64_t line, column;
+	size_t token;
 } token_mark_t;
 
 struct s_lexer {
-	int capacity;
+	size_t capacity;
 	token_t *tokens;
+	// LEXER_OPT_SEGMENTED_TOKENS - fixed-size segments that never move, in place of the tokens array
+	bool segmented;
+	size_t num_segments, segments_capacity;
+	token_t **segments;
+	token_t overflow;	// written to in place of a new token once the token array can't grow any more
 	
 	const char *source_begin, *source_end;
+	const char *stop;	// lexer_run stops before the first token at or past this
 	token_mark_t current;
 	
+	size_t num_blocks, blocks_capacity;
+	block_t *blocks;
+	int64_t *token_blocks;
+	
+	int num_decls, decls_capacity;
+	decl_t *decls;
+	
+	unsigned int options;
+	int num_defines;
+	char **defines;
+	
+	// scan state lexer_run starts from - set when resuming from a checkpoint or after lexer_run_for runs out of budget
+	token_t comment;	// the Rem token of the block comment being read, TOK_INVALID outside one
+	int pending_flags;
+	bool skip_pending;	// read a false ?Condition - what follows its line is skipped
+	bool continued;	// dropped a .. and waiting for the newline it continues
+	atomic_int cancel;	// set by lexer_cancel from any thread
+	
+	int64_t checkpoint_lines;
+	size_t checkpoint_bytes;
+	int num_checkpoints, checkpoints_capacity;
+	lexer_checkpoint_t *checkpoints;
+	
+	int num_diagnostics, diagnostics_capacity;
+	lexer_diagnostic_t *diagnostics;
+	
+	// LEXER_OPT_FINGERPRINT - tokens are hashed once they can't be merged with the next one
+	uint64_t fingerprint_low, fingerprint_high;
+	bool fingerprint_started;	// hashed a token, so newlines count from here on
+	bool fingerprint_newline;	// a newline since the last hashed token, only hashed before the next one
+	bool fingerprint_end;	// an End held back in case the next token pairs with it
+	
 	char *error;
 };
 
 static int lexer_asprintf(char **ret, const char *format, ...);
-static void lexer_tokens_fit(lexer_t *lexer, size_t n);
+static bool lexer_tokens_fit(lexer_t *lexer, size_t n);
+static void lexer_tokens_free(lexer_t *lexer);
+static token_t *lexer_token_at(lexer_t *lexer, size_t index);
 static token_t *lexer_new_token(lexer_t *lexer);
-static token_t *lexer_merge_tokens(lexer_t *lexer, int from, int to, token_kind_t newKind);
+static void lexer_fail(lexer_t *lexer, const char *message);
+static void lexer_add_checkpoint(lexer_t *lexer, const token_t *comment, int pending_flags);
+static void lexer_restore(lexer_t *lexer, const lexer_checkpoint_t *checkpoint);
+static const char *lexer_token_text(const token_t *token, size_t *length);
+static void lexer_add_token(lexer_t *lexer, const token_t *token);
+static void lexer_fingerprint_reset(lexer_t *lexer);
+static void lexer_fingerprint_bytes(lexer_t *lexer, const char *bytes, size_t length, bool fold);
+static void lexer_fingerprint_token(lexer_t *lexer, const token_t *token);
+static void lexer_fingerprint_hash(lexer_t *lexer, const token_t *token);
+#ifdef BMXLEXER_REFERENCE_ENGINE
+static bool lexer_reference_isdigit(char cur);
+static bool lexer_reference_isalpha(char cur);
+static bool lexer_reference_isalnum(char cur);
+static bool lexer_reference_isxdigit(char cur);
+static char lexer_reference_tolower(char cur);
+static token_t *lexer_reference_new_token(lexer_t *lexer);
+static token_t *lexer_reference_merge_tokens(lexer_t *lexer, size_t from, size_t to, token_kind_t newKind);
+static token_mark_t lexer_reference_mark(lexer_t *lexer);
+static void lexer_reference_reset(lexer_t *lexer, token_mark_t mark);
+static char lexer_reference_current(lexer_t *lexer);
+static bool lexer_reference_has_next(lexer_t *lexer);
+static char lexer_reference_next(lexer_t *lexer);
+static char lexer_reference_peek(lexer_t *lexer);
+static void lexer_reference_skip_whitespace(lexer_t *lexer);
+static token_t lexer_reference_read_base_number(lexer_t *lexer);
+static token_kind_t lexer_reference_kind_for_single(const char *single, size_t len);
+static token_t lexer_reference_read_number(lexer_t *lexer);
+static token_t lexer_reference_read_word(lexer_t *lexer);
+static token_t lexer_reference_read_string(lexer_t *lexer);
+static token_t lexer_reference_read_line_comment(lexer_t *lexer);
+static token_t lexer_compare_next(lexer_t *lexer, size_t *index);
+#endif
 static token_mark_t lexer_mark(lexer_t *lexer);
 static void lexer_reset(lexer_t *lexer, token_mark_t mark);
 static char lexer_current(lexer_t *lexer);
@@ -60,12 +153,27 @@ static bool lexer_has_next(lexer_t *lexer);
 static char lexer_next(lexer_t *lexer);
 static char lexer_peek(lexer_t *lexer);
 static void lexer_skip_whitespace(lexer_t *lexer);
+static int lexer_utf8_length(const char *place, const char *end);
+static void lexer_add_diagnostic(lexer_t *lexer, lexer_diagnostic_kind_t kind, size_t length);
+static void lexer_skip_utf8(lexer_t *lexer);
+static void lexer_skip_plain(lexer_t *lexer, char stop);
+static void lexer_skip_word(lexer_t *lexer);
+static bool lexer_is_word_start(lexer_t *lexer, const char *place);
 static token_t lexer_read_base_number(lexer_t *lexer);
 static token_kind_t token_kind_for_single(const char *single, size_t len);
 static token_t lexer_read_number(lexer_t *lexer);
 token_t lexer_read_word(lexer_t *lexer);
 static token_t lexer_read_string(lexer_t *lexer);
 static token_t lexer_read_line_comment(lexer_t *lexer);
+static block_t *lexer_new_block(lexer_t *lexer);
+static bool lexer_opens_block(lexer_t *lexer, size_t index);
+static bool lexer_match_blocks(lexer_t *lexer);
+static bool lexer_at_line_end(lexer_t *lexer);
+static bool lexer_at_statement_start(lexer_t *lexer);
+static bool lexer_eval_condition(lexer_t *lexer, const char *place);
+static void lexer_skip_inactive(lexer_t *lexer);
+static decl_t *lexer_new_decl(lexer_t *lexer, decl_kind_t kind, const char *from, const char *to, int64_t line,
+		int parent);
 
 
 static const char *token_strings[] = {
@@ -200,6 +308,7 @@ static const char *token_strings[] = {
 	"Line Comment",
 	"Block Comment",
 	"<EOF>",
+	"Skipped Region",
 };
 
 
@@ -397,6 +506,34 @@ static token_pair_t const token_pairs[] = {
 };
 
 
+typedef struct s_block_closer {
+	token_kind_t open, close;
+} block_closer_t;
+
+static block_closer_t const block_closers[] = {
+	{ .open = TOK_TYPE_KW, .close = TOK_ENDTYPE_KW },
+	{ .open = TOK_FUNCTION_KW, .close = TOK_ENDFUNCTION_KW },
+	{ .open = TOK_METHOD_KW, .close = TOK_ENDMETHOD_KW },
+	{ .open = TOK_EXTERN_KW, .close = TOK_ENDEXTERN_KW },
+	
+	{ .open = TOK_IF_KW, .close = TOK_ENDIF_KW },
+	{ .open = TOK_SELECT_KW, .close = TOK_ENDSELECT_KW },
+	{ .open = TOK_WHILE_KW, .close = TOK_WEND_KW },
+	{ .open = TOK_WHILE_KW, .close = TOK_ENDWHILE_KW },
+	{ .open = TOK_FOR_KW, .close = TOK_NEXT_KW },
+	{ .open = TOK_REPEAT_KW, .close = TOK_UNTIL_KW },
+	{ .open = TOK_REPEAT_KW, .close = TOK_FOREVER_KW },
+	
+#ifdef BMAX_USE_ADDITIONS
+	
+	{ .open = TOK_PROTOCOL_KW, .close = TOK_ENDPROTOCOL_KW },
+	
+#endif
+	
+	{ .open = TOK_INVALID, .close = TOK_INVALID },
+};
+
+
 char *token_to_string(const token_t *tok) {
 	const char *orig;
 	char *buf = NULL;
@@ -415,30 +552,277 @@ char *token_to_string(const token_t *tok) {
 	}
 	if (orig != NULL) {
 		buf = (char*)calloc(len+1, sizeof(char));
-		strncpy(buf, orig, len);
+		if (buf != NULL) {
+			memcpy(buf, orig, len);
+		}
 	}
 	return buf;
 }
 
 
+char *token_ofs_to_string(const token_ofs_t *tok, const char *source_begin) {
+	if (tok == NULL || source_begin == NULL) {
+		return token_to_string(NULL);
+	}
+	
+	token_t token = {
+		.kind = tok->kind,
+		.flags = tok->flags,
+		.from = source_begin+tok->from,
+		.to = source_begin+tok->to,
+		.line = tok->line,
+		.column = tok->column,
+	};
+	return token_to_string(&token);
+}
+
+
+size_t token_kind_length(token_kind_t kind) {
+	switch (kind) {
+		case TOK_DOT: case TOK_AT: return 1;
+		case TOK_DOUBLEDOT: case TOK_DOUBLEAT: return 2;
+		case TOK_TRIPLEDOT: return 3;
+		default: break;
+	}
+	
+	const token_single_t *single_iter = token_singles;
+	for (; single_iter->matches != NULL; ++single_iter) {
+		if (single_iter->kind == kind) {
+			return strlen(single_iter->matches);
+		}
+	}
+	
+	// operators like :+ are only fixed if their halves have to be adjacent
+	const token_pair_t *pair_iter = token_pairs;
+	for (; pair_iter->left != TOK_INVALID; ++pair_iter) {
+		if (pair_iter->kind == kind && pair_iter->range == 0) {
+			return token_kind_length(pair_iter->left)+token_kind_length(pair_iter->right);
+		}
+	}
+	return 0;
+}
+
+
+uint64_t token_hash(const token_t *token) {
+	// FNV-1a over the kind and the text
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ (uint64_t)token->kind)*1099511628211ULL;
+	
+	size_t length;
+	const unsigned char *text = (const unsigned char*)lexer_token_text(token, &length);
+	size_t index = 0;
+	for (; index < length; ++index) {
+		hash = (hash ^ text[index])*1099511628211ULL;
+	}
+	return hash;
+}
+
+
+/*
+a token's text for lexer_export_strings - the same as token_to_string, i.e.
+its source text or its kind's string for newlines and tokens without text
+*/
+static const char *lexer_token_text(const token_t *token, size_t *length) {
+	if (token->from != NULL && token->to != NULL && token->kind != TOK_EOF && token->kind != TOK_INVALID &&
+		token->kind != TOK_NEWLINE) {
+		*length = (size_t)(token->to-token->from);
+		return token->from;
+	}
+	*length = strlen(token_strings[token->kind]);
+	return token_strings[token->kind];
+}
+
+
+lexer_strings_t *lexer_export_strings(lexer_t *lexer) {
+	if (lexer == NULL) {
+		return NULL;
+	}
+	
+	/*
+	the first text of each kind is shared by every later token of the kind
+	spelled the same way, so keywords, operators and newlines in their usual
+	spelling are only stored once (two passes - one to size, one to copy)
+	*/
+	const char *shared[TOK_COUNT];
+	size_t shared_length[TOK_COUNT];
+	size_t shared_offset[TOK_COUNT];
+	size_t num_tokens = lexer->current.token;
+	lexer_strings_t *strings = NULL;
+	char *text = NULL;
+	size_t *offsets = NULL;
+	size_t size = 0;
+	
+	int pass = 0;
+	for (; pass < 2; ++pass) {
+		memset(shared, 0, sizeof(shared));
+		size = 0;
+		
+		size_t index = 0;
+		for (; index < num_tokens; ++index) {
+			const token_t *token = lexer_token_at(lexer, index);
+			size_t length;
+			const char *from = lexer_token_text(token, &length);
+			
+			const char *first = shared[token->kind];
+			if (first != NULL && shared_length[token->kind] == length && memcmp(first, from, length) == 0) {
+				if (offsets != NULL) {
+					offsets[index] = shared_offset[token->kind];
+				}
+				continue;
+			}
+			
+			if (first == NULL) {
+				shared[token->kind] = from;
+				shared_length[token->kind] = length;
+				shared_offset[token->kind] = size;
+			}
+			if (text != NULL) {
+				memcpy(text+size, from, length);
+				text[size+length] = 0;
+				offsets[index] = size;
+			}
+			size += length+1;
+		}
+		
+		if (pass == 0) {
+			if ((SIZE_MAX-sizeof(lexer_strings_t)-size)/sizeof(size_t) < num_tokens) {
+				return NULL;
+			}
+			strings = malloc(sizeof(lexer_strings_t)+num_tokens*sizeof(size_t)+size);
+			if (strings == NULL) {
+				return NULL;
+			}
+			offsets = (size_t*)(strings+1);
+			text = (char*)(offsets+num_tokens);
+		}
+	}
+	
+	strings->num_tokens = num_tokens;
+	strings->size = size;
+	strings->text = text;
+	strings->offsets = offsets;
+	return strings;
+}
+
+
+const char *lexer_strings_get(const lexer_strings_t *strings, size_t index) {
+	if (strings == NULL || strings->num_tokens <= index) {
+		return NULL;
+	}
+	return strings->text+strings->offsets[index];
+}
+
+
+const char *lexer_strings_get32(const lexer_strings_t *strings, int index) {
+	return (index >= 0 ? lexer_strings_get(strings, (size_t)index) : NULL);
+}
+
+
 lexer_t *lexer_new(const char *source_begin, const char *source_end) {
 	if (source_begin == NULL || source_end == NULL || source_begin > source_end) {
 		return NULL;
 	}
 	
 	lexer_t *lexer = malloc(sizeof(lexer_t));
+	if (lexer == NULL) {
+		return NULL;
+	}
 	
 	lexer->capacity = 0;
 	lexer->tokens = NULL;
+	lexer->segmented = false;
+	lexer->num_segments = 0;
+	lexer->segments_capacity = 0;
+	lexer->segments = NULL;
 	lexer->source_begin = source_begin;
 	lexer->source_end = source_end;
+	lexer->stop = source_end;
 	lexer->current.place = source_begin;
 	lexer->current.line = 1;
 	lexer->current.column = 1;
 	lexer->current.token = 0;
+	lexer->num_blocks = 0;
+	lexer->blocks_capacity = 0;
+	lexer->blocks = NULL;
+	lexer->token_blocks = NULL;
+	lexer->num_decls = 0;
+	lexer->decls_capacity = 0;
+	lexer->decls = NULL;
+	lexer->options = 0;
+	lexer->num_defines = 0;
+	lexer->defines = NULL;
+	lexer->comment = (token_t){.kind = TOK_INVALID};
+	lexer->pending_flags = 0;
+	lexer->skip_pending = false;
+	lexer->continued = false;
+	atomic_init(&lexer->cancel, 0);
+	lexer->checkpoint_lines = 0;
+	lexer->checkpoint_bytes = 0;
+	lexer->num_checkpoints = 0;
+	lexer->checkpoints_capacity = 0;
+	lexer->checkpoints = NULL;
+	lexer->num_diagnostics = 0;
+	lexer->diagnostics_capacity = 0;
+	lexer->diagnostics = NULL;
+	lexer_fingerprint_reset(lexer);
 	lexer->error = NULL;
-	lexer_tokens_fit(lexer, LEXER_INITIAL_CAPACITY);
+	if (!lexer_tokens_fit(lexer, LEXER_INITIAL_CAPACITY)) {
+		free(lexer);
+		return NULL;
+	}
+	
+	return lexer;
+}
+
+
+lexer_t *lexer_new_range(const char *source_begin, const char *source_end, const char *start, const char *stop,
+		int64_t line) {
+	if (start == NULL || start < source_begin || source_end < start) {
+		return NULL;
+	}
+	
+	lexer_t *lexer = lexer_new(source_begin, source_end);
+	if (lexer == NULL) {
+		return NULL;
+	}
+	
+	lexer->current.place = start;
+	lexer->current.line = line;
+	if (stop != NULL && start <= stop && stop < source_end) {
+		lexer->stop = stop;
+	}
+	return lexer;
+}
+
+
+static void lexer_restore(lexer_t *lexer, const lexer_checkpoint_t *checkpoint) {
+	lexer->current.place = lexer->source_begin+checkpoint->offset;
+	lexer->current.line = checkpoint->line;
+	lexer->current.column = checkpoint->column;
+	lexer->pending_flags = checkpoint->flags;
+	lexer->skip_pending = false;
+	lexer->continued = false;
+	lexer->comment = (token_t){.kind = TOK_INVALID};
+	if (checkpoint->rem_line != 0) {
+		lexer->comment.kind = TOK_REM_KW;
+		lexer->comment.from = lexer->comment.to = lexer->source_begin+checkpoint->rem_offset;
+		lexer->comment.line = checkpoint->rem_line;
+		lexer->comment.column = checkpoint->rem_column;
+	}
+}
+
+
+lexer_t *lexer_new_at(const char *source_begin, const char *source_end, const lexer_checkpoint_t *checkpoint,
+		const char *stop) {
+	if (checkpoint == NULL || source_begin == NULL || source_end < source_begin ||
+		(size_t)(source_end-source_begin) < checkpoint->offset) {
+		return NULL;
+	}
 	
+	lexer_t *lexer = lexer_new_range(source_begin, source_end, source_begin+checkpoint->offset, stop, checkpoint->line);
+	if (lexer != NULL) {
+		lexer_restore(lexer, checkpoint);
+	}
 	return lexer;
 }
 
@@ -448,9 +832,34 @@ void lexer_destroy(lexer_t *lexer) {
 		return;
 	}
 	
-	if (lexer->tokens != NULL) {
-		free(lexer->tokens);
-		lexer->tokens = NULL;
+	lexer_tokens_free(lexer);
+	if (lexer->blocks != NULL) {
+		free(lexer->blocks);
+		lexer->blocks = NULL;
+	}
+	if (lexer->token_blocks != NULL) {
+		free(lexer->token_blocks);
+		lexer->token_blocks = NULL;
+	}
+	if (lexer->decls != NULL) {
+		free(lexer->decls);
+		lexer->decls = NULL;
+	}
+	if (lexer->checkpoints != NULL) {
+		free(lexer->checkpoints);
+		lexer->checkpoints = NULL;
+	}
+	if (lexer->diagnostics != NULL) {
+		free(lexer->diagnostics);
+		lexer->diagnostics = NULL;
+	}
+	if (lexer->defines != NULL) {
+		int index = 0;
+		for (; index < lexer->num_defines; ++index) {
+			free(lexer->defines[index]);
+		}
+		free(lexer->defines);
+		lexer->defines = NULL;
 	}
 	if (lexer->error != NULL) {
 		free(lexer->error);
@@ -464,26 +873,153 @@ void lexer_destroy(lexer_t *lexer) {
 }
 
 
-static void lexer_tokens_fit(lexer_t *lexer, size_t n) {
-	if (n < lexer->capacity) {
+void lexer_set_options(lexer_t *lexer, unsigned int options) {
+	if (lexer == NULL) {
 		return;
 	}
 	
-	size_t sz = lexer->capacity*2;
+	lexer->options = options;
+	// the storage only changes while there are no tokens to move over - it grows again with the first token
+	bool segmented = ((options & LEXER_OPT_SEGMENTED_TOKENS) != 0);
+	if (segmented != lexer->segmented && lexer->current.token == 0) {
+		lexer_tokens_free(lexer);
+		lexer->segmented = segmented;
+	}
+}
+
+
+void lexer_set_checkpoints(lexer_t *lexer, int64_t every_lines, size_t every_bytes) {
+	if (lexer != NULL) {
+		lexer->checkpoint_lines = (every_lines > 0 ? every_lines : 0);
+		lexer->checkpoint_bytes = every_bytes;
+	}
+}
+
+
+int lexer_define(lexer_t *lexer, const char *name) {
+	if (lexer == NULL || name == NULL) {
+		return -1;
+	}
+	
+	// strdup isn't part of C99
+	size_t size = strlen(name)+1;
+	char *copy = malloc(size);
+	if (copy == NULL) {
+		return -1;
+	}
+	memcpy(copy, name, size);
+	char **defines = realloc(lexer->defines, (size_t)(lexer->num_defines+1)*sizeof(char*));
+	if (defines == NULL) {
+		free(copy);
+		return -1;
+	}
+	lexer->defines = defines;
+	lexer->defines[lexer->num_defines] = copy;
+	++lexer->num_defines;
+	return 0;
+}
+
+
+/* grows the token array to hold at least n tokens - returns false if that's more than fits in memory */
+static bool lexer_tokens_fit(lexer_t *lexer, size_t n) {
+	if (n < lexer->capacity) {
+		return true;
+	}
+	
+	if (lexer->segmented) {
+		// only the segment table is reallocated, never the tokens
+		while (lexer->capacity <= n) {
+			if (lexer->capacity > SIZE_MAX/sizeof(token_t)-LEXER_SEGMENT_SIZE) {
+				return false;
+			}
+			if (lexer->num_segments == lexer->segments_capacity) {
+				size_t capacity = (lexer->segments_capacity > 0 ? lexer->segments_capacity*2 : 16);
+				token_t **segments = realloc(lexer->segments, capacity*sizeof(token_t*));
+				if (segments == NULL) {
+					return false;
+				}
+				lexer->segments = segments;
+				lexer->segments_capacity = capacity;
+			}
+			
+			token_t *segment = malloc(LEXER_SEGMENT_SIZE*sizeof(token_t));
+			if (segment == NULL) {
+				return false;
+			}
+			LEXER_PROBE2(tokens__grow, lexer->capacity, lexer->capacity+LEXER_SEGMENT_SIZE);
+			lexer->segments[lexer->num_segments] = segment;
+			lexer->num_segments += 1;
+			lexer->capacity += LEXER_SEGMENT_SIZE;
+		}
+		return true;
+	}
+	
+	const size_t max_capacity = SIZE_MAX/sizeof(token_t);
+	size_t sz = (lexer->capacity <= max_capacity/2 ? lexer->capacity*2 : max_capacity);
 	if (sz < n) {
 		sz = n;
 	}
-	lexer->tokens = realloc(lexer->tokens, sz*sizeof(token_t));
+	if (sz > max_capacity) {
+		return false;
+	}
+	LEXER_PROBE2(tokens__grow, lexer->capacity, sz);
+	token_t *tokens = realloc(lexer->tokens, sz*sizeof(token_t));
+	if (tokens == NULL) {
+		return false;
+	}
+	lexer->tokens = tokens;
 	lexer->capacity = sz;
+	return true;
+}
+
+
+static void lexer_tokens_free(lexer_t *lexer) {
+	size_t index = 0;
+	for (; index < lexer->num_segments; ++index) {
+		free(lexer->segments[index]);
+	}
+	free(lexer->segments);
+	free(lexer->tokens);
+	lexer->segments = NULL;
+	lexer->num_segments = lexer->segments_capacity = 0;
+	lexer->tokens = NULL;
+	lexer->capacity = 0;
+}
+
+
+/* the token at the index, which has to be below the capacity */
+static token_t *lexer_token_at(lexer_t *lexer, size_t index) {
+	if (lexer->segmented) {
+		return lexer->segments[index >> LEXER_SEGMENT_SHIFT]+(index & (LEXER_SEGMENT_SIZE-1));
+	}
+	return lexer->tokens+index;
 }
 
 
 static token_t *lexer_new_token(lexer_t *lexer) {
-	int index = lexer->current.token + 1;
-	lexer_tokens_fit(lexer, index+1);
-	token_t *token = lexer->tokens+lexer->current.token;
-	lexer->current.token = index;
+	// the previous token can't be merged with anything any more
+	if ((lexer->options & LEXER_OPT_FINGERPRINT) != 0 && lexer->current.token > 0) {
+		lexer_fingerprint_token(lexer, lexer_token_at(lexer, lexer->current.token-1));
+		// only the last token is ever looked at while lexing, and that's the new one
+		if ((lexer->options & LEXER_OPT_DISCARD_TOKENS) != 0) {
+			lexer->current.token = 0;
+		}
+	}
+	
+	token_t *token = &lexer->overflow;
+	if (lexer->error == NULL) {
+		size_t index = lexer->current.token + 1;
+		if (index != 0 && lexer_tokens_fit(lexer, index+1)) {
+			token = lexer_token_at(lexer, lexer->current.token);
+			lexer->current.token = index;
+		} else {
+			// keep lexing into the sink so callers don't need to check - lexer_run_for stops on the error
+			lexer_asprintf(&lexer->error, "[%lld:%lld] Out of memory for tokens\n", (long long)lexer->current.line,
+				(long long)lexer->current.column);
+		}
+	}
 	token->kind = TOK_INVALID;
+	token->flags = 0;
 	token->from = token->to = NULL;
 	token->line = 0;
 	token->column = 0;
@@ -491,16 +1027,180 @@ static token_t *lexer_new_token(lexer_t *lexer) {
 }
 
 
-static token_t *lexer_merge_tokens(lexer_t *lexer, int from, int to, token_kind_t newKind) {
-	lexer->tokens[from].to = lexer->tokens[to].to;
-	lexer->tokens[from].kind = newKind;
-	int offset = from - to;
-	int idx = to+1;
-	for (; idx < lexer->current.token; ++idx)
-		lexer->tokens[idx+offset] = lexer->tokens[idx];
-	lexer->current.token += offset;
+/* sets the lexer's error unless it already has one - lexer_run_for stops after the current token */
+static void lexer_fail(lexer_t *lexer, const char *message) {
+	if (lexer->error == NULL) {
+		lexer_asprintf(&lexer->error, "[%lld:%lld] %s\n", (long long)lexer->current.line,
+			(long long)lexer->current.column, message);
+	}
+}
+
+
+static void lexer_add_checkpoint(lexer_t *lexer, const token_t *comment, int pending_flags) {
+	// lexer_get_checkpoint takes an int, so a source needing more fails rather than losing checkpoints
+	if (lexer->num_checkpoints == INT_MAX) {
+		lexer_fail(lexer, "Too many checkpoints");
+		return;
+	}
+	if (lexer->num_checkpoints == lexer->checkpoints_capacity) {
+		int capacity = (lexer->checkpoints_capacity <= INT_MAX/2 ? lexer->checkpoints_capacity*2 : INT_MAX);
+		if (capacity < 16) {
+			capacity = 16;
+		}
+		lexer_checkpoint_t *checkpoints = realloc(lexer->checkpoints, (size_t)capacity*sizeof(lexer_checkpoint_t));
+		if (checkpoints == NULL) {
+			lexer_fail(lexer, "Out of memory for checkpoints");
+			return;
+		}
+		lexer->checkpoints = checkpoints;
+		lexer->checkpoints_capacity = capacity;
+	}
 	
-	return NULL;
+	lexer_checkpoint_t *checkpoint = lexer->checkpoints+lexer->num_checkpoints;
+	++lexer->num_checkpoints;
+	checkpoint->offset = LEXER_OFFSET(lexer, lexer->current.place);
+	checkpoint->line = lexer->current.line;
+	checkpoint->column = lexer->current.column;
+	checkpoint->token = lexer->current.token;
+	checkpoint->flags = pending_flags;
+	checkpoint->rem_line = checkpoint->rem_column = 0;
+	checkpoint->rem_offset = 0;
+	if (comment->kind != TOK_INVALID) {
+		checkpoint->rem_line = comment->line;
+		checkpoint->rem_column = comment->column;
+		checkpoint->rem_offset = LEXER_OFFSET(lexer, comment->to);
+	}
+}
+
+
+/*
+adds a token, merging it into the previous one if the two form a pair (e.g.
+End If or :+) - this is the same left-to-right merge the reference engine does
+after scanning, only without moving every later token for each merge
+*/
+static void lexer_add_token(lexer_t *lexer, const token_t *token) {
+	if (lexer->current.token > 0) {
+		token_t *prev = lexer_token_at(lexer, lexer->current.token-1);
+		const token_pair_t *pair_iter = token_pairs;
+		for (; pair_iter->left != TOK_INVALID; ++pair_iter) {
+			if (pair_iter->left == prev->kind && pair_iter->right == token->kind &&
+				token->from <= prev->to+pair_iter->range) {
+				prev->kind = pair_iter->kind;
+				prev->to = token->to;
+				return;
+			}
+		}
+	}
+	*lexer_new_token(lexer) = *token;
+}
+
+
+static void lexer_fingerprint_reset(lexer_t *lexer) {
+	lexer->fingerprint_low = 14695981039346656037ULL;
+	lexer->fingerprint_high = 0x9E3779B97F4A7C15ULL;
+	lexer->fingerprint_started = false;
+	lexer->fingerprint_newline = false;
+	lexer->fingerprint_end = false;
+}
+
+
+/* two independent 64-bit lanes, FNV-1a and a multiply-xorshift, so the fingerprint is 128 bits */
+static void lexer_fingerprint_bytes(lexer_t *lexer, const char *bytes, size_t length, bool fold) {
+	uint64_t low = lexer->fingerprint_low, high = lexer->fingerprint_high;
+	size_t index = 0;
+	for (; index < length; ++index) {
+		unsigned char byte = (unsigned char)bytes[index];
+		if (fold && 'A' <= byte && byte <= 'Z') {
+			byte |= 0x20;
+		}
+		low = (low ^ byte)*1099511628211ULL;
+		high = (high ^ byte)*0xC2B2AE3D27D4EB4FULL;
+		high ^= high >> 31;
+	}
+	lexer->fingerprint_low = low;
+	lexer->fingerprint_high = high;
+}
+
+
+/*
+adds a token to the fingerprint - the lexer only pairs End with the keyword
+after it across a single space, so an End is held back and paired here however
+far apart the two are, and End If hashes the same as End   If or EndIf
+*/
+static void lexer_fingerprint_token(lexer_t *lexer, const token_t *token) {
+	if (lexer->fingerprint_end) {
+		lexer->fingerprint_end = false;
+		const token_pair_t *pair_iter = token_pairs;
+		while (pair_iter->left != TOK_INVALID && !(pair_iter->left == TOK_END_KW && pair_iter->right == token->kind)) {
+			++pair_iter;
+		}
+		token_t held = { .kind = (pair_iter->left != TOK_INVALID ? pair_iter->kind : TOK_END_KW) };
+		lexer_fingerprint_hash(lexer, &held);
+		if (pair_iter->left != TOK_INVALID) {
+			return;
+		}
+	}
+	
+	if (token->kind == TOK_END_KW) {
+		lexer->fingerprint_end = true;
+	} else {
+		lexer_fingerprint_hash(lexer, token);
+	}
+}
+
+
+/*
+hashes a token into the fingerprint - comments (and the Rem/End Rem around
+block comments) are left out and runs of newlines count as one, so only changes
+to code change the fingerprint.  keywords and operators only count by kind,
+which already says how they're spelled give or take case and spaces; identifiers
+and number literals are case-folded, since BlitzMax doesn't tell case apart
+there.
+*/
+static void lexer_fingerprint_hash(lexer_t *lexer, const token_t *token) {
+	const char *text = NULL;
+	size_t length = 0;
+	
+	switch (token->kind) {
+		case TOK_LINE_COMMENT:
+		case TOK_BLOCK_COMMENT:
+		case TOK_REM_KW:
+		case TOK_ENDREM_KW:
+		case TOK_EOF:
+		case TOK_INVALID:
+			return;
+		
+		case TOK_NEWLINE:
+			lexer->fingerprint_newline = lexer->fingerprint_started;
+			return;
+		
+		case TOK_ID:
+		case TOK_NUMBER_LIT:
+		case TOK_HEX_LIT:
+		case TOK_BIN_LIT:
+		case TOK_STRING_LIT:
+			text = lexer_token_text(token, &length);
+			break;
+		
+		default:
+			break;
+	}
+	
+	if (lexer->fingerprint_newline) {
+		const char newline[5] = { (char)TOK_NEWLINE, 0, 0, 0, 0 };
+		lexer_fingerprint_bytes(lexer, newline, sizeof(newline), false);
+		lexer->fingerprint_newline = false;
+	}
+	
+	// the length keeps adjacent tokens from running together - spelled out byte by byte to not depend on endianness
+	const char header[5] = {
+		(char)token->kind, (char)length, (char)(length >> 8), (char)(length >> 16), (char)(length >> 24)
+	};
+	lexer_fingerprint_bytes(lexer, header, sizeof(header), false);
+	if (text != NULL) {
+		lexer_fingerprint_bytes(lexer, text, length, token->kind != TOK_STRING_LIT);
+	}
+	lexer->fingerprint_started = true;
 }
 
 
@@ -555,37 +1255,195 @@ static void lexer_skip_whitespace(lexer_t *lexer) {
 }
 
 
-static token_t lexer_read_base_number(lexer_t *lexer) {
-	char cur = lexer_current(lexer);
-	token_mark_t mark = lexer_mark(lexer);
-	token_t token = {
-		.kind = TOK_NUMBER_LIT,
-		.line = mark.line,
-		.column = mark.column,
-		.from = mark.place,
-		.to = NULL,
-	};
+/*
+returns the length of the UTF-8 sequence beginning at place if it's valid, or
+minus the length of its invalid part otherwise (a stray continuation byte, an
+overlong or truncated sequence, a surrogate or a code point past U+10FFFF)
+*/
+static int lexer_utf8_length(const char *place, const char *end) {
+	const unsigned char *bytes = (const unsigned char*)place;
+	unsigned char lead = bytes[0];
+	unsigned char low = 0x80, high = 0xBF;	// range of the byte after the lead
+	int length;
 	
-	if (cur == '%') {	// bin
-		while (lexer_has_next(lexer) && (cur = lexer_next(lexer)) == '0' || cur == '1');
-	} else if (cur == '$') {	// hex
-		while (lexer_has_next(lexer) && isxdigit(lexer_next(lexer)));
+	if (lead < 0x80) {
+		return 1;
+	} else if (0xC2 <= lead && lead <= 0xDF) {
+		length = 2;
+	} else if (0xE0 <= lead && lead <= 0xEF) {
+		length = 3;
+		low = (lead == 0xE0 ? 0xA0 : 0x80);
+		high = (lead == 0xED ? 0x9F : 0xBF);
+	} else if (0xF0 <= lead && lead <= 0xF4) {
+		length = 4;
+		low = (lead == 0xF0 ? 0x90 : 0x80);
+		high = (lead == 0xF4 ? 0x8F : 0xBF);
 	} else {
-		lexer_asprintf(&lexer->error, "[%d:%d] Malformed number literal encountered, not a number\n",
-				lexer->current.line, lexer->current.column);
-		token.kind = TOK_INVALID;
-		return token;
+		return -1;
 	}
 	
-	lexer_next(lexer);
-	token.to = lexer->current.place;
+	int index = 1;
+	for (; index < length; ++index) {
+		if (end-place <= index || bytes[index] < low || high < bytes[index]) {
+			return -index;
+		}
+		low = 0x80;
+		high = 0xBF;
+	}
+	return length;
+}
+
+
+static void lexer_add_diagnostic(lexer_t *lexer, lexer_diagnostic_kind_t kind, size_t length) {
+	// lexer_get_diagnostic takes an int as well
+	if (lexer->num_diagnostics == INT_MAX) {
+		lexer_fail(lexer, "Too many diagnostics");
+		return;
+	}
+	if (lexer->num_diagnostics == lexer->diagnostics_capacity) {
+		int capacity = (lexer->diagnostics_capacity > 0 ? lexer->diagnostics_capacity : 8);
+		capacity = (capacity <= INT_MAX/2 ? capacity*2 : INT_MAX);
+		lexer_diagnostic_t *diagnostics = realloc(lexer->diagnostics, (size_t)capacity*sizeof(lexer_diagnostic_t));
+		if (diagnostics == NULL) {
+			lexer_fail(lexer, "Out of memory for diagnostics");
+			return;
+		}
+		lexer->diagnostics = diagnostics;
+		lexer->diagnostics_capacity = capacity;
+	}
 	
-	return token;
+	lexer_diagnostic_t *diagnostic = lexer->diagnostics+lexer->num_diagnostics++;
+	diagnostic->kind = kind;
+	diagnostic->offset = LEXER_OFFSET(lexer, lexer->current.place);
+	diagnostic->length = length;
+	diagnostic->line = lexer->current.line;
+	diagnostic->column = lexer->current.column;
 }
 
 
-static token_kind_t token_kind_for_single(const char *single, size_t len) {
-	const token_single_t* iter = token_singles;
+/*
+moves onto the last byte of the UTF-8 sequence beginning at the current
+character, reporting the sequence if it isn't valid - for loops that go on by
+calling lexer_next
+*/
+static void lexer_skip_utf8(lexer_t *lexer) {
+	int length = lexer_utf8_length(lexer->current.place, lexer->source_end);
+	if (length < 0) {
+		length = -length;
+		lexer_add_diagnostic(lexer, LEXER_DIAG_INVALID_UTF8, (size_t)length);
+	}
+	lexer->current.place += length-1;
+	lexer->current.column += length-1;
+}
+
+
+/*
+moves onto the last of the ASCII characters following the current one that
+aren't NUL, a newline or stop - for loops that go on by calling lexer_next and
+only care about those (checks 16 characters at a time where SSE2 is available)
+*/
+static void lexer_skip_plain(lexer_t *lexer, char stop) {
+	const char *place = lexer->current.place+1;
+	const char *end = lexer->source_end;
+	
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128(), newline = _mm_set1_epi8('\n'), stops = _mm_set1_epi8(stop);
+	while (end-place >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)place);
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, zero), _mm_cmpeq_epi8(bytes, newline)),
+									   _mm_cmpeq_epi8(bytes, stops));
+		// or'ing in the bytes themselves picks up the high bit of anything past 0x7F
+		int mask = _mm_movemask_epi8(_mm_or_si128(special, bytes));
+		if (mask != 0) {
+			place += __builtin_ctz((unsigned int)mask);
+			break;
+		}
+		place += 16;
+	}
+#endif
+	
+	while (place < end && *place != 0 && *place != '\n' && *place != stop && (*place & 0x80) == 0) {
+		++place;
+	}
+	lexer->current.column += (int64_t)(place-1-lexer->current.place);
+	lexer->current.place = place-1;
+}
+
+
+/* same as lexer_skip_plain for the ASCII word characters (letters, digits and underscores) */
+static void lexer_skip_word(lexer_t *lexer) {
+	const char *place = lexer->current.place+1;
+	const char *end = lexer->source_end;
+	
+#ifdef __SSE2__
+	// the compares are signed, so each range is moved down to begin at -128
+	const __m128i case_bit = _mm_set1_epi8(0x20), alpha_low = _mm_set1_epi8('a'-128),
+		alpha_high = _mm_set1_epi8(-128+26), digit_low = _mm_set1_epi8('0'-128), digit_high = _mm_set1_epi8(-128+10),
+		underscore = _mm_set1_epi8('_');
+	while (end-place >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)place);
+		__m128i alpha = _mm_cmplt_epi8(_mm_sub_epi8(_mm_or_si128(bytes, case_bit), alpha_low), alpha_high);
+		__m128i digit = _mm_cmplt_epi8(_mm_sub_epi8(bytes, digit_low), digit_high);
+		__m128i word = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(bytes, underscore));
+		int mask = ~_mm_movemask_epi8(word) & 0xFFFF;
+		if (mask != 0) {
+			place += __builtin_ctz((unsigned int)mask);
+			break;
+		}
+		place += 16;
+	}
+#endif
+	
+	while (place < end && (*place == '_' || lexer_is_alpha(*place) || lexer_is_digit(*place))) {
+		++place;
+	}
+	lexer->current.column += (int64_t)(place-1-lexer->current.place);
+	lexer->current.place = place-1;
+}
+
+
+/* true if a word (a keyword or identifier) begins at place */
+static bool lexer_is_word_start(lexer_t *lexer, const char *place) {
+	char cur = *place;
+	if (cur == '_' || lexer_is_alpha(cur)) {
+		return true;
+	}
+	return ((cur & 0x80) != 0 && (lexer->options & LEXER_OPT_UTF8_IDENTIFIERS) != 0 &&
+			lexer_utf8_length(place, lexer->source_end) > 0);
+}
+
+
+static token_t lexer_read_base_number(lexer_t *lexer) {
+	char cur = lexer_current(lexer);
+	token_mark_t mark = lexer_mark(lexer);
+	token_t token = {
+		.kind = TOK_NUMBER_LIT,
+		.line = mark.line,
+		.column = mark.column,
+		.from = mark.place,
+		.to = NULL,
+	};
+	
+	// both loops stop on the first character that isn't part of the literal
+	if (cur == '%') {	// bin
+		while (lexer_has_next(lexer) && ((cur = lexer_next(lexer)) == '0' || cur == '1'));
+	} else if (cur == '$') {	// hex
+		while (lexer_has_next(lexer) && lexer_is_xdigit(lexer_next(lexer)));
+	} else {
+		lexer_asprintf(&lexer->error, "[%lld:%lld] Malformed number literal encountered, not a number\n",
+				(long long)lexer->current.line, (long long)lexer->current.column);
+		token.kind = TOK_INVALID;
+		return token;
+	}
+	
+	token.to = lexer->current.place;
+	
+	return token;
+}
+
+
+static token_kind_t token_kind_for_single(const char *single, size_t len) {
+	const token_single_t* iter = token_singles;
 	while (iter->kind != TOK_INVALID) {
 		if (strlen(iter->matches) == len && ((iter->case_sensitive
 			 ? strncmp(iter->matches, single, len)
@@ -620,14 +1478,14 @@ static token_t lexer_read_number(lexer_t *lexer) {
 			continue;
 		}
 		
-		if (isdigit(cur)) {
+		if (lexer_is_digit(cur)) {
 			continue;
 		}
 		
-		if (tolower(cur) == 'e') {
+		if (cur == 'e' || cur == 'E') {
 			if (isExp) {
-				lexer_asprintf(&lexer->error, "[%d:%d] Malformed number literal encountered, exponent already provided\n",
-						lexer->current.line, lexer->current.column);
+				lexer_asprintf(&lexer->error, "[%lld:%lld] Malformed number literal encountered, exponent already provided\n",
+						(long long)lexer->current.line, (long long)lexer->current.column);
 				token.kind = TOK_INVALID;
 				return token;
 			}
@@ -638,9 +1496,9 @@ static token_t lexer_read_number(lexer_t *lexer) {
 				lexer_next(lexer);
 				cur = lexer_peek(lexer);
 			}
-			if (!isdigit(cur)) {
-				lexer_asprintf(&lexer->error, "[%d:%d] Malformed number literal encountered, exponent expected but not found (%c:%d)\n",
-						lexer->current.line, lexer->current.column, cur, cur);
+			if (!lexer_is_digit(cur)) {
+				lexer_asprintf(&lexer->error, "[%lld:%lld] Malformed number literal encountered, exponent expected but not found (%c:%d)\n",
+						(long long)lexer->current.line, (long long)lexer->current.column, cur, cur);
 				token.kind = TOK_INVALID;
 				return token;
 			}
@@ -666,12 +1524,19 @@ token_t lexer_read_word(lexer_t *lexer) {
 		.to = NULL,
 	};
 	
-	while (lexer_has_next(lexer)) {
-		char cur = lexer_peek(lexer);
-		if (cur != '_' && !isalnum(cur)) {
+	// non-ASCII characters only get here with LEXER_OPT_UTF8_IDENTIFIERS, where any valid one is part of the word
+	if ((mark.place[0] & 0x80) != 0) {
+		lexer_skip_utf8(lexer);
+	}
+	
+	for (;;) {
+		lexer_skip_word(lexer);
+		if ((lexer->options & LEXER_OPT_UTF8_IDENTIFIERS) == 0 || !lexer_has_next(lexer) ||
+			(lexer_peek(lexer) & 0x80) == 0 || lexer_utf8_length(lexer->current.place+1, lexer->source_end) < 0) {
 			break;
 		}
 		lexer_next(lexer);
+		lexer_skip_utf8(lexer);
 	}
 	
 	lexer_next(lexer);
@@ -699,11 +1564,15 @@ static token_t lexer_read_string(lexer_t *lexer) {
 	
 	while (lexer_has_next(lexer) && (cur = lexer_next(lexer)) != '"') {
 		if (cur == '\n') {
-			lexer_asprintf(&lexer->error, "[%d:%d] String literal does not terminate before newline or EOF\n",
-					lexer->current.line, lexer->current.column);
+			lexer_asprintf(&lexer->error, "[%lld:%lld] String literal does not terminate before newline or EOF\n",
+					(long long)lexer->current.line, (long long)lexer->current.column);
 			token.kind = TOK_INVALID;
 			return token;
 		}
+		if ((cur & 0x80) != 0) {
+			lexer_skip_utf8(lexer);
+		}
+		lexer_skip_plain(lexer, '"');
 	}
 	lexer_next(lexer);
 	token.to = lexer->current.place;
@@ -724,7 +1593,11 @@ static token_t lexer_read_line_comment(lexer_t *lexer) {
 	};
 	
 	do {
+		lexer_skip_plain(lexer, '\n');
 		cur = lexer_next(lexer);
+		if ((cur & 0x80) != 0) {
+			lexer_skip_utf8(lexer);
+		}
 	} while(cur != 0 && cur != '\n');
 	
 	token.to = lexer->current.place;
@@ -733,27 +1606,273 @@ static token_t lexer_read_line_comment(lexer_t *lexer) {
 }
 
 
+/* true if there's nothing but whitespace or a line comment between the current place and the end of the line */
+static bool lexer_at_line_end(lexer_t *lexer) {
+	const char *place = lexer->current.place;
+	while (place < lexer->source_end && (*place == ' ' || *place == '\t' || *place == '\r')) {
+		++place;
+	}
+	return (place >= lexer->source_end || *place == '\n' || *place == '\'');
+}
+
+
+static bool lexer_at_statement_start(lexer_t *lexer) {
+	if (lexer->current.token == 0) {
+		return true;
+	}
+	token_kind_t prev = lexer_token_at(lexer, lexer->current.token-1)->kind;
+	return (prev == TOK_NEWLINE || prev == TOK_SKIPPED);
+}
+
+
+typedef struct s_condition {
+	lexer_t *lexer;
+	const char *place, *end;
+	bool valid;
+} condition_t;
+
+static bool condition_or(condition_t *cond);
+
+
+static void condition_skip_spaces(condition_t *cond) {
+	while (cond->place < cond->end && (*cond->place == ' ' || *cond->place == '\t' || *cond->place == '\r')) {
+		++cond->place;
+	}
+}
+
+
+static size_t condition_word(condition_t *cond, const char **word) {
+	condition_skip_spaces(cond);
+	const char *place = cond->place;
+	*word = place;
+	if (place < cond->end && (*place == '_' || lexer_is_alpha(*place))) {
+		while (place < cond->end && (*place == '_' || lexer_is_alpha(*place) || lexer_is_digit(*place))) {
+			++place;
+		}
+	}
+	return (size_t)(place-*word);
+}
+
+
+static bool condition_accept(condition_t *cond, const char *keyword) {
+	const char *word;
+	size_t len = condition_word(cond, &word);
+	if (len == strlen(keyword) && strncasecmp(word, keyword, len) == 0) {
+		cond->place = word+len;
+		return true;
+	}
+	return false;
+}
+
+
+static bool condition_unary(condition_t *cond) {
+	if (condition_accept(cond, "not")) {
+		return !condition_unary(cond);
+	}
+	
+	if (cond->place < cond->end && *cond->place == '(') {
+		++cond->place;
+		bool result = condition_or(cond);
+		condition_skip_spaces(cond);
+		if (cond->place < cond->end && *cond->place == ')') {
+			++cond->place;
+		} else {
+			cond->valid = false;
+		}
+		return result;
+	}
+	
+	const char *word;
+	size_t len = condition_word(cond, &word);
+	if (len == 0) {
+		cond->valid = false;
+		return true;
+	}
+	cond->place = word+len;
+	
+	int index = 0;
+	for (; index < cond->lexer->num_defines; ++index) {
+		if (strlen(cond->lexer->defines[index]) == len &&
+			strncasecmp(cond->lexer->defines[index], word, len) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static bool condition_and(condition_t *cond) {
+	bool result = condition_unary(cond);
+	while (cond->valid && condition_accept(cond, "and")) {
+		result = condition_unary(cond) && result;
+	}
+	return result;
+}
+
+
+static bool condition_or(condition_t *cond) {
+	bool result = condition_and(cond);
+	while (cond->valid && condition_accept(cond, "or")) {
+		result = condition_and(cond) || result;
+	}
+	return result;
+}
+
+
+/*
+evaluates the condition following the ? of a conditional compilation line,
+e.g. ?Win32 Or (Linux And Not Threaded) - a bare ? is always true, and so is
+anything that can't be parsed so nothing is skipped by mistake
+*/
+static bool lexer_eval_condition(lexer_t *lexer, const char *place) {
+	const char *end = memchr(place, '\n', (size_t)(lexer->source_end-place));
+	condition_t cond = {
+		.lexer = lexer,
+		.place = place,
+		.end = (end != NULL ? end : lexer->source_end),
+		.valid = true,
+	};
+	
+	condition_skip_spaces(&cond);
+	if (cond.place == cond.end || *cond.place == '\'') {
+		return true;
+	}
+	
+	bool result = condition_or(&cond);
+	condition_skip_spaces(&cond);
+	if (cond.place < cond.end && *cond.place != '\'') {
+		cond.valid = false;
+	}
+	return (cond.valid ? result : true);
+}
+
+
+/*
+skips an inactive region starting at the beginning of the current line up to
+the next line starting with a ? (or the end of the source), adding a single
+TOK_SKIPPED token for it
+*/
+static void lexer_skip_inactive(lexer_t *lexer) {
+	const char *begin = lexer->current.place;
+	const char *end = lexer->source_end;
+	const char *line = begin;
+	const char *line_start = begin;
+	int64_t num_lines = 0;
+	
+	while (line < end) {
+		const char *iter = line;
+		while (iter < end && (*iter == ' ' || *iter == '\t' || *iter == '\r')) {
+			++iter;
+		}
+		if (iter < end && *iter == '?') {
+			break;
+		}
+		
+		const char *newline = memchr(iter, '\n', (size_t)(end-iter));
+		if (newline == NULL) {
+			line_start = line;
+			line = end;
+			break;
+		}
+		line = line_start = newline+1;
+		++num_lines;
+	}
+	
+	if (line == begin) {
+		return;
+	}
+	
+	token_t skipped = {
+		.kind = TOK_SKIPPED,
+		.line = lexer->current.line,
+		.column = lexer->current.column,
+		.from = begin,
+		.to = line,
+	};
+	*lexer_new_token(lexer) = skipped;
+	
+	lexer->current.place = line;
+	lexer->current.line += num_lines;
+	lexer->current.column = 1+(int64_t)(line-line_start);
+}
+
+
 int lexer_run(lexer_t *lexer) {
+	return lexer_run_for(lexer, 0);
+}
+
+
+int lexer_run_for(lexer_t *lexer, size_t max_bytes) {
 	if (lexer == NULL || lexer->error != NULL) {
 		return 1;
 	}
 	
 	token_mark_t mark;
-	token_t comment = {.kind=TOK_INVALID};
+	token_t comment = lexer->comment;
 	token_t token;
 	char cur;
+	bool skip_pending = lexer->skip_pending;
+	bool continued = lexer->continued;
+	int pending_flags = lexer->pending_flags;
+	
+	// lexing only stops between tokens, so a slice can run past max_bytes by the length of one token
+	size_t budget_end = (max_bytes > 0 ? LEXER_OFFSET(lexer, lexer->current.place)+max_bytes : SIZE_MAX);
+	
+	// checkpoints are only taken where the state above is fully described by lexer_checkpoint_t, and not right after
+	// a skipped region since where that ends depends on the line the checkpoint would be at
+	bool checkpoints = ((lexer->checkpoint_lines > 0 || lexer->checkpoint_bytes > 0) &&
+						(lexer->options & LEXER_OPT_DISCARD_TOKENS) == 0);
+	int64_t checkpoint_line = 0;
+	size_t checkpoint_offset = 0;
+	if (checkpoints && lexer->num_checkpoints > 0) {
+		const lexer_checkpoint_t *last = lexer->checkpoints+lexer->num_checkpoints-1;
+		checkpoint_line = (lexer->checkpoint_lines > 0 ? last->line+lexer->checkpoint_lines : INT64_MAX);
+		checkpoint_offset = (lexer->checkpoint_bytes > 0 ? last->offset+lexer->checkpoint_bytes : SIZE_MAX);
+	}
+	
+	LEXER_PROBE2(run__start, LEXER_OFFSET(lexer, lexer->current.place),
+			LEXER_OFFSET(lexer, lexer->source_end));
 	
 	while(lexer_current(lexer) != 0) {
+		bool cancelled = (atomic_load_explicit(&lexer->cancel, memory_order_relaxed) != 0);
+		if (cancelled || budget_end <= LEXER_OFFSET(lexer, lexer->current.place)) {
+			if (cancelled) {
+				atomic_store_explicit(&lexer->cancel, 0, memory_order_relaxed);
+			}
+			lexer->comment = comment;
+			lexer->pending_flags = pending_flags;
+			lexer->skip_pending = skip_pending;
+			lexer->continued = continued;
+			LEXER_PROBE3(run__done, LEXER_OFFSET(lexer, lexer->current.place),
+					lexer->current.token, (cancelled ? LEXER_RUN_CANCELLED : LEXER_RUN_PENDING));
+			return (cancelled ? LEXER_RUN_CANCELLED : LEXER_RUN_PENDING);
+		}
+		
+		if (checkpoints && !skip_pending && !continued &&
+			(checkpoint_line <= lexer->current.line || checkpoint_offset <= LEXER_OFFSET(lexer, lexer->current.place)) &&
+			(comment.kind == TOK_INVALID ? lexer->current.column == 1 : comment.line < lexer->current.line) &&
+			(lexer->current.token == 0 || lexer_token_at(lexer, lexer->current.token-1)->kind != TOK_SKIPPED)) {
+			lexer_add_checkpoint(lexer, &comment, pending_flags);
+			checkpoint_line = (lexer->checkpoint_lines > 0 ? lexer->current.line+lexer->checkpoint_lines : INT64_MAX);
+			checkpoint_offset = (lexer->checkpoint_bytes > 0 ?
+								 LEXER_OFFSET(lexer, lexer->current.place)+lexer->checkpoint_bytes : SIZE_MAX);
+		}
+		
 		token.kind = TOK_INVALID;
+		token.flags = 0;
 		lexer_skip_whitespace(lexer);
 		
 		mark = lexer_mark(lexer);
-		if ((cur = lexer_current(lexer)) == 0) {
+		if ((cur = lexer_current(lexer)) == 0 || lexer->stop <= mark.place) {
 			break;
 		}
 		
 		if (comment.kind == TOK_INVALID) {
 			
+			if (cur == '?' && (lexer->options & LEXER_OPT_CONDITIONALS) != 0 && lexer_at_statement_start(lexer)) {
+				skip_pending = !lexer_eval_condition(lexer, mark.place+1);
+			}
+			
 			if (cur == '@') {
 				token.kind = TOK_AT;
 				if (lexer_next(lexer) == '@') {
@@ -768,7 +1887,7 @@ int lexer_run(lexer_t *lexer) {
 			}
 			
 			if (cur == '.') {
-				if (isdigit(lexer_peek(lexer))) {
+				if (lexer_is_digit(lexer_peek(lexer))) {
 					token = lexer_read_number(lexer);
 				} else {
 					token.kind = TOK_DOT;
@@ -800,7 +1919,7 @@ int lexer_run(lexer_t *lexer) {
 				}
 			}
 			
-			if (cur == '$' && isxdigit(lexer_peek(lexer))) {
+			if (cur == '$' && lexer_is_xdigit(lexer_peek(lexer))) {
 				token = lexer_read_base_number(lexer);
 			}
 			
@@ -808,7 +1927,7 @@ int lexer_run(lexer_t *lexer) {
 				token = lexer_read_string(lexer);
 			}
 			
-			if (isdigit(cur)) {
+			if (lexer_is_digit(cur)) {
 				token = lexer_read_number(lexer);
 			}
 			
@@ -825,7 +1944,7 @@ int lexer_run(lexer_t *lexer) {
 			}
 		}
 		
-		if (cur == '_' || isalpha(cur)) {
+		if (lexer_is_word_start(lexer, mark.place)) {
 			token = lexer_read_word(lexer);
 		}
 		
@@ -835,7 +1954,7 @@ int lexer_run(lexer_t *lexer) {
 					lexer_next(lexer);
 				}
 				
-				if ((cur = lexer_current(lexer)) == '_' || isalpha(cur)) {
+				if (lexer_is_word_start(lexer, lexer->current.place)) {
 					token_mark_t next_mark = lexer_mark(lexer);
 					token_t next = lexer_read_word(lexer);
 					if (next.kind == TOK_REM_KW) {
@@ -848,97 +1967,1745 @@ int lexer_run(lexer_t *lexer) {
 			}
 			
 			if (token.kind == TOK_ENDREM_KW) {
+				// an empty block (Rem and EndRem a line apart) would otherwise end before it begins
+				const char *from = comment.to + 1;
 				token_t block = {
 					.kind = TOK_BLOCK_COMMENT,
 					.line = comment.line,
 					.column = comment.column,
-					.from = comment.to + 1,
-					.to = token.from - 1,
+					.from = from,
+					.to = (token.from > from ? token.from - 1 : from),
 				};
+				LEXER_PROBE3(rem__end, LEXER_OFFSET(lexer, block.from),
+						(ptrdiff_t)(block.to-block.from), token.line);
 				comment.kind = TOK_INVALID;
 				*lexer_new_token(lexer) = block;
 			}
 			
 			if (token.kind == TOK_INVALID) {
+				if ((lexer_current(lexer) & 0x80) != 0) {
+					lexer_skip_utf8(lexer);
+				}
 				lexer_next(lexer);
 				lexer_skip_whitespace(lexer);
 			}
 		}
 		
+		if (token.kind != TOK_INVALID && comment.kind == TOK_INVALID &&
+			(lexer->options & LEXER_OPT_FOLD_CONTINUATIONS) != 0) {
+			if (token.kind == TOK_DOUBLEDOT && lexer_at_line_end(lexer)) {
+				continued = true;
+				continue;
+			}
+			if (continued && token.kind == TOK_NEWLINE) {
+				continued = false;
+				pending_flags |= TOKEN_FLAG_CONTINUED;
+				continue;
+			}
+			if (token.kind != TOK_LINE_COMMENT) {
+				token.flags |= pending_flags;
+				pending_flags = 0;
+			}
+		}
+		
 		if (token.kind != TOK_INVALID && comment.kind == TOK_INVALID) {
-			*lexer_new_token(lexer) = token;
+			lexer_add_token(lexer, &token);
+			
+			if (skip_pending && token.kind == TOK_NEWLINE) {
+				skip_pending = false;
+				lexer_skip_inactive(lexer);
+			}
 		}
 		
 		if (comment.kind == TOK_INVALID && token.kind == TOK_REM_KW) {
 			comment = token;
+			LEXER_PROBE2(rem__start, LEXER_OFFSET(lexer, comment.from), comment.line);
 		}
 		
 		if (comment.kind == TOK_INVALID && token.kind == TOK_INVALID && lexer->error == NULL) {
-			lexer_asprintf(&lexer->error, "[%d:%d] Invalid token: %c:%d\n",
-					lexer->current.line, lexer->current.column, cur, cur);
+			lexer_asprintf(&lexer->error, "[%lld:%lld] Invalid token: %c:%d\n",
+					(long long)lexer->current.line, (long long)lexer->current.column, cur, cur);
+			int length = lexer_utf8_length(lexer->current.place, lexer->source_end);
+			if (length < 0) {
+				lexer_add_diagnostic(lexer, LEXER_DIAG_INVALID_UTF8, (size_t)-length);
+			}
 		}
 		
 		if (lexer->error != NULL) {
+			LEXER_PROBE4(error, LEXER_OFFSET(lexer, lexer->current.place),
+					lexer->current.line, lexer->current.column, lexer->error);
+			LEXER_PROBE3(run__done, LEXER_OFFSET(lexer, lexer->current.place),
+					lexer->current.token, 1);
 			return 1;
 		}
 	}
 	
-	lexer_new_token(lexer)->kind = TOK_EOF;
+	// stopped early in a Rem block - keep the part of it that was read
+	if (comment.kind != TOK_INVALID && lexer->stop < lexer->source_end && lexer->stop <= lexer->current.place &&
+		comment.to < lexer->stop) {
+		token_t block = {
+			.kind = TOK_BLOCK_COMMENT,
+			.line = comment.line,
+			.column = comment.column,
+			.from = comment.to + 1,
+			.to = lexer->stop,
+		};
+		*lexer_new_token(lexer) = block;
+	}
 	
-	unsigned int tok_index = 0;
-	while (lexer->tokens[tok_index].kind != TOK_EOF) {
-		token_t left, right;
-		bool merged = false;
-		left = lexer->tokens[tok_index];
-		right = lexer->tokens[tok_index+1];
-		
-		const token_pair_t *pair_iter = token_pairs;
-		while (pair_iter->left != TOK_INVALID && !merged) {
-			if (pair_iter->left == left.kind && pair_iter->right == right.kind &&
-				right.from <= left.to+pair_iter->range) {
-				lexer_merge_tokens(lexer, tok_index, tok_index+1, pair_iter->kind);
-				merged = true;
-			}
-			++pair_iter;
-		}
-		
-		if (!merged)
-			++tok_index;
+	token_t *eof = lexer_new_token(lexer);
+	eof->kind = TOK_EOF;
+	if ((lexer->options & LEXER_OPT_FINGERPRINT) != 0) {
+		// nothing follows the end of file, so this only hashes an End that was held back
+		lexer_fingerprint_token(lexer, eof);
+	}
+	
+	if (lexer->error == NULL && (lexer->options & LEXER_OPT_DISCARD_TOKENS) == 0 && !lexer_match_blocks(lexer)) {
+		lexer_fail(lexer, "Out of memory for blocks");
+	}
+	
+	// the only errors that don't stop the loop above - running out of room for tokens or blocks
+	if (lexer->error != NULL) {
+		LEXER_PROBE4(error, LEXER_OFFSET(lexer, lexer->current.place),
+				lexer->current.line, lexer->current.column, lexer->error);
+		LEXER_PROBE3(run__done, LEXER_OFFSET(lexer, lexer->current.place),
+				lexer->current.token, 1);
+		return 1;
 	}
 	
+	LEXER_PROBE3(run__done, LEXER_OFFSET(lexer, lexer->current.place),
+			lexer->current.token, 0);
+	
 	return 0;
 }
 
-token_t *lexer_copy_tokens(lexer_t *lexer, int *num_tokens) {
-	if (lexer == NULL || num_tokens == NULL)
-		return NULL;
-	
-	int num = lexer->current.token;
-	token_t *tokens = (token_t*)calloc(lexer->current.token, sizeof(token_t));
-	memcpy(tokens, lexer->tokens, sizeof(token_t)*num);
-	*num_tokens = num;
-	return tokens;
+void lexer_cancel(lexer_t *lexer) {
+	if (lexer != NULL) {
+		atomic_store_explicit(&lexer->cancel, 1, memory_order_relaxed);
+	}
 }
 
-int lexer_get_num_tokens(lexer_t *lexer) {
-	return lexer->current.token;
+
+/* returns NULL if the block array can't grow */
+static block_t *lexer_new_block(lexer_t *lexer) {
+	if (lexer->num_blocks == lexer->blocks_capacity) {
+		// there's at most one block per token, so this can't overflow before the token array would have
+		size_t capacity = lexer->blocks_capacity*2;
+		if (capacity < 16) {
+			capacity = 16;
+		}
+		block_t *blocks = realloc(lexer->blocks, capacity*sizeof(block_t));
+		if (blocks == NULL) {
+			return NULL;
+		}
+		lexer->blocks = blocks;
+		lexer->blocks_capacity = capacity;
+	}
+	block_t *block = lexer->blocks+lexer->num_blocks;
+	++lexer->num_blocks;
+	block->kind = TOK_INVALID;
+	block->open = block->close = -1;
+	block->depth = 0;
+	return block;
 }
 
-token_kind_t lexer_get_token(lexer_t *lexer, int index, token_t *token) {
-	if (lexer == NULL) {
-		return TOK_INVALID;
+
+static bool token_ends_statement(token_kind_t kind) {
+	return (kind == TOK_NEWLINE || kind == TOK_SEMICOLON || kind == TOK_EOF || kind == TOK_LINE_COMMENT ||
+			kind == TOK_SKIPPED);
+}
+
+
+static bool token_ends_operand(token_kind_t kind) {
+	switch (kind) {
+		case TOK_ID: case TOK_NUMBER_LIT: case TOK_HEX_LIT: case TOK_BIN_LIT: case TOK_STRING_LIT:
+		case TOK_CLOSEPAREN: case TOK_CLOSEBRACKET:
+		case TOK_SELF_KW: case TOK_SUPER_KW: case TOK_NULL_KW: case TOK_PI_KW:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+static bool token_begins_operand(token_kind_t kind) {
+	switch (kind) {
+		case TOK_ID: case TOK_NUMBER_LIT: case TOK_HEX_LIT: case TOK_BIN_LIT: case TOK_STRING_LIT:
+		case TOK_SELF_KW: case TOK_SUPER_KW: case TOK_NULL_KW: case TOK_PI_KW: case TOK_NEW_KW:
+			return true;
+		default:
+			return false;
 	}
+}
+
+
+/*
+decides whether the opening keyword at index actually opens a block - it has
+to start a statement, If only opens a block if nothing follows its condition
+(and Then) on the same line, and Function/Method don't open blocks when
+they're abstract or declared inside an Extern/Protocol
+*/
+static bool lexer_opens_block(lexer_t *lexer, size_t index) {
+	token_kind_t kind = lexer_token_at(lexer, index)->kind;
 	
-	if (index < 0 || lexer->current.token <= index) {
-		if (token != NULL) {
-			token->kind = TOK_INVALID;
+	if (index > 0) {
+		token_kind_t prev = lexer_token_at(lexer, index-1)->kind;
+		if (prev != TOK_NEWLINE && prev != TOK_SEMICOLON && prev != TOK_BLOCK_COMMENT && prev != TOK_SKIPPED) {
+			return false;
 		}
-		return TOK_INVALID;
 	}
-	if (token != NULL) {
-		*token = lexer->tokens[index];
+	
+	if (kind == TOK_IF_KW) {
+		size_t iter = index+1;
+		for (; !token_ends_statement(lexer_token_at(lexer, iter)->kind); ++iter) {
+			token_kind_t cur = lexer_token_at(lexer, iter)->kind;
+			if (cur == TOK_THEN_KW || cur == TOK_ELSE_KW) {
+				return token_ends_statement(lexer_token_at(lexer, iter+1)->kind);
+			}
+			// an operand followed directly by another one ends the condition, e.g. If x Print y
+			if (iter > index+1 && token_ends_operand(lexer_token_at(lexer, iter-1)->kind) && token_begins_operand(cur)) {
+				return false;
+			}
+		}
+		return true;
 	}
-	return token->kind;
+	
+	if (kind == TOK_FUNCTION_KW || kind == TOK_METHOD_KW) {
+		size_t iter = index+1;
+		for (; !token_ends_statement(lexer_token_at(lexer, iter)->kind); ++iter) {
+			if (lexer_token_at(lexer, iter)->kind == TOK_ABSTRACT_KW) {
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+
+/* fills the block index - returns false if it runs out of memory */
+static bool lexer_match_blocks(lexer_t *lexer) {
+	size_t num_tokens = lexer->current.token;
+	size_t stack_capacity = 64;
+	size_t stack_size = 0;
+	size_t *stack = malloc(stack_capacity*sizeof(size_t));
+	int num_declarative = 0;	// Extern/Protocol blocks on the stack
+	if (stack == NULL) {
+		return false;
+	}
+	
+	size_t index = 0;
+	for (; index < num_tokens; ++index) {
+		token_kind_t kind = lexer_token_at(lexer, index)->kind;
+		const block_closer_t *closer = block_closers;
+		bool opens = false;
+		
+		while (closer->open != TOK_INVALID && closer->open != kind && closer->close != kind) {
+			++closer;
+		}
+		if (closer->open == TOK_INVALID || !lexer_opens_block(lexer, index)) {
+			continue;
+		}
+		
+		opens = (closer->open == kind);
+		
+		if (opens) {
+			if (num_declarative > 0 && (kind == TOK_FUNCTION_KW || kind == TOK_METHOD_KW)) {
+				continue;
+			}
+			
+			if (stack_size == stack_capacity) {
+				size_t *grown = realloc(stack, stack_capacity*2*sizeof(size_t));
+				if (grown == NULL) {
+					free(stack);
+					return false;
+				}
+				stack = grown;
+				stack_capacity *= 2;
+			}
+			
+			block_t *block = lexer_new_block(lexer);
+			if (block == NULL) {
+				free(stack);
+				return false;
+			}
+			block->kind = kind;
+			block->open = (int64_t)index;
+			block->depth = (int64_t)stack_size;
+			stack[stack_size++] = lexer->num_blocks-1;
+			if (kind == TOK_EXTERN_KW || kind == TOK_PROTOCOL_KW) {
+				++num_declarative;
+			}
+			continue;
+		}
+		
+		// find the nearest block this closes - anything opened after it is left unclosed, and depth is one past it
+		size_t depth = stack_size;
+		for (; depth > 0; --depth) {
+			token_kind_t open = lexer->blocks[stack[depth-1]].kind;
+			const block_closer_t *iter = block_closers;
+			while (iter->open != TOK_INVALID && (iter->open != open || iter->close != kind)) {
+				++iter;
+			}
+			if (iter->open != TOK_INVALID) {
+				break;
+			}
+		}
+		
+		if (depth == 0) {
+			block_t *block = lexer_new_block(lexer);
+			if (block == NULL) {
+				free(stack);
+				return false;
+			}
+			block->kind = closer->open;
+			block->close = (int64_t)index;
+			block->depth = (int64_t)stack_size;
+			continue;
+		}
+		
+		lexer->blocks[stack[depth-1]].close = (int64_t)index;
+		for (; stack_size >= depth; --stack_size) {
+			token_kind_t open = lexer->blocks[stack[stack_size-1]].kind;
+			if (open == TOK_EXTERN_KW || open == TOK_PROTOCOL_KW) {
+				--num_declarative;
+			}
+		}
+	}
+	
+	free(stack);
+	return true;
+}
+
+
+
+/*
+returns NULL and fails the outline run once there are as many declarations as
+lexer_get_decl can index, or if the declaration array can't grow
+*/
+static decl_t *lexer_new_decl(lexer_t *lexer, decl_kind_t kind, const char *from, const char *to, int64_t line,
+		int parent) {
+	// the outline scanner doesn't keep the lexer's position up to date, so errors are put on the declaration's line
+	if (lexer->num_decls == INT_MAX) {
+		lexer->current.line = line;
+		lexer->current.column = 1;
+		lexer_fail(lexer, "Too many declarations");
+		return NULL;
+	}
+	if (lexer->num_decls == lexer->decls_capacity) {
+		int capacity = (lexer->decls_capacity <= INT_MAX/2 ? lexer->decls_capacity*2 : INT_MAX);
+		if (capacity < 64) {
+			capacity = 64;
+		}
+		decl_t *decls = realloc(lexer->decls, (size_t)capacity*sizeof(decl_t));
+		if (decls == NULL) {
+			lexer->current.line = line;
+			lexer->current.column = 1;
+			lexer_fail(lexer, "Out of memory for declarations");
+			return NULL;
+		}
+		lexer->decls = decls;
+		lexer->decls_capacity = capacity;
+	}
+	decl_t *decl = lexer->decls+lexer->num_decls;
+	++lexer->num_decls;
+	decl->kind = kind;
+	decl->from = from;
+	decl->to = to;
+	decl->line = line;
+	decl->parent = parent;
+	return decl;
+}
+
+
+/*
+the outline scanner works on raw pointers rather than lexer_next/lexer_peek
+and only looks at the first word of each line - everything else on a line is
+skipped with memchr unless that word starts a declaration
+*/
+typedef struct s_outline {
+	const char *place, *end;
+	int64_t line;
+} outline_t;
+
+
+static bool outline_is_word_start(char cur) {
+	return (cur == '_' || lexer_is_alpha(cur));
+}
+
+
+static bool outline_is_word(char cur) {
+	return (cur == '_' || lexer_is_alpha(cur) || lexer_is_digit(cur));
+}
+
+
+static void outline_skip_spaces(outline_t *outline) {
+	const char *place = outline->place;
+	while (place < outline->end && (*place == ' ' || *place == '\t' || *place == '\r')) {
+		++place;
+	}
+	outline->place = place;
+}
+
+
+static void outline_skip_line(outline_t *outline) {
+	const char *newline = memchr(outline->place, '\n', (size_t)(outline->end-outline->place));
+	outline->place = (newline != NULL ? newline : outline->end);
+}
+
+
+static size_t outline_read_word(outline_t *outline, const char **from) {
+	const char *place = outline->place;
+	*from = place;
+	if (place >= outline->end || !outline_is_word_start(*place)) {
+		return 0;
+	}
+	while (place < outline->end && outline_is_word(*place)) {
+		++place;
+	}
+	outline->place = place;
+	return (size_t)(place-*from);
+}
+
+
+static bool outline_word_is(const char *word, size_t len, const char *keyword) {
+	return (strlen(keyword) == len && strncasecmp(word, keyword, len) == 0);
+}
+
+
+/* skips a Rem block the same way lexer_run does - the block ends on the first EndRem or End Rem word */
+static void outline_skip_rem(outline_t *outline) {
+	while (outline->place < outline->end) {
+		char cur = *outline->place;
+		if (cur == '\n') {
+			++outline->line;
+			++outline->place;
+			continue;
+		}
+		
+		if (!outline_is_word_start(cur)) {
+			++outline->place;
+			continue;
+		}
+		
+		const char *word;
+		size_t len = outline_read_word(outline, &word);
+		if (outline_word_is(word, len, "endrem")) {
+			return;
+		}
+		if (outline_word_is(word, len, "end")) {
+			if (outline->place < outline->end && *outline->place == ' ') {
+				++outline->place;
+			}
+			const char *next_place = outline->place;
+			len = outline_read_word(outline, &word);
+			if (outline_word_is(word, len, "rem")) {
+				return;
+			}
+			outline->place = next_place;
+		}
+	}
+}
+
+
+/* skips to the next comma outside of parentheses/brackets/strings in the current statement, returns false if there isn't one */
+static bool outline_skip_to_comma(outline_t *outline) {
+	int depth = 0;
+	while (outline->place < outline->end) {
+		char cur = *outline->place;
+		switch (cur) {
+			case '\n': case ';': case '\'':
+				return false;
+			case '"': {
+				const char *quote = outline->place+1;
+				while (quote < outline->end && *quote != '"' && *quote != '\n') {
+					++quote;
+				}
+				outline->place = (quote < outline->end && *quote == '"' ? quote+1 : quote);
+				continue;
+			}
+			case '.':
+				// line continuation
+				if (outline->place+1 < outline->end && outline->place[1] == '.') {
+					const char *newline = memchr(outline->place, '\n', (size_t)(outline->end-outline->place));
+					const char *iter = outline->place+2;
+					while (iter < outline->end && (*iter == ' ' || *iter == '\t' || *iter == '\r')) {
+						++iter;
+					}
+					if (newline != NULL && (iter == newline || *iter == '\'')) {
+						outline->place = newline+1;
+						++outline->line;
+						continue;
+					}
+				}
+				break;
+			case '(': case '[':
+				++depth;
+				break;
+			case ')': case ']':
+				--depth;
+				break;
+			case ',':
+				if (depth <= 0) {
+					++outline->place;
+					return true;
+				}
+				break;
+			default:
+				break;
+		}
+		++outline->place;
+	}
+	return false;
+}
+
+
+/* reads the name following a declaration keyword and records it */
+static int outline_read_decl(lexer_t *lexer, outline_t *outline, unsigned int kinds, decl_kind_t kind, int parent) {
+	const char *name;
+	outline_skip_spaces(outline);
+	size_t len = outline_read_word(outline, &name);
+	if (len == 0 || (kinds & kind) == 0) {
+		return -1;
+	}
+	if (lexer_new_decl(lexer, kind, name, name+len, outline->line, parent) == NULL) {
+		return -1;
+	}
+	return lexer->num_decls-1;
+}
+
+
+/* reads a module name (e.g. brl.blitz) or a quoted path following Import/Include/Framework/Module and records it */
+static void outline_read_import(lexer_t *lexer, outline_t *outline, unsigned int kinds, decl_kind_t kind) {
+	const char *from, *to;
+	outline_skip_spaces(outline);
+	if (outline->place >= outline->end || (kinds & kind) == 0) {
+		return;
+	}
+	
+	from = outline->place;
+	if (*from == '"') {
+		++from;
+		to = from;
+		while (to < outline->end && *to != '"' && *to != '\n') {
+			++to;
+		}
+		if (to >= outline->end || *to != '"') {
+			return;
+		}
+		outline->place = to+1;
+	} else {
+		to = from;
+		while (to < outline->end && (outline_is_word(*to) || *to == '.')) {
+			++to;
+		}
+		outline->place = to;
+	}
+	
+	if (from < to) {
+		lexer_new_decl(lexer, kind, from, to, outline->line, -1);
+	}
+}
+
+
+int lexer_run_outline(lexer_t *lexer, unsigned int kinds) {
+	if (lexer == NULL || lexer->error != NULL) {
+		return 1;
+	}
+	
+	outline_t outline = {
+		.place = lexer->current.place,
+		.end = lexer->source_end,
+		.line = lexer->current.line,
+	};
+	int type = -1;	// index of the enclosing Type's decl
+	bool in_type = false;
+	
+	while (outline.place < outline.end) {
+		const char *word;
+		size_t len;
+		
+		outline_skip_spaces(&outline);
+		len = outline_read_word(&outline, &word);
+		
+		if (len == 0) {
+			// blank line, comment, or a statement that can't declare anything
+		} else if (outline_word_is(word, len, "rem")) {
+			outline_skip_rem(&outline);
+		} else if (outline_word_is(word, len, "import")) {
+			do {
+				outline_read_import(lexer, &outline, kinds, DECL_IMPORT);
+			} while (outline_skip_to_comma(&outline));
+		} else if (outline_word_is(word, len, "include")) {
+			outline_read_import(lexer, &outline, kinds, DECL_INCLUDE);
+		} else if (outline_word_is(word, len, "framework")) {
+			outline_read_import(lexer, &outline, kinds, DECL_FRAMEWORK);
+		} else if (outline_word_is(word, len, "module")) {
+			outline_read_import(lexer, &outline, kinds, DECL_MODULE);
+		} else if ((kinds & DECL_HEADER_ONLY) != 0 &&
+				   !outline_word_is(word, len, "strict") && !outline_word_is(word, len, "superstrict") &&
+				   !outline_word_is(word, len, "moduleinfo")) {
+			// past the header - nothing that follows can be an Import
+			break;
+		} else if (outline_word_is(word, len, "type")) {
+			in_type = true;
+			type = outline_read_decl(lexer, &outline, kinds, DECL_TYPE, -1);
+			
+			outline_skip_spaces(&outline);
+			len = outline_read_word(&outline, &word);
+			if (outline_word_is(word, len, "extends")) {
+				outline_read_decl(lexer, &outline, kinds, DECL_EXTENDS, type);
+			}
+		} else if (outline_word_is(word, len, "endtype")) {
+			in_type = false;
+			type = -1;
+		} else if (outline_word_is(word, len, "end")) {
+			outline_skip_spaces(&outline);
+			len = outline_read_word(&outline, &word);
+			if (outline_word_is(word, len, "type")) {
+				in_type = false;
+				type = -1;
+			}
+		} else if (outline_word_is(word, len, "function")) {
+			outline_read_decl(lexer, &outline, kinds, DECL_FUNCTION, type);
+		} else if (outline_word_is(word, len, "method")) {
+			outline_read_decl(lexer, &outline, kinds, DECL_METHOD, type);
+		} else {
+			decl_kind_t kind = 0;
+			if (outline_word_is(word, len, "global")) {
+				kind = DECL_GLOBAL;
+			} else if (outline_word_is(word, len, "const")) {
+				kind = DECL_CONST;
+			} else if (in_type && outline_word_is(word, len, "field")) {
+				kind = DECL_FIELD;
+			}
+			
+			if (kind != 0 && (kinds & kind) != 0) {
+				do {
+					outline_read_decl(lexer, &outline, kinds, kind, type);
+				} while (outline_skip_to_comma(&outline));
+			}
+		}
+		
+		outline_skip_line(&outline);
+		if (outline.place < outline.end) {
+			++outline.place;
+			++outline.line;
+		}
+	}
+	
+	lexer->current.place = outline.end;
+	lexer->current.line = outline.line;
+	
+	// declarations are only dropped when lexer_new_decl fails
+	return (lexer->error != NULL ? 1 : 0);
+}
+
+
+#ifdef BMXLEXER_REFERENCE_ENGINE
+
+/*
+the reference engine is the original, unoptimized scanner and pair-merging
+pass, along with the helpers it calls - it is kept byte-for-byte as it was so
+that changes to lexer_run can be diffed against it (see lexer_compare, the
+fuzzer entry point below and lexer_check.c).  it only shares the token tables,
+the token storage and lexer_asprintf with lexer_run, so do not call the
+scanner's helpers from here, and do not "fix" or optimize anything in here.
+the only edits are for 64-bit positions, segmented storage and ctype.
+*/
+
+/*
+ctype in the C locale, which the original scanner relied on - kept local so
+the reference shares no classification with lexer_run and doesn't depend on
+the locale
+*/
+static bool lexer_reference_isdigit(char cur) {
+	return (cur >= '0' && cur <= '9');
+}
+
+
+static bool lexer_reference_isalpha(char cur) {
+	return ((cur >= 'a' && cur <= 'z') || (cur >= 'A' && cur <= 'Z'));
+}
+
+
+static bool lexer_reference_isalnum(char cur) {
+	return (lexer_reference_isdigit(cur) || lexer_reference_isalpha(cur));
+}
+
+
+static bool lexer_reference_isxdigit(char cur) {
+	return (lexer_reference_isdigit(cur) || (cur >= 'a' && cur <= 'f') || (cur >= 'A' && cur <= 'F'));
+}
+
+
+static char lexer_reference_tolower(char cur) {
+	return (cur >= 'A' && cur <= 'Z' ? (char)(cur-'A'+'a') : cur);
+}
+
+
+static token_t *lexer_reference_new_token(lexer_t *lexer) {
+	size_t index = lexer->current.token + 1;
+	token_t *token = &lexer->overflow;
+	if (index != 0 && lexer_tokens_fit(lexer, index+1)) {
+		token = lexer_token_at(lexer, lexer->current.token);
+		lexer->current.token = index;
+	} else if (lexer->error == NULL) {
+		lexer_asprintf(&lexer->error, "[%lld:%lld] Out of memory for tokens\n", (long long)lexer->current.line,
+			(long long)lexer->current.column);
+	}
+	token->kind = TOK_INVALID;
+	token->flags = 0;
+	token->from = token->to = NULL;
+	token->line = 0;
+	token->column = 0;
+	return token;
+}
+
+
+static token_t *lexer_reference_merge_tokens(lexer_t *lexer, size_t from, size_t to, token_kind_t newKind) {
+	lexer_token_at(lexer, from)->to = lexer_token_at(lexer, to)->to;
+	lexer_token_at(lexer, from)->kind = newKind;
+	size_t offset = to - from;
+	size_t idx = to+1;
+	for (; idx < lexer->current.token; ++idx)
+		*lexer_token_at(lexer, idx-offset) = *lexer_token_at(lexer, idx);
+	lexer->current.token -= offset;
+	
+	return NULL;
+}
+
+
+static token_mark_t lexer_reference_mark(lexer_t *lexer) {
+	return lexer->current;
+}
+
+
+static void lexer_reference_reset(lexer_t *lexer, token_mark_t mark) {
+	lexer->current = mark;
+}
+
+
+static char lexer_reference_current(lexer_t *lexer) {
+	if (lexer->source_end < lexer->current.place)
+		return 0;
+	return *(lexer->current.place);
+}
+
+
+static bool lexer_reference_has_next(lexer_t *lexer) {
+	return (bool)((lexer->current.place) < lexer->source_end);
+}
+
+
+static char lexer_reference_next(lexer_t *lexer) {
+	if (lexer_reference_current(lexer) == '\n') {
+		lexer->current.line += 1;
+		lexer->current.column = 1;
+	} else {
+		++lexer->current.column;
+	}
+	return lexer_reference_has_next(lexer) ? *(++lexer->current.place) : 0;
+}
+
+
+static char lexer_reference_peek(lexer_t *lexer) {
+	return lexer_reference_has_next(lexer) ? *(lexer->current.place+1) : 0;
+}
+
+
+static void lexer_reference_skip_whitespace(lexer_t *lexer) {
+	char cur;
+	while ((cur = lexer_reference_current(lexer)) != 0 &&
+		   (cur == ' ' || cur == '\t' || cur == '\r')) {
+		lexer_reference_next(lexer);
+	}
+}
+
+
+static token_t lexer_reference_read_base_number(lexer_t *lexer) {
+	char cur = lexer_reference_current(lexer);
+	token_mark_t mark = lexer_reference_mark(lexer);
+	token_t token = {
+		.kind = TOK_NUMBER_LIT,
+		.line = mark.line,
+		.column = mark.column,
+		.from = mark.place,
+		.to = NULL,
+	};
+	
+	if (cur == '%') {	// bin
+		// the original's precedence, only made explicit
+		while ((lexer_reference_has_next(lexer) && (cur = lexer_reference_next(lexer)) == '0') || cur == '1');
+	} else if (cur == '$') {	// hex
+		while (lexer_reference_has_next(lexer) && lexer_reference_isxdigit(lexer_reference_next(lexer)));
+	} else {
+		lexer_asprintf(&lexer->error, "[%lld:%lld] Malformed number literal encountered, not a number\n",
+				(long long)lexer->current.line, (long long)lexer->current.column);
+		token.kind = TOK_INVALID;
+		return token;
+	}
+	
+	lexer_reference_next(lexer);
+	token.to = lexer->current.place;
+	
+	return token;
+}
+
+
+static token_kind_t lexer_reference_kind_for_single(const char *single, size_t len) {
+	const token_single_t* iter = token_singles;
+	while (iter->kind != TOK_INVALID) {
+		if (strlen(iter->matches) == len && ((iter->case_sensitive
+			 ? strncmp(iter->matches, single, len)
+			 : strncasecmp(iter->matches, single, len)) == 0)) {
+				break;
+			}
+		++iter;
+	}
+	return iter->kind;
+}
+
+
+static token_t lexer_reference_read_number(lexer_t *lexer) {
+	char cur = lexer_reference_current(lexer);
+	token_mark_t mark = lexer_reference_mark(lexer);
+	bool isDec = (cur == '.');
+	bool isExp = false;
+	token_t token = {
+		.kind = TOK_NUMBER_LIT,
+		.line = mark.line,
+		.column = mark.column,
+		.from = mark.place,
+		.to = NULL,
+	};
+	
+	while (lexer_reference_has_next(lexer) && (cur = lexer_reference_next(lexer)) != 0) {
+		if (cur == '.') {
+			if (isDec) {
+				break;
+			}
+			isDec = true;
+			continue;
+		}
+		
+		if (lexer_reference_isdigit(cur)) {
+			continue;
+		}
+		
+		if (lexer_reference_tolower(cur) == 'e') {
+			if (isExp) {
+				lexer_asprintf(&lexer->error, "[%lld:%lld] Malformed number literal encountered, exponent already provided\n",
+						(long long)lexer->current.line, (long long)lexer->current.column);
+				token.kind = TOK_INVALID;
+				return token;
+			}
+			
+			isExp = true;
+			cur = lexer_reference_peek(lexer);
+			if (cur == '-' || cur == '+') {
+				lexer_reference_next(lexer);
+				cur = lexer_reference_peek(lexer);
+			}
+			if (!lexer_reference_isdigit(cur)) {
+				lexer_asprintf(&lexer->error, "[%lld:%lld] Malformed number literal encountered, exponent expected but not found (%c:%d)\n",
+						(long long)lexer->current.line, (long long)lexer->current.column, cur, cur);
+				token.kind = TOK_INVALID;
+				return token;
+			}
+			continue;
+		}
+		
+		break;
+	}
+	
+	token.to = lexer->current.place;
+	
+	return token;
+}
+
+
+static token_t lexer_reference_read_word(lexer_t *lexer) {
+	token_mark_t mark = lexer_reference_mark(lexer);
+	token_t token = {
+		.kind = TOK_ID,
+		.line = mark.line,
+		.column = mark.column,
+		.from = mark.place,
+		.to = NULL,
+	};
+	
+	while (lexer_reference_has_next(lexer)) {
+		char cur = lexer_reference_peek(lexer);
+		if (cur != '_' && !lexer_reference_isalnum(cur)) {
+			break;
+		}
+		lexer_reference_next(lexer);
+	}
+	
+	lexer_reference_next(lexer);
+	token.to = lexer->current.place;
+	
+	token_kind_t alter = lexer_reference_kind_for_single(token.from, (size_t)(token.to-token.from));
+	if (alter != TOK_INVALID) {
+		token.kind = alter;
+	}
+	
+	return token;
+}
+
+
+static token_t lexer_reference_read_string(lexer_t *lexer) {
+	char cur = lexer_reference_current(lexer);
+	token_mark_t mark = lexer_reference_mark(lexer);
+	token_t token = {
+		.kind = TOK_STRING_LIT,
+		.line = mark.line,
+		.column = mark.column,
+		.from = mark.place,
+		.to = NULL,
+	};
+	
+	while (lexer_reference_has_next(lexer) && (cur = lexer_reference_next(lexer)) != '"') {
+		if (cur == '\n') {
+			lexer_asprintf(&lexer->error, "[%lld:%lld] String literal does not terminate before newline or EOF\n",
+					(long long)lexer->current.line, (long long)lexer->current.column);
+			token.kind = TOK_INVALID;
+			return token;
+		}
+	}
+	lexer_reference_next(lexer);
+	token.to = lexer->current.place;
+	
+	return token;
+}
+
+
+static token_t lexer_reference_read_line_comment(lexer_t *lexer) {
+	char cur = lexer_reference_current(lexer);
+	token_mark_t mark = lexer_reference_mark(lexer);
+	token_t token = {
+		.kind = TOK_LINE_COMMENT,
+		.line = mark.line,
+		.column = mark.column,
+		.from = mark.place,
+		.to = NULL,
+	};
+	
+	do {
+		cur = lexer_reference_next(lexer);
+	} while(cur != 0 && cur != '\n');
+	
+	token.to = lexer->current.place;
+	
+	return token;
+}
+
+
+int lexer_run_reference(lexer_t *lexer) {
+	if (lexer == NULL || lexer->error != NULL) {
+		return 1;
+	}
+	
+	token_mark_t mark;
+	token_t comment = {.kind=TOK_INVALID};
+	token_t token = {.flags=0};
+	char cur;
+	
+	while(lexer_reference_current(lexer) != 0) {
+		token.kind = TOK_INVALID;
+		lexer_reference_skip_whitespace(lexer);
+		
+		mark = lexer_reference_mark(lexer);
+		if ((cur = lexer_reference_current(lexer)) == 0) {
+			break;
+		}
+		
+		if (comment.kind == TOK_INVALID) {
+			
+			if (cur == '@') {
+				token.kind = TOK_AT;
+				if (lexer_reference_next(lexer) == '@') {
+					token.kind = TOK_DOUBLEAT;
+					lexer_reference_next(lexer);
+				}
+				
+				token.from = mark.place;
+				token.to = lexer->current.place;
+				token.line = mark.line;
+				token.column = mark.column;
+			}
+			
+			if (cur == '.') {
+				if (lexer_reference_isdigit(lexer_reference_peek(lexer))) {
+					token = lexer_reference_read_number(lexer);
+				} else {
+					token.kind = TOK_DOT;
+					
+#ifdef BMAX_USE_ADDITIONS
+					while(token.kind <= TOK_TRIPLEDOT && lexer_reference_next(lexer) == '.') {
+						++token.kind;
+					}
+#else
+					while(token.kind <= TOK_DOUBLEDOT && lexer_reference_next(lexer) == '.') {
+						++token.kind;
+					}
+#endif
+					token.from = mark.place;
+					token.to = lexer->current.place;
+					token.line = mark.line;
+					token.column = mark.column;
+				}
+			}
+			
+			if (cur == '\'') {
+				token = lexer_reference_read_line_comment(lexer);
+			}
+			
+			if (cur == '%') {
+				char peek = lexer_reference_peek(lexer);
+				if (peek == '1' || peek == '0') {
+					token = lexer_reference_read_base_number(lexer);
+				}
+			}
+			
+			if (cur == '$' && lexer_reference_isxdigit(lexer_reference_peek(lexer))) {
+				token = lexer_reference_read_base_number(lexer);
+			}
+			
+			if (cur == '"') {
+				token = lexer_reference_read_string(lexer);
+			}
+			
+			if (lexer_reference_isdigit(cur)) {
+				token = lexer_reference_read_number(lexer);
+			}
+			
+			if (token.kind == TOK_INVALID) {
+				token_kind_t alter = lexer_reference_kind_for_single(&cur, 1);
+				if (alter != TOK_INVALID) {
+					token.kind = alter;
+					token.from = mark.place;
+					token.line = mark.line;
+					token.column = mark.column;
+					lexer_reference_next(lexer);
+					token.to = lexer->current.place;
+				}
+			}
+		}
+		
+		if (cur == '_' || lexer_reference_isalpha(cur)) {
+			token = lexer_reference_read_word(lexer);
+		}
+		
+		if (comment.kind != TOK_INVALID) {
+			if (token.kind == TOK_END_KW) {
+				if (lexer_reference_current(lexer) == ' ') {
+					lexer_reference_next(lexer);
+				}
+				
+				if ((cur = lexer_reference_current(lexer)) == '_' || lexer_reference_isalpha(cur)) {
+					token_mark_t next_mark = lexer_reference_mark(lexer);
+					token_t next = lexer_reference_read_word(lexer);
+					if (next.kind == TOK_REM_KW) {
+						token.kind = TOK_ENDREM_KW;
+						token.to = next.to;
+					} else {
+						lexer_reference_reset(lexer, next_mark);
+					}
+				}
+			}
+			
+			if (token.kind == TOK_ENDREM_KW) {
+				token_t block = {
+					.kind = TOK_BLOCK_COMMENT,
+					.line = comment.line,
+					.column = comment.column,
+					.from = comment.to + 1,
+					.to = token.from - 1,
+				};
+				comment.kind = TOK_INVALID;
+				*lexer_reference_new_token(lexer) = block;
+			}
+			
+			if (token.kind == TOK_INVALID) {
+				lexer_reference_next(lexer);
+				lexer_reference_skip_whitespace(lexer);
+			}
+		}
+		
+		if (token.kind != TOK_INVALID && comment.kind == TOK_INVALID) {
+			*lexer_reference_new_token(lexer) = token;
+		}
+		
+		if (comment.kind == TOK_INVALID && token.kind == TOK_REM_KW) {
+			comment = token;
+		}
+		
+		if (comment.kind == TOK_INVALID && token.kind == TOK_INVALID && lexer->error == NULL) {
+			lexer_asprintf(&lexer->error, "[%lld:%lld] Invalid token: %c:%d\n",
+					(long long)lexer->current.line, (long long)lexer->current.column, cur, cur);
+		}
+		
+		if (lexer->error != NULL) {
+			return 1;
+		}
+	}
+	
+	lexer_reference_new_token(lexer)->kind = TOK_EOF;
+	// the EOF token went to the overflow token, so there's nothing to stop the merge pass
+	if (lexer->error != NULL) {
+		return 1;
+	}
+	
+	size_t tok_index = 0;
+	while (lexer_token_at(lexer, tok_index)->kind != TOK_EOF) {
+		token_t left, right;
+		bool merged = false;
+		left = *lexer_token_at(lexer, tok_index);
+		right = *lexer_token_at(lexer, tok_index+1);
+		
+		const token_pair_t *pair_iter = token_pairs;
+		while (pair_iter->left != TOK_INVALID && !merged) {
+			if (pair_iter->left == left.kind && pair_iter->right == right.kind &&
+				right.from <= left.to+pair_iter->range) {
+				lexer_reference_merge_tokens(lexer, tok_index, tok_index+1, pair_iter->kind);
+				merged = true;
+			}
+			++pair_iter;
+		}
+		
+		if (!merged)
+			++tok_index;
+	}
+	
+	return 0;
+}
+
+
+/*
+reads the token at *index with every pair after it merged in, the way
+lexer_add_token would have - a failed reference run stops before its merge
+pass, so failed runs are compared through this
+*/
+static token_t lexer_compare_next(lexer_t *lexer, size_t *index) {
+	token_t token = *lexer_token_at(lexer, *index);
+	++*index;
+	
+	while (*index < lexer->current.token) {
+		const token_t *next = lexer_token_at(lexer, *index);
+		const token_pair_t *pair_iter = token_pairs;
+		while (pair_iter->left != TOK_INVALID && !(pair_iter->left == token.kind && pair_iter->right == next->kind &&
+			next->from <= token.to+pair_iter->range)) {
+			++pair_iter;
+		}
+		if (pair_iter->left == TOK_INVALID) {
+			break;
+		}
+		token.kind = pair_iter->kind;
+		token.to = next->to;
+		++*index;
+	}
+	return token;
+}
+
+
+int64_t lexer_compare(lexer_t *lexer, lexer_t *other) {
+	if (lexer == NULL || other == NULL) {
+		return -2;
+	}
+	
+	const char *error = lexer->error != NULL ? lexer->error : "";
+	const char *other_error = other->error != NULL ? other->error : "";
+	if (strcmp(error, other_error) != 0) {
+		return -2;
+	}
+	bool failed = (*error != 0);
+	
+	size_t lexer_index = 0, other_index = 0;
+	int64_t index = 0;
+	for (; lexer_index < lexer->current.token && other_index < other->current.token; ++index) {
+		token_t left_token, right_token;
+		if (failed) {
+			left_token = lexer_compare_next(lexer, &lexer_index);
+			right_token = lexer_compare_next(other, &other_index);
+		} else {
+			left_token = *lexer_token_at(lexer, lexer_index++);
+			right_token = *lexer_token_at(other, other_index++);
+		}
+		const token_t *left = &left_token;
+		const token_t *right = &right_token;
+		if (left->kind != right->kind || left->flags != right->flags ||
+			left->line != right->line || left->column != right->column ||
+			(left->from == NULL) != (right->from == NULL) ||
+			(left->to == NULL) != (right->to == NULL)) {
+			return index;
+		}
+		
+		if ((left->from != NULL &&
+			 LEXER_OFFSET(lexer, left->from) != LEXER_OFFSET(other, right->from)) ||
+			(left->to != NULL &&
+			 LEXER_OFFSET(lexer, left->to) != LEXER_OFFSET(other, right->to))) {
+			return index;
+		}
+		
+		if (left->from != NULL && left->to != NULL && left->from < left->to &&
+			memcmp(left->from, right->from, (size_t)(left->to-left->from)) != 0) {
+			return index;
+		}
+	}
+	
+	if (lexer_index < lexer->current.token || other_index < other->current.token) {
+		return index;
+	}
+	
+	return -1;
+}
+
+
+#ifdef BMXLEXER_FUZZ
+
+/*
+the reference engine predates the options, so runs without conditionals or
+UTF-8 identifiers are checked against it, with .. folded into its tokens
+afterwards where needed - every run is also checked against lexing the same
+source in small slices and against resuming it from a checkpoint
+*/
+static const unsigned int lexer_fuzz_options[] = {
+	0,
+	LEXER_OPT_FOLD_CONTINUATIONS,
+	LEXER_OPT_CONDITIONALS,
+	LEXER_OPT_CONDITIONALS | LEXER_OPT_FOLD_CONTINUATIONS | LEXER_OPT_UTF8_IDENTIFIERS,
+};
+
+static lexer_t *lexer_fuzz_new(const char *begin, const char *end, unsigned int options);
+static const char *lexer_fuzz_changed(lexer_t *reference);
+static void lexer_fuzz_fold(lexer_t *lexer);
+static void lexer_fuzz_check(lexer_t *lexer, lexer_t *other, const char *against, unsigned int options);
+static void lexer_fuzz_check_reference(lexer_t *lexer, const char *begin, const char *end, unsigned int options);
+
+
+static lexer_t *lexer_fuzz_new(const char *begin, const char *end, unsigned int options) {
+	lexer_t *lexer = lexer_new(begin, end);
+	lexer_set_options(lexer, options);
+	lexer_define(lexer, "Debug");
+	lexer_set_checkpoints(lexer, 1, 0);
+	return lexer;
+}
+
+
+/*
+returns where the first token of a reference run that lexer_run deliberately
+lexes differently begins, or NULL if there's none - currently only $ and %
+literals, which the reference lets swallow the character after them (empty
+Rem blocks are changed too, but lexer_fuzz_check_reference evens those out)
+*/
+static const char *lexer_fuzz_changed(lexer_t *reference) {
+	size_t index = 0;
+	for (; index < reference->current.token; ++index) {
+		const token_t *token = lexer_token_at(reference, index);
+		if (token->kind != TOK_NUMBER_LIT || token->from == NULL || token->to == NULL || token->to-token->from < 2) {
+			continue;
+		}
+		char last = token->to[-1];
+		if ((token->from[0] == '$' && !lexer_is_xdigit(last)) ||
+			(token->from[0] == '%' && last != '0' && last != '1')) {
+			return token->from;
+		}
+	}
+	return NULL;
+}
+
+
+/* does to a reference run's tokens what LEXER_OPT_FOLD_CONTINUATIONS does while lexing */
+static void lexer_fuzz_fold(lexer_t *lexer) {
+	size_t from = 0, to = 0;
+	int pending_flags = 0;
+	bool continued = false;
+	for (; from < lexer->current.token; ++from) {
+		token_t token = *lexer_token_at(lexer, from);
+		if (token.kind == TOK_DOUBLEDOT) {
+			const char *place = token.to;
+			while (place < lexer->source_end && (*place == ' ' || *place == '\t' || *place == '\r')) {
+				++place;
+			}
+			if (place >= lexer->source_end || *place == '\n' || *place == '\'') {
+				continued = true;
+				continue;
+			}
+		}
+		if (continued && token.kind == TOK_NEWLINE) {
+			continued = false;
+			pending_flags |= TOKEN_FLAG_CONTINUED;
+			continue;
+		}
+		if (token.kind != TOK_LINE_COMMENT && token.kind != TOK_EOF) {
+			token.flags |= pending_flags;
+			pending_flags = 0;
+		}
+		*lexer_token_at(lexer, to++) = token;
+	}
+	lexer->current.token = to;
+}
+
+
+static void lexer_fuzz_check(lexer_t *lexer, lexer_t *other, const char *against, unsigned int options) {
+	int64_t index = lexer_compare(lexer, other);
+	if (index == -2) {
+		fprintf(stderr, "errors differ from %s with options %#x:\n%s%s", against, options,
+			(lexer->error != NULL ? lexer->error : "(none)\n"), (other->error != NULL ? other->error : "(none)\n"));
+		abort();
+	} else if (index != -1) {
+		fprintf(stderr, "token streams differ from %s at token %lld with options %#x\n", against, (long long)index,
+			options);
+		abort();
+	}
+}
+
+
+/*
+checks lexer against the reference engine - if the source has something
+lexer_run deliberately lexes differently, both engines are compared on the
+source up to there instead
+*/
+static void lexer_fuzz_check_reference(lexer_t *lexer, const char *begin, const char *end, unsigned int options) {
+	lexer_t *reference = lexer_new(begin, end);
+	lexer_run_reference(reference);
+	
+	const char *changed = lexer_fuzz_changed(reference);
+	if (changed != NULL) {
+		lexer_destroy(reference);
+		size_t size = (size_t)(changed-begin);
+		char *prefix = (char*)malloc(size+1);
+		memcpy(prefix, begin, size);
+		prefix[size] = 0;
+		
+		lexer_t *truncated = lexer_fuzz_new(prefix, prefix+size, options);
+		lexer_run(truncated);
+		lexer_fuzz_check_reference(truncated, prefix, prefix+size, options);
+		lexer_destroy(truncated);
+		free(prefix);
+		return;
+	}
+	
+	// lexer_run gives empty Rem blocks an empty range, where the reference's ends one character before it begins
+	size_t index = 0;
+	for (; index < reference->current.token; ++index) {
+		token_t *token = lexer_token_at(reference, index);
+		if (token->kind == TOK_BLOCK_COMMENT && token->to < token->from) {
+			token->to = token->from;
+		}
+	}
+	
+	if ((options & LEXER_OPT_FOLD_CONTINUATIONS) != 0) {
+		lexer_fuzz_fold(reference);
+	}
+	lexer_fuzz_check(lexer, reference, "the reference engine", options);
+	lexer_destroy(reference);
+}
+
+
+/*
+libFuzzer entry point: lexes the input with each set of options above and
+aborts on the first difference.  build with something along the lines of
+	clang -fsanitize=fuzzer,address -DBMXLEXER_REFERENCE_ENGINE -DBMXLEXER_FUZZ lexer.c
+and seed the corpus directory with BlitzMax sources.
+*/
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+	// the scanner reads the byte at source_end, so give it a terminated copy
+	char *begin = (char*)malloc(size+1);
+	memcpy(begin, data, size);
+	begin[size] = 0;
+	char *end = begin+size;
+	
+	size_t option = 0;
+	for (; option < sizeof(lexer_fuzz_options)/sizeof(lexer_fuzz_options[0]); ++option) {
+		unsigned int options = lexer_fuzz_options[option];
+		lexer_t *lexer = lexer_fuzz_new(begin, end, options);
+		lexer_run(lexer);
+		
+		if ((options & (LEXER_OPT_CONDITIONALS | LEXER_OPT_UTF8_IDENTIFIERS)) == 0) {
+			lexer_fuzz_check_reference(lexer, begin, end, options);
+		}
+		
+		lexer_t *sliced = lexer_fuzz_new(begin, end, options);
+		while (lexer_run_for(sliced, 3) == LEXER_RUN_PENDING) {
+		}
+		lexer_fuzz_check(lexer, sliced, "lexing in slices", options);
+		lexer_destroy(sliced);
+		
+		int num_checkpoints = lexer_get_num_checkpoints(lexer);
+		if (num_checkpoints > 0) {
+			lexer_t *resumed = lexer_fuzz_new(begin, end, options);
+			lexer_run(resumed);
+			lexer_resume(resumed, num_checkpoints/2, begin, end);
+			lexer_fuzz_check(lexer, resumed, "resuming from a checkpoint", options);
+			lexer_destroy(resumed);
+		}
+		
+		lexer_destroy(lexer);
+	}
+	
+	free(begin);
+	return 0;
+}
+
+#endif /* BMXLEXER_FUZZ */
+
+#endif /* BMXLEXER_REFERENCE_ENGINE */
+
+token_t *lexer_copy_tokens(lexer_t *lexer, size_t *num_tokens) {
+	if (lexer == NULL || num_tokens == NULL)
+		return NULL;
+	
+	size_t num = lexer->current.token;
+	token_t *tokens = (token_t*)calloc(lexer->current.token, sizeof(token_t));
+	size_t index = 0;
+	while (tokens != NULL && index < num) {
+		size_t count;
+		const token_t *span = lexer_get_token_span(lexer, index, &count);
+		memcpy(tokens+index, span, sizeof(token_t)*count);
+		index += count;
+	}
+	*num_tokens = num;
+	return tokens;
+}
+
+const token_t *lexer_get_tokens(lexer_t *lexer, size_t *num_tokens) {
+	if (lexer == NULL) {
+		return NULL;
+	}
+	if (num_tokens != NULL) {
+		*num_tokens = lexer->current.token;
+	}
+	return (lexer->segmented ? NULL : lexer->tokens);
+}
+
+const token_t *lexer_get_token_span(lexer_t *lexer, size_t index, size_t *count) {
+	if (lexer == NULL || lexer->current.token <= index) {
+		if (count != NULL) {
+			*count = 0;
+		}
+		return NULL;
+	}
+	
+	size_t contiguous = lexer->current.token-index;
+	if (lexer->segmented && LEXER_SEGMENT_SIZE-(index & (LEXER_SEGMENT_SIZE-1)) < contiguous) {
+		contiguous = LEXER_SEGMENT_SIZE-(index & (LEXER_SEGMENT_SIZE-1));
+	}
+	if (count != NULL) {
+		*count = contiguous;
+	}
+	return lexer_token_at(lexer, index);
+}
+
+size_t lexer_get_num_tokens(lexer_t *lexer) {
+	return lexer->current.token;
+}
+
+int lexer_get_num_tokens32(lexer_t *lexer) {
+	return (lexer->current.token <= INT_MAX ? (int)lexer->current.token : -1);
+}
+
+token_kind_t lexer_get_token(lexer_t *lexer, size_t index, token_t *token) {
+	if (lexer == NULL) {
+		return TOK_INVALID;
+	}
+	
+	if (lexer->current.token <= index) {
+		if (token != NULL) {
+			token->kind = TOK_INVALID;
+		}
+		return TOK_INVALID;
+	}
+	if (token != NULL) {
+		*token = *lexer_token_at(lexer, index);
+	}
+	return token->kind;
+}
+
+token_kind_t lexer_get_token32(lexer_t *lexer, int index, token_t *token) {
+	if (index < 0) {
+		if (token != NULL) {
+			token->kind = TOK_INVALID;
+		}
+		return TOK_INVALID;
+	}
+	return lexer_get_token(lexer, (size_t)index, token);
+}
+
+size_t lexer_get_num_blocks(lexer_t *lexer) {
+	return lexer->num_blocks;
+}
+
+token_kind_t lexer_get_block(lexer_t *lexer, size_t index, block_t *block) {
+	if (lexer == NULL || lexer->num_blocks <= index) {
+		if (block != NULL) {
+			block->kind = TOK_INVALID;
+			block->open = block->close = -1;
+			block->depth = 0;
+		}
+		return TOK_INVALID;
+	}
+	if (block != NULL) {
+		*block = lexer->blocks[index];
+	}
+	return lexer->blocks[index].kind;
+}
+
+int64_t lexer_get_token_block(lexer_t *lexer, size_t token_index) {
+	if (lexer == NULL || lexer->current.token <= token_index) {
+		return -1;
+	}
+	
+	if (lexer->token_blocks == NULL) {
+		int64_t *token_blocks = malloc(lexer->current.token*sizeof(int64_t));
+		if (token_blocks == NULL) {
+			return -1;
+		}
+		size_t index = 0;
+		for (; index < lexer->current.token; ++index) {
+			token_blocks[index] = -1;
+		}
+		for (index = 0; index < lexer->num_blocks; ++index) {
+			const block_t *block = lexer->blocks+index;
+			if (block->open != -1) {
+				token_blocks[block->open] = (int64_t)index;
+			}
+			if (block->close != -1) {
+				token_blocks[block->close] = (int64_t)index;
+			}
+		}
+		lexer->token_blocks = token_blocks;
+	}
+	
+	return lexer->token_blocks[token_index];
+}
+
+size_t lexer_get_num_unbalanced_blocks(lexer_t *lexer) {
+	size_t count = 0;
+	size_t index = 0;
+	for (; index < lexer->num_blocks; ++index) {
+		if (lexer->blocks[index].open == -1 || lexer->blocks[index].close == -1) {
+			++count;
+		}
+	}
+	return count;
+}
+
+int lexer_get_num_decls(lexer_t *lexer) {
+	return lexer->num_decls;
+}
+
+decl_kind_t lexer_get_decl(lexer_t *lexer, int index, decl_t *decl) {
+	if (lexer == NULL || index < 0 || lexer->num_decls <= index) {
+		return 0;
+	}
+	if (decl != NULL) {
+		*decl = lexer->decls[index];
+	}
+	return lexer->decls[index].kind;
+}
+
+int lexer_get_num_checkpoints(lexer_t *lexer) {
+	return (lexer != NULL ? lexer->num_checkpoints : 0);
+}
+
+int lexer_get_checkpoint(lexer_t *lexer, int index, lexer_checkpoint_t *checkpoint) {
+	if (lexer == NULL || index < 0 || lexer->num_checkpoints <= index) {
+		return -1;
+	}
+	if (checkpoint != NULL) {
+		*checkpoint = lexer->checkpoints[index];
+	}
+	return 0;
+}
+
+int lexer_find_checkpoint(lexer_t *lexer, int64_t line) {
+	if (lexer == NULL) {
+		return -1;
+	}
+	
+	// checkpoints are in source order - find the last one at or before the beginning of the line
+	int low = 0;
+	int high = lexer->num_checkpoints;
+	while (low < high) {
+		int mid = low+(high-low)/2;
+		const lexer_checkpoint_t *checkpoint = lexer->checkpoints+mid;
+		if (checkpoint->line < line || (checkpoint->line == line && checkpoint->column == 1)) {
+			low = mid+1;
+		} else {
+			high = mid;
+		}
+	}
+	return low-1;
+}
+
+int lexer_resume(lexer_t *lexer, int checkpoint, const char *source_begin, const char *source_end) {
+	if (lexer == NULL || checkpoint < 0 || lexer->num_checkpoints <= checkpoint ||
+		source_begin == NULL || source_end < source_begin) {
+		return 1;
+	}
+	
+	lexer_checkpoint_t resume = lexer->checkpoints[checkpoint];
+	if ((size_t)(source_end-source_begin) < resume.offset) {
+		return 1;
+	}
+	
+	// the tokens before the checkpoint are kept, so move them along with the source
+	if (source_begin != lexer->source_begin) {
+		size_t index = 0;
+		for (; index < resume.token; ++index) {
+			token_t *token = lexer_token_at(lexer, index);
+			if (token->from != NULL) {
+				token->from = source_begin+LEXER_OFFSET(lexer, token->from);
+			}
+			if (token->to != NULL) {
+				token->to = source_begin+LEXER_OFFSET(lexer, token->to);
+			}
+		}
+	}
+	
+	lexer->source_begin = source_begin;
+	lexer->source_end = lexer->stop = source_end;
+	lexer->current.token = resume.token;
+	lexer->num_checkpoints = checkpoint+1;
+	if ((lexer->options & LEXER_OPT_FINGERPRINT) != 0) {
+		// the last kept token could still be merged with the next, so it's hashed once that's known
+		lexer_fingerprint_reset(lexer);
+		size_t index = 0;
+		for (; index+1 < resume.token; ++index) {
+			lexer_fingerprint_token(lexer, lexer_token_at(lexer, index));
+		}
+	}
+	while (lexer->num_diagnostics > 0 && resume.offset <= lexer->diagnostics[lexer->num_diagnostics-1].offset) {
+		--lexer->num_diagnostics;
+	}
+	lexer->num_blocks = 0;
+	if (lexer->token_blocks != NULL) {
+		free(lexer->token_blocks);
+		lexer->token_blocks = NULL;
+	}
+	if (lexer->error != NULL) {
+		free(lexer->error);
+		lexer->error = NULL;
+	}
+	lexer_restore(lexer, &resume);
+	
+	return lexer_run(lexer);
+}
+
+int lexer_get_fingerprint(lexer_t *lexer, lexer_fingerprint_t *fingerprint) {
+	if (lexer == NULL || fingerprint == NULL || (lexer->options & LEXER_OPT_FINGERPRINT) == 0) {
+		return -1;
+	}
+	
+	// finish both lanes with a strong mix, since FNV's low bits are weak
+	uint64_t lanes[2] = { lexer->fingerprint_low, lexer->fingerprint_high };
+	int index = 0;
+	for (; index < 2; ++index) {
+		uint64_t lane = lanes[index];
+		lane ^= lane >> 33;
+		lane *= 0xFF51AFD7ED558CCDULL;
+		lane ^= lane >> 33;
+		lane *= 0xC4CEB9FE1A85EC53ULL;
+		lane ^= lane >> 33;
+		lanes[index] = lane;
+	}
+	fingerprint->low = lanes[0];
+	fingerprint->high = lanes[1];
+	return 0;
+}
+
+
+int lexer_get_num_diagnostics(lexer_t *lexer) {
+	return (lexer != NULL ? lexer->num_diagnostics : 0);
+}
+
+
+int lexer_get_diagnostic(lexer_t *lexer, int index, lexer_diagnostic_t *diagnostic) {
+	if (lexer == NULL || index < 0 || lexer->num_diagnostics <= index) {
+		return -1;
+	}
+	if (diagnostic != NULL) {
+		*diagnostic = lexer->diagnostics[index];
+	}
+	return 0;
+}
+
+
+const char *lexer_get_source(lexer_t *lexer, size_t *length) {
+	if (lexer == NULL) {
+		return NULL;
+	}
+	if (length != NULL) {
+		*length = LEXER_OFFSET(lexer, lexer->source_end);
+	}
+	return lexer->source_begin;
+}
+
+/*
+tokens without text (e.g., TOK_EOF) have null pointers - those are given the
+offset of source_end so every offset token stays within the source
+*/
+#define LEXER_TOKEN_OFFSET(lexer, ptr) ((ptr) != NULL ? LEXER_OFFSET(lexer, ptr) : LEXER_OFFSET(lexer, (lexer)->source_end))
+
+int lexer_get_tokens_ofs(lexer_t *lexer, int first, int max_tokens, token_ofs_t *tokens) {
+	if (lexer == NULL || tokens == NULL || first < 0 || max_tokens < 0) {
+		return 0;
+	}
+	if (LEXER_OFFSET(lexer, lexer->source_end) > UINT32_MAX) {
+		return -1;
+	}
+	
+	if (lexer->current.token <= (size_t)first) {
+		return 0;
+	}
+	
+	size_t num = lexer->current.token-(size_t)first;
+	if (num > (size_t)max_tokens) {
+		num = (size_t)max_tokens;
+	}
+	
+	size_t index = 0;
+	for (; index < num; ++index) {
+		const token_t *token = lexer_token_at(lexer, first+index);
+		token_ofs_t *out = tokens+index;
+		if (token->line > INT_MAX || token->column > INT_MAX) {
+			return -1;
+		}
+		out->kind = token->kind;
+		out->flags = token->flags;
+		out->from = (uint32_t)LEXER_TOKEN_OFFSET(lexer, token->from);
+		out->to = (uint32_t)LEXER_TOKEN_OFFSET(lexer, token->to);
+		out->line = (int)token->line;
+		out->column = (int)token->column;
+	}
+	return (int)num;
+}
+
+size_t lexer_get_tokens_ofs64(lexer_t *lexer, size_t first, size_t max_tokens, token_ofs64_t *tokens) {
+	if (lexer == NULL || tokens == NULL || lexer->current.token <= first) {
+		return 0;
+	}
+	
+	size_t num = lexer->current.token-first;
+	if (num > max_tokens) {
+		num = max_tokens;
+	}
+	
+	size_t index = 0;
+	for (; index < num; ++index) {
+		const token_t *token = lexer_token_at(lexer, first+index);
+		token_ofs64_t *out = tokens+index;
+		out->kind = token->kind;
+		out->flags = token->flags;
+		out->from = (uint64_t)LEXER_TOKEN_OFFSET(lexer, token->from);
+		out->to = (uint64_t)LEXER_TOKEN_OFFSET(lexer, token->to);
+		out->line = token->line;
+		out->column = token->column;
+	}
+	return num;
 }
 
 const char *lexer_get_error(lexer_t *lexer) {
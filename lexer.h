@@ -28,6 +28,17 @@
 // (see README.md/Additions for details)
 #define BMAX_USE_ADDITIONS
 
+// Uncomment this to compile in USDT probes (requires sys/sdt.h, see
+// README.md/Build options for the list of probes)
+// #define BMXLEXER_USE_SDT
+
+// Uncomment this to keep the original scanner around as a reference engine
+// for differential testing (lexer_run_reference/lexer_compare)
+// #define BMXLEXER_REFERENCE_ENGINE
+
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -198,35 +209,265 @@ typedef enum {
 	
 	TOK_EOF,
 	
-	TOK_LAST=TOK_EOF,
+	TOK_SKIPPED,
+	
+	TOK_LAST=TOK_SKIPPED,
 	TOK_COUNT
 } token_kind_t;
 
 
+typedef enum {
+	/* the token is the first on a line continued from the previous one by .. (LEXER_OPT_FOLD_CONTINUATIONS) */
+	TOKEN_FLAG_CONTINUED=1<<0,
+} token_flag_t;
+
 typedef struct s_token {
 	token_kind_t kind;
+	int flags; /* token_flag_t */
 	const char *from, *to;
-	int line, column;
+	int64_t line, column;
 } token_t;
 
+/* a matched pair of block keywords, e.g. Type/End Type or Repeat/Until - indices refer to the lexer's tokens */
+typedef struct s_block {
+	token_kind_t kind; /* the opening keyword's kind, e.g. TOK_TYPE_KW */
+	int64_t open, close; /* -1 if the block is missing its opening or closing token */
+	int64_t depth; /* number of blocks enclosing this one */
+} block_t;
+
+/* declaration kinds recorded by lexer_run_outline - these are flags so they can be combined to filter the outline */
+typedef enum {
+	DECL_TYPE=1<<0,
+	DECL_EXTENDS=1<<1,
+	DECL_FUNCTION=1<<2,
+	DECL_METHOD=1<<3,
+	DECL_GLOBAL=1<<4,
+	DECL_CONST=1<<5,
+	DECL_FIELD=1<<6,
+	
+	DECL_FRAMEWORK=1<<7,
+	DECL_MODULE=1<<8,
+	DECL_IMPORT=1<<9,
+	DECL_INCLUDE=1<<10,
+	
+	DECL_ALL=0x7ff,
+	
+	/* not a kind - stops the outline at the first statement that can't appear in a file's header
+	   (anything other than Strict/SuperStrict/Framework/Module/ModuleInfo/Import/Include) */
+	DECL_HEADER_ONLY=1<<16
+} decl_kind_t;
+
+typedef struct s_decl {
+	decl_kind_t kind;
+	const char *from, *to; /* the declared name, the base type's name for DECL_EXTENDS, or the module name or
+	                          unquoted path for DECL_FRAMEWORK/DECL_MODULE/DECL_IMPORT/DECL_INCLUDE */
+	int64_t line;
+	int parent; /* index of the enclosing Type's decl, or -1 */
+} decl_t;
+
+typedef enum {
+	/* evaluate ?Condition lines against the conditions passed to lexer_define - lines in inactive regions are
+	   skipped and reported as a single TOK_SKIPPED token */
+	LEXER_OPT_CONDITIONALS=1<<0,
+	/* drop a trailing .. and the newline it continues, flagging the first token of the next line with
+	   TOKEN_FLAG_CONTINUED instead - a TOK_NEWLINE then always ends a statement */
+	LEXER_OPT_FOLD_CONTINUATIONS=1<<1,
+	/* allow any valid UTF-8 encoded character past U+007F in identifiers, not only letters, digits and underscores */
+	LEXER_OPT_UTF8_IDENTIFIERS=1<<2,
+	/* hash the tokens into a fingerprint of the code while lexing, leaving out comments and blank lines and ignoring
+	   case and spacing where BlitzMax does (see lexer_get_fingerprint) */
+	LEXER_OPT_FINGERPRINT=1<<3,
+	/* with LEXER_OPT_FINGERPRINT, don't keep the tokens - the lexer only holds on to the last one, and doesn't match
+	   blocks or record checkpoints */
+	LEXER_OPT_DISCARD_TOKENS=1<<4,
+	/* keep the tokens in fixed-size segments instead of one array that's reallocated as it grows, so a token never
+	   moves once it's added and lexing never copies the tokens so far - only takes effect before the first token;
+	   lexer_get_tokens returns NULL with this, use lexer_get_token_span */
+	LEXER_OPT_SEGMENTED_TOKENS=1<<5,
+} lexer_option_t;
+
+/* a 128-bit fingerprint of a source's tokens (see LEXER_OPT_FINGERPRINT) */
+typedef struct s_lexer_fingerprint {
+	uint64_t low, high;
+} lexer_fingerprint_t;
+
+/* results of lexer_run_for besides 0 (done) and 1 (error) - lexing can go on from where it stopped after either */
+typedef enum {
+	LEXER_RUN_PENDING=2,
+	LEXER_RUN_CANCELLED=3,
+} lexer_run_result_t;
+
+typedef enum {
+	/* bytes that aren't valid UTF-8 - a stray continuation byte, an overlong or truncated sequence, a surrogate or a
+	   code point past U+10FFFF */
+	LEXER_DIAG_INVALID_UTF8=1,
+} lexer_diagnostic_kind_t;
+
+/* a problem in the source that doesn't stop the lexer (see lexer_get_diagnostic) */
+typedef struct s_lexer_diagnostic {
+	lexer_diagnostic_kind_t kind;
+	size_t offset; /* from source_begin */
+	size_t length; /* number of bytes at offset the diagnostic is about */
+	int64_t line, column;
+} lexer_diagnostic_t;
+
+/* a token with byte offsets from the lexer's source_begin in place of pointers - these don't depend on where the
+   source is in memory, so they can be cached, written to files or shared with other processes */
+typedef struct s_token_ofs {
+	token_kind_t kind;
+	int flags; /* token_flag_t */
+	uint32_t from, to;
+	int line, column;
+} token_ofs_t;
+
+/* same as token_ofs_t, for sources of 4GB or more */
+typedef struct s_token_ofs64 {
+	token_kind_t kind;
+	int flags; /* token_flag_t */
+	uint64_t from, to;
+	int64_t line, column;
+} token_ofs64_t;
+
+/* the lexer's state at a point in the source, recorded by lexer_run (see lexer_set_checkpoints) - lexing can resume
+   from any checkpoint instead of the beginning of the source */
+typedef struct s_lexer_checkpoint {
+	size_t offset; /* from source_begin - the beginning of a line unless it's inside a Rem block */
+	int64_t line, column;
+	size_t token; /* index of the first token after the checkpoint */
+	int flags; /* token_flag_t for that token */
+	int64_t rem_line, rem_column; /* position of the Rem keyword when inside a Rem block, 0 otherwise */
+	size_t rem_offset; /* offset of the end of that Rem keyword */
+} lexer_checkpoint_t;
+
+/* the text of every token in a single allocation (see lexer_export_strings) - only one spelling of each kind is shared,
+   the first one in the source, so keywords, operators and newlines written the usual way are stored once while other
+   tokens (identifiers, literals, comments) get their own copy even if spelled the same */
+typedef struct s_lexer_strings {
+	size_t num_tokens;
+	size_t size; /* bytes of text, including the NULs */
+	const char *text; /* NUL-terminated token texts */
+	const size_t *offsets; /* offset of each token's text in text */
+} lexer_strings_t;
+
 typedef struct s_lexer lexer_t;
 
 /* allocates a new lexer for the range specified by source_begin and source_end and returns it */
 lexer_t *lexer_new(const char *source_begin, const char *source_end);
+/* allocates a new lexer for part of a source - lexing begins at start, which must be the beginning of a line outside
+   any Rem block and is numbered line, and lexer_run stops before the first token at or past stop (NULL for the end of
+   the source); offsets are still from source_begin */
+lexer_t *lexer_new_range(const char *source_begin, const char *source_end, const char *start, const char *stop,
+		int64_t line);
+/* allocates a new lexer that resumes from a checkpoint recorded by another lexer for the same source - token indices
+   start over from 0 rather than checkpoint->token; stop is the same as for lexer_new_range */
+lexer_t *lexer_new_at(const char *source_begin, const char *source_end, const lexer_checkpoint_t *checkpoint,
+		const char *stop);
 /* destroys the contents (tokens and such) of the lexer and releases its memory */
 void lexer_destroy(lexer_t *lexer);
+/* sets the lexer's options (any combination of lexer_option_t flags) - must be done before running the lexer */
+void lexer_set_options(lexer_t *lexer, unsigned int options);
+/* defines a condition (e.g. "Debug" or "Linux") for LEXER_OPT_CONDITIONALS - names are case-insensitive; returns 0,
+   or -1 if out of memory */
+int lexer_define(lexer_t *lexer, const char *name);
+/* makes lexer_run record a checkpoint at the first line start after every every_lines lines or every_bytes bytes
+   (0 disables either) - must be done before running the lexer */
+void lexer_set_checkpoints(lexer_t *lexer, int64_t every_lines, size_t every_bytes);
 /* runs the lexer - you should only do this once, doing it twice will result in the entire list of tokens being duplicated for no reason */
 int lexer_run(lexer_t *lexer);
+/* runs the lexer over about max_bytes more of the source (0 for no limit) - returns LEXER_RUN_PENDING if there's
+   more to lex, in which case calling it again continues where it stopped, or LEXER_RUN_CANCELLED if lexer_cancel was
+   called, otherwise the same as lexer_run once the lexer is done */
+int lexer_run_for(lexer_t *lexer, size_t max_bytes);
+/* makes a running lexer_run_for or lexer_run return LEXER_RUN_CANCELLED before its next token (or the next call do
+   so if none is running) - safe to call from any thread */
+void lexer_cancel(lexer_t *lexer);
+/* runs the outline scanner instead of the lexer - no tokens are produced, only declarations of the given kinds
+   (any combination of decl_kind_t flags); like lexer_run, only do this once - returns 0, or 1 if declarations had to
+   be dropped (see lexer_get_error) */
+int lexer_run_outline(lexer_t *lexer, unsigned int kinds);
 /* returns the error string or NULL if there is no error */
 const char *lexer_get_error(lexer_t *lexer);
 /* returns the number of tokens identified by the lexer */
-int lexer_get_num_tokens(lexer_t *lexer);
+size_t lexer_get_num_tokens(lexer_t *lexer);
+/* same as lexer_get_num_tokens for callers that count in ints - returns -1 if there are more tokens than fit in one */
+int lexer_get_num_tokens32(lexer_t *lexer);
 /* returns the kind of the token at the index and copies that token to the provided token if it isn't null */
-token_kind_t lexer_get_token(lexer_t *lexer, int index, token_t *token);
+token_kind_t lexer_get_token(lexer_t *lexer, size_t index, token_t *token);
+/* same as lexer_get_token for callers that can only pass an int (e.g. through a foreign function interface) */
+token_kind_t lexer_get_token32(lexer_t *lexer, int index, token_t *token);
 /* returns a copy of all tokens identified by the lexer; number of tokens is copied to num_tokens */
-token_t *lexer_copy_tokens(lexer_t *lexer, int *num_tokens);
+token_t *lexer_copy_tokens(lexer_t *lexer, size_t *num_tokens);
+/* returns the lexer's own tokens without copying them and copies their number to num_tokens if it isn't null - the
+   tokens stay valid until the lexer is run again or destroyed; NULL with LEXER_OPT_SEGMENTED_TOKENS */
+const token_t *lexer_get_tokens(lexer_t *lexer, size_t *num_tokens);
+/* returns the lexer's own token at the index without copying it, or NULL if out of range, and copies the number of
+   tokens stored contiguously from there on (at least 1) to count if it isn't null - works with either storage.  with
+   LEXER_OPT_SEGMENTED_TOKENS the pointer stays valid while lexer_run_for goes on lexing, though the last token may
+   still be merged with the next (e.g. End and If) */
+const token_t *lexer_get_token_span(lexer_t *lexer, size_t index, size_t *count);
+/* returns the number of blocks matched by the lexer - blocks are ordered by their first token */
+size_t lexer_get_num_blocks(lexer_t *lexer);
+/* returns the kind of the block at the index and copies that block to the provided block if it isn't null */
+token_kind_t lexer_get_block(lexer_t *lexer, size_t index, block_t *block);
+/* returns the index of the block opened or closed by the token at the index, or -1 if it doesn't open or close one */
+int64_t lexer_get_token_block(lexer_t *lexer, size_t token_index);
+/* returns the number of blocks missing either their opening or closing token */
+size_t lexer_get_num_unbalanced_blocks(lexer_t *lexer);
+/* returns the number of declarations found by lexer_run_outline */
+int lexer_get_num_decls(lexer_t *lexer);
+/* returns the kind of the declaration at the index (0 if out of range) and copies it to the provided decl if it isn't null */
+decl_kind_t lexer_get_decl(lexer_t *lexer, int index, decl_t *decl);
+/* returns the number of checkpoints recorded by lexer_run - a run that would need more than INT_MAX fails instead */
+int lexer_get_num_checkpoints(lexer_t *lexer);
+/* copies the checkpoint at the index to the provided checkpoint if it isn't null - returns 0, or -1 if out of range */
+int lexer_get_checkpoint(lexer_t *lexer, int index, lexer_checkpoint_t *checkpoint);
+/* returns the index of the last checkpoint at or before the beginning of the line, or -1 if there is none */
+int lexer_find_checkpoint(lexer_t *lexer, int64_t line);
+/* discards the tokens from the checkpoint at the index on and lexes again from there - for re-lexing a source that
+   only changed past the checkpoint, which may have moved to source_begin; returns the same as lexer_run */
+int lexer_resume(lexer_t *lexer, int checkpoint, const char *source_begin, const char *source_end);
+/* copies the fingerprint of a finished run's tokens to fingerprint - returns 0, or -1 without LEXER_OPT_FINGERPRINT;
+   inactive regions of LEXER_OPT_CONDITIONALS count as a TOK_SKIPPED each, so fingerprints depend on the defines */
+int lexer_get_fingerprint(lexer_t *lexer, lexer_fingerprint_t *fingerprint);
+/* returns the number of diagnostics reported by lexer_run - these are in source order, and a run that would report
+   more than INT_MAX fails instead */
+int lexer_get_num_diagnostics(lexer_t *lexer);
+/* copies the diagnostic at the index to the provided diagnostic if it isn't null - returns 0, or -1 if out of range */
+int lexer_get_diagnostic(lexer_t *lexer, int index, lexer_diagnostic_t *diagnostic);
+/* returns the beginning of the lexer's source and copies its length to length if it isn't null */
+const char *lexer_get_source(lexer_t *lexer, size_t *length);
+/* copies up to max_tokens tokens, starting at the index first, to tokens as offset tokens - returns the number of
+   tokens copied, or -1 if the source is too large for 32-bit offsets or has more lines than fit in an int */
+int lexer_get_tokens_ofs(lexer_t *lexer, int first, int max_tokens, token_ofs_t *tokens);
+/* same as lexer_get_tokens_ofs, with 64-bit offsets and positions - never fails */
+size_t lexer_get_tokens_ofs64(lexer_t *lexer, size_t first, size_t max_tokens, token_ofs64_t *tokens);
 /* returns a copy of the string contents of the token, must be freed via free(str) */
 char *token_to_string(const token_t* tok);
+/* returns the text of every token the lexer identified (the same text token_to_string returns) in one allocation,
+   which must be freed via free(strings) - returns NULL on error */
+lexer_strings_t *lexer_export_strings(lexer_t *lexer);
+/* returns the text of the token at the index, or NULL if out of range */
+const char *lexer_strings_get(const lexer_strings_t *strings, size_t index);
+/* same as lexer_strings_get for callers that can only pass an int */
+const char *lexer_strings_get32(const lexer_strings_t *strings, int index);
+/* same as token_to_string for an offset token of the given source */
+char *token_ofs_to_string(const token_ofs_t *tok, const char *source_begin);
+/* returns the length every token of the kind has when spelled without spaces (e.g. 11 for EndFunction or 2 for :+),
+   or 0 if it varies (identifiers, literals, comments, etc.) */
+size_t token_kind_length(token_kind_t kind);
+/* returns a 64-bit hash of the token's kind and text (the text token_to_string returns) - tokens that differ only in
+   where they are hash the same */
+uint64_t token_hash(const token_t *token);
+
+#ifdef BMXLEXER_REFERENCE_ENGINE
+/* runs the original, unoptimized scanner - same contract as lexer_run */
+int lexer_run_reference(lexer_t *lexer);
+/* compares the tokens (kind, offsets from source_begin, text, position) and errors of two lexers - returns -1 if
+   they're identical, -2 if either is NULL or their errors differ, otherwise the index of the first token that
+   differs; if both failed with the same error, the tokens before it are compared with token pairs (End If, :+, ...)
+   merged, since the reference engine only merges them once it's done */
+int64_t lexer_compare(lexer_t *lexer, lexer_t *other);
+#endif
 
 
 #ifdef __cplusplus
@@ -0,0 +1,375 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+/*
+Differential checks of lexer_run against the reference engine - every input
+goes through the fuzzer entry point in lexer.c, which lexes it with each set
+of options it covers and aborts on the first difference from the reference
+engine, from lexing it in slices or from resuming it at a checkpoint.
+
+Inputs are the files named on the command line (e.g. a corpus of BlitzMax
+sources) and a corpus generated from fragments of BlitzMax, seeded so a
+failure can be reproduced.  Before those, a few fixed sources that broke the
+lexer or the extras once are checked.  Build with something along the lines of
+	cc -g -fsanitize=address,undefined -DBMXLEXER_REFERENCE_ENGINE -DBMXLEXER_FUZZ lexer.c lexer_diff.c lexer_pack.c lexer_check.c -o lexer_check
+and run it as lexer_check [-n number of generated inputs] [-s seed] [file ...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+
+#include "lexer.h"
+#include "lexer_diff.h"
+#include "lexer_pack.h"
+
+#if !defined(BMXLEXER_REFERENCE_ENGINE) || !defined(BMXLEXER_FUZZ)
+#error lexer_check.c needs lexer.c built with BMXLEXER_REFERENCE_ENGINE and BMXLEXER_FUZZ
+#endif
+
+#define CHECK_MAX_INPUT (4096)
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+
+/*
+generated inputs are runs of these - mostly the edge cases a faster scanner is
+likely to get wrong (spacing inside pairs, malformed numbers, the additions'
+operators, unterminated strings and Rem blocks, non-ASCII bytes)
+*/
+static const char *check_fragments[] = {
+	" ", "  ", "\t", "\n", "\r\n", "\n\n",
+	"x", "_y1", "Foo", "a.b", "Self", "Super", "Null", "Not", "And", "Or", "Shl", "Mod",
+	"Local ", "Global ", "Const ", "Field ", "Function ", "Method ", "Type ", "Extends ", "Abstract",
+	"If ", "Then ", "Else", "ElseIf ", "Else If ", "EndIf", "End If", "End  If", "Select ", "Case ", "Default",
+	"For ", "To ", "Step ", "Next", "EachIn ", "While ", "Wend", "Repeat", "Until ", "Forever", "Return ",
+	"End", "End ", "End Function", "EndFunction", "End Method", "End Type", "End  Type", "Extern", "End Extern",
+	"Rem", "Rem ", "EndRem", "End Rem", "End  Rem", "Rem\n", "\nEndRem\n", "\nEnd Rem\n",
+	"'", "' comment\n", "\"", "\"string\"", "\"unterminated",
+	"0", "3", "42", "1.5", ".5", ".5e-3", "1e10", "1e", "1e+", "2.5E+3", "1.2.3", "1e3e4",
+	"%", "%1", "%0101", "%2", "$", "$ff", "$FF", "$g", "$1f2e",
+	".", "..", "...", "..  ' continued\n", "..\n", "@", "@@", "?", "?Debug", "?Not Debug", "?Threaded",
+	":", ":=", ":+", ": +", ":-", ":*", ":/", ":Shl", ":Mod", "--", "++", "->", "<>", "<=", ">=", "=<", "=>",
+	"(", ")", "[", "]", "{", "}", ",", ";", "=", "+", "-", "*", "/", "^", "~", "|", "&", "#", "!", "%", "$",
+	"\x80", "\xc3\xa9", "\xe2\x82\xac", "\xff", "\\",
+};
+
+/* Rem blocks with nothing in them, whose comment token has an empty range */
+static const char *check_empty_rems[] = {
+	"Rem\nEndRem\n",
+	"Rem\nEnd Rem\n",
+	"Rem EndRem",
+	"Rem\n\nEndRem\n",
+	"Local a = 1\nRem\nEndRem\nLocal b = 2\n",
+};
+
+/* sources that have to fingerprint the same - End pairs however they're spaced - and ones that mustn't */
+static const char *check_same_fingerprints[][2] = {
+	{ "If a Then\nEnd If\n", "If a Then\nEnd   If\n" },
+	{ "If a Then\nEnd If\n", "If a Then\nEndIf\n" },
+	{ "If a Then\nend\tif\n", "If a Then\nENDIF\n" },
+	{ "Function f()\nEnd    Function\n", "Function f()\nEndFunction\n" },
+	{ "Type T\n\tField x\nEnd  Type\n", "Type T\n\tField x\nEnd Type\n" },
+	{ "Select x\nEnd  Select\nEnd", "Select x\nEndSelect\nEnd " },
+};
+static const char *check_different_fingerprints[][2] = {
+	{ "If a Then\nEnd If\n", "If a Then\nEnd\nIf\n" },
+	{ "End  If\n", "End  Function\n" },
+	{ "x\nEnd", "x\n" },
+	{ "End\n", "End End\n" },
+};
+
+static const char *check_input;	// what's being checked, reported if the fuzzer entry point aborts
+static int check_failures;	// failed fixed checks
+
+static uint64_t check_random(uint64_t *state);
+static void check_report(int signal);
+static void check_expect(bool passed, const char *what, const char *source);
+static lexer_t *check_lex(const char *source, unsigned int options);
+static void check_pack(lexer_t *lexer, const char *input);
+static void check_empty_rem(const char *source);
+static void check_fingerprint(const char *source, const char *other, bool same);
+static void check_buffer(const char *label, const char *data, size_t size);
+static int check_file(const char *path);
+static void check_generated(uint64_t seed, long count);
+
+
+/* xorshift64* - the same sequence everywhere, unlike rand() */
+static uint64_t check_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state*2685821657736338717ULL;
+}
+
+
+static void check_report(int signal) {
+	(void)signal;
+	if (check_input != NULL) {
+		fputs("lexer_check: failed on ", stderr);
+		fputs(check_input, stderr);
+		fputs("\n", stderr);
+	}
+}
+
+
+static void check_expect(bool passed, const char *what, const char *source) {
+	if (!passed) {
+		fprintf(stderr, "lexer_check: %s for \"", what);
+		for (; *source != 0; ++source) {
+			fprintf(stderr, (*source == '\n' ? "\\n" : "%c"), *source);
+		}
+		fprintf(stderr, "\"\n");
+		++check_failures;
+	}
+}
+
+
+/* a lexer that has run over the source, or NULL if it failed */
+static lexer_t *check_lex(const char *source, unsigned int options) {
+	lexer_t *lexer = lexer_new(source, source+strlen(source));
+	if (lexer == NULL) {
+		return NULL;
+	}
+	lexer_set_options(lexer, options);
+	if (lexer_run(lexer) != 0) {
+		lexer_destroy(lexer);
+		return NULL;
+	}
+	return lexer;
+}
+
+
+/* packs the lexer's tokens and checks each of them unpacks to what the lexer has */
+static void check_pack(lexer_t *lexer, const char *input) {
+	size_t num_tokens = lexer_get_num_tokens(lexer);
+	token_pack_t *pack = token_pack_new(lexer);
+	check_expect(pack != NULL && token_pack_get_num_tokens(pack) == num_tokens, "packing the tokens failed", input);
+	
+	size_t index = 0;
+	for (; pack != NULL && index < num_tokens; ++index) {
+		token_ofs64_t token, packed;
+		lexer_get_tokens_ofs64(lexer, index, 1, &token);
+		token_pack_get_token(pack, index, &packed);
+		if (token.kind != packed.kind || token.flags != packed.flags || token.from != packed.from ||
+			token.to != packed.to || token.line != packed.line || token.column != packed.column) {
+			check_expect(false, "a token changed in the pack", input);
+			break;
+		}
+	}
+	token_pack_destroy(pack);
+}
+
+
+static void check_empty_rem(const char *source) {
+	lexer_t *lexer = check_lex(source, 0);
+	check_expect(lexer != NULL, "lexing failed", source);
+	if (lexer == NULL) {
+		return;
+	}
+	
+	size_t index = 0, num_tokens = lexer_get_num_tokens(lexer);
+	for (; index < num_tokens; ++index) {
+		token_t token;
+		if (lexer_get_token(lexer, index, &token) == TOK_BLOCK_COMMENT) {
+			check_expect(token.from == token.to, "empty Rem block's range isn't empty", source);
+		}
+	}
+	
+	// copies every token's text
+	lexer_strings_t *strings = lexer_export_strings(lexer);
+	check_expect(strings != NULL, "exporting the token strings failed", source);
+	for (index = 0; strings != NULL && index < num_tokens; ++index) {
+		token_t token;
+		lexer_get_token(lexer, index, &token);
+		char *text = token_to_string(&token);
+		check_expect(text != NULL && strcmp(text, lexer_strings_get(strings, index)) == 0,
+			"exported token string differs from token_to_string", source);
+		free(text);
+	}
+	free(strings);
+	
+	check_pack(lexer, source);
+	
+	// hashes every token's text
+	lexer_t *same = check_lex(source, 0);
+	token_diff_t *diff = (same != NULL ? token_diff_new(lexer, same) : NULL);
+	check_expect(diff != NULL && token_diff_get_num_hunks(diff) == 0, "diff against itself isn't empty", source);
+	token_diff_destroy(diff);
+	lexer_destroy(same);
+	
+	lexer_destroy(lexer);
+}
+
+
+static void check_fingerprint(const char *source, const char *other, bool same) {
+	// with the tokens kept and without, since only the last one is around to pair with when they're discarded
+	unsigned int options[] = { LEXER_OPT_FINGERPRINT, LEXER_OPT_FINGERPRINT | LEXER_OPT_DISCARD_TOKENS };
+	size_t index = 0;
+	for (; index < sizeof(options)/sizeof(options[0]); ++index) {
+		lexer_t *lexer = check_lex(source, options[index]);
+		lexer_t *other_lexer = check_lex(other, options[index]);
+		lexer_fingerprint_t fingerprint, other_fingerprint;
+		bool fingerprinted = (lexer != NULL && other_lexer != NULL && lexer_get_fingerprint(lexer, &fingerprint) == 0 &&
+							  lexer_get_fingerprint(other_lexer, &other_fingerprint) == 0);
+		check_expect(fingerprinted, "fingerprinting failed", source);
+		if (fingerprinted) {
+			bool equal = (fingerprint.low == other_fingerprint.low && fingerprint.high == other_fingerprint.high);
+			check_expect(equal == same, (same ? "fingerprint differs from its respaced twin's" :
+				"fingerprint is the same as different code's"), source);
+		}
+		lexer_destroy(other_lexer);
+		lexer_destroy(lexer);
+	}
+}
+
+
+static void check_buffer(const char *label, const char *data, size_t size) {
+	check_input = label;
+	LLVMFuzzerTestOneInput((const unsigned char*)data, size);
+	check_input = NULL;
+	
+	// the fuzzer entry point only covers lexer.c, so the extras are checked here
+	char *source = malloc(size+1);
+	if (source == NULL) {
+		return;
+	}
+	memcpy(source, data, size);
+	source[size] = 0;
+	lexer_t *lexer = lexer_new(source, source+size);
+	if (lexer != NULL && lexer_run(lexer) == 0) {
+		check_pack(lexer, label);
+	}
+	lexer_destroy(lexer);
+	free(source);
+}
+
+
+static int check_file(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "lexer_check: can't open %s\n", path);
+		return -1;
+	}
+	
+	char *data = NULL;
+	size_t size = 0, capacity = 0;
+	for (;;) {
+		if (size == capacity) {
+			capacity = (capacity > 0 ? capacity*2 : 65536);
+			char *grown = realloc(data, capacity);
+			if (grown == NULL) {
+				fprintf(stderr, "lexer_check: out of memory reading %s\n", path);
+				free(data);
+				fclose(file);
+				return -1;
+			}
+			data = grown;
+		}
+		size_t read = fread(data+size, 1, capacity-size, file);
+		if (read == 0) {
+			break;
+		}
+		size += read;
+	}
+	
+	int result = 0;
+	if (ferror(file)) {
+		fprintf(stderr, "lexer_check: can't read %s\n", path);
+		result = -1;
+	} else {
+		check_buffer(path, data, size);
+	}
+	free(data);
+	fclose(file);
+	return result;
+}
+
+
+static void check_generated(uint64_t seed, long count) {
+	const size_t num_fragments = sizeof(check_fragments)/sizeof(check_fragments[0]);
+	char label[64];
+	char data[CHECK_MAX_INPUT];
+	long index = 0;
+	for (; index < count; ++index) {
+		// each input gets its own state so one can be reproduced without the ones before it
+		uint64_t state = (seed ^ ((uint64_t)index*0x9E3779B97F4A7C15ULL)) | 1;
+		size_t size = 0;
+		long fragments = (long)(check_random(&state) % 64);
+		for (; fragments > 0; --fragments) {
+			const char *fragment = check_fragments[check_random(&state) % num_fragments];
+			size_t length = strlen(fragment);
+			if (size+length > sizeof(data)) {
+				break;
+			}
+			memcpy(data+size, fragment, length);
+			size += length;
+		}
+		
+		snprintf(label, sizeof(label), "generated input %ld (-s %llu)", index, (unsigned long long)seed);
+		check_buffer(label, data, size);
+	}
+}
+
+
+int main(int argc, char **argv) {
+	long count = 10000;
+	uint64_t seed = 1;
+	int failures = 0;
+	int checked = 0;
+	
+	signal(SIGABRT, check_report);
+	
+	size_t index = 0;
+	for (; index < sizeof(check_empty_rems)/sizeof(check_empty_rems[0]); ++index) {
+		check_empty_rem(check_empty_rems[index]);
+	}
+	for (index = 0; index < sizeof(check_same_fingerprints)/sizeof(check_same_fingerprints[0]); ++index) {
+		check_fingerprint(check_same_fingerprints[index][0], check_same_fingerprints[index][1], true);
+	}
+	for (index = 0; index < sizeof(check_different_fingerprints)/sizeof(check_different_fingerprints[0]); ++index) {
+		check_fingerprint(check_different_fingerprints[index][0], check_different_fingerprints[index][1], false);
+	}
+	
+	int arg = 1;
+	for (; arg < argc; ++arg) {
+		if (strcmp(argv[arg], "-n") == 0 && arg+1 < argc) {
+			count = strtol(argv[++arg], NULL, 10);
+		} else if (strcmp(argv[arg], "-s") == 0 && arg+1 < argc) {
+			seed = (uint64_t)strtoull(argv[++arg], NULL, 10);
+		} else if (argv[arg][0] == '-') {
+			fprintf(stderr, "usage: %s [-n number of generated inputs] [-s seed] [file ...]\n", argv[0]);
+			return 2;
+		} else {
+			failures += (check_file(argv[arg]) != 0);
+			++checked;
+		}
+	}
+	
+	check_generated(seed, count);
+	printf("lexer_check: %d files and %ld generated inputs match the reference engine\n", checked-failures, count);
+	return (failures == 0 && check_failures == 0 ? 0 : 1);
+}
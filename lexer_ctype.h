@@ -0,0 +1,51 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_CTYPE_H_4WZK7D2R
+#define LEXER_CTYPE_H_4WZK7D2R
+
+#include <stdbool.h>
+
+/*
+Internal to the lexer and its extras, not part of the public API.
+
+ASCII character classes that, unlike ctype's, don't depend on the locale or
+choke on bytes past 0x7F.  Anything that has to agree with where lexer_run
+splits tokens should use these.
+*/
+
+static inline bool lexer_is_digit(char cur) {
+	return (unsigned)((unsigned char)cur-'0') < 10u;
+}
+
+
+static inline bool lexer_is_alpha(char cur) {
+	return (unsigned)(((unsigned char)cur | 0x20)-'a') < 26u;
+}
+
+
+static inline bool lexer_is_xdigit(char cur) {
+	return (lexer_is_digit(cur) || (unsigned)(((unsigned char)cur | 0x20)-'a') < 6u);
+}
+
+#endif /* end of include guard: LEXER_CTYPE_H_4WZK7D2R */
@@ -0,0 +1,1109 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+// O_CLOEXEC, lstat, usleep and strdup aren't declared in strict C99 otherwise
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "lexer.h"
+#include "lexer_daemon.h"
+
+#define LEXD_MAX_RECORDS 65536
+#define LEXD_MAX_SOURCE ((uint64_t)256 << 20)
+/* the whole batch is read before it's answered (see lexd_serve_batch), so it has to fit in memory */
+#define LEXD_MAX_BATCH ((uint64_t)1 << 30)
+#define LEXD_INITIAL_BUCKETS 256
+#define LEXD_OPTIONS (LEXER_OPT_FOLD_CONTINUATIONS | LEXER_OPT_UTF8_IDENTIFIERS)
+#define LEXD_MAX_IOV 64
+
+/* a closed connection must not kill the process with SIGPIPE - where there's no MSG_NOSIGNAL, sockets get
+   SO_NOSIGPIPE instead (see lexd_no_sigpipe) */
+#ifdef MSG_NOSIGNAL
+#define LEXD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define LEXD_SEND_FLAGS 0
+#endif
+
+/* a lexed source - entries in use by a connection are kept until it's done with them, even once evicted */
+typedef struct s_lexd_entry {
+	uint64_t hash;
+	unsigned int options;
+	char *source;
+	size_t source_length;
+	token_ofs64_t *tokens;
+	size_t num_tokens;
+	char *error;
+	size_t error_length;
+	lexd_status_t status;
+	size_t size;
+	
+	int refs;
+	bool cached;
+	struct s_lexd_entry *chain;
+	struct s_lexd_entry *newer, *older;
+} lexd_entry_t;
+
+typedef struct s_lexd_connection {
+	int fd;
+	lexd_t *daemon;
+	struct s_lexd_connection *next;
+} lexd_connection_t;
+
+struct s_lexd {
+	int fd;
+	char *path;
+	atomic_bool stopping;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	lexd_connection_t *connections;
+	
+	lexd_entry_t **buckets;
+	size_t num_buckets;
+	lexd_entry_t *newest, *oldest;
+	size_t cache_size;
+	lexd_stats_t stats;
+};
+
+/* a request read from a batch - data is the path or source, terminated */
+typedef struct s_lexd_job {
+	lexd_request_t request;
+	char *data;
+} lexd_job_t;
+
+typedef struct s_lexd_record {
+	lexd_request_t request;
+	const char *data;
+	char *path;
+} lexd_record_t;
+
+struct s_lexd_batch {
+	lexd_record_t *records;
+	int num_records, capacity;
+};
+
+struct s_lexd_reply {
+	char *data;
+	size_t *results; /* offset of each result's header in data */
+	int num_results;
+};
+
+static const char lexd_zeroes[8];
+
+static void lexd_no_sigpipe(int fd);
+static int lexd_read_all(int fd, void *buf, size_t length);
+static int lexd_send_all(int fd, struct iovec *iov, int count);
+static uint64_t lexd_hash(const char *source, size_t length, unsigned int options);
+static char *lexd_read_file(const char *path, size_t *length);
+
+static lexd_entry_t *lexd_lex(char *source, size_t length, uint64_t hash, unsigned int options);
+static void lexd_entry_free(lexd_entry_t *entry);
+static lexd_entry_t *lexd_find(lexd_t *daemon, uint64_t hash, unsigned int options, const char *source,
+		size_t length);
+static void lexd_unlink_lru(lexd_t *daemon, lexd_entry_t *entry);
+static void lexd_link_lru(lexd_t *daemon, lexd_entry_t *entry);
+static void lexd_insert(lexd_t *daemon, lexd_entry_t *entry);
+static void lexd_evict(lexd_t *daemon);
+static void lexd_release(lexd_t *daemon, lexd_entry_t *entry);
+static lexd_entry_t *lexd_lookup(lexd_t *daemon, char *source, size_t length, unsigned int options, bool *cached);
+
+static int lexd_write_result(int fd, lexd_status_t status, unsigned int flags, const lexd_entry_t *entry,
+		const char *error);
+static int lexd_answer(lexd_t *daemon, int fd, lexd_job_t *job);
+static int lexd_serve_batch(lexd_t *daemon, int fd);
+static void *lexd_connection_main(void *connection);
+
+static lexd_record_t *lexd_batch_add(lexd_batch_t *batch);
+
+
+/** I/O **/
+
+static void lexd_no_sigpipe(int fd) {
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+	(void)fd;
+#endif
+}
+
+
+static int lexd_read_all(int fd, void *buf, size_t length) {
+	char *place = buf;
+	while (length > 0) {
+		ssize_t read = recv(fd, place, length, 0);
+		if (read < 0 && errno == EINTR) {
+			continue;
+		} else if (read <= 0) {
+			return -1;
+		}
+		place += read;
+		length -= (size_t)read;
+	}
+	return 0;
+}
+
+
+/* sends everything in iov, which is modified along the way */
+static int lexd_send_all(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = (size_t)(count < LEXD_MAX_IOV ? count : LEXD_MAX_IOV);
+		
+		ssize_t sent = sendmsg(fd, &message, LEXD_SEND_FLAGS);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		} else if (sent < 0) {
+			return -1;
+		}
+		
+		size_t left = (size_t)sent;
+		while (count > 0 && left >= iov->iov_len) {
+			left -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base+left;
+			iov->iov_len -= left;
+		}
+	}
+	return 0;
+}
+
+
+/* not cryptographic - a cached source is only used once it compares equal, so a collision costs time, never
+   correctness */
+static uint64_t lexd_hash(const char *source, size_t length, unsigned int options) {
+	uint64_t hash = 0x9E3779B97F4A7C15ULL ^ options ^ ((uint64_t)length*0xC2B2AE3D27D4EB4FULL);
+	uint64_t word;
+	size_t index = 0;
+	for (; index+8 <= length; index += 8) {
+		memcpy(&word, source+index, 8);
+		hash = (hash ^ word)*0xFF51AFD7ED558CCDULL;
+		hash ^= hash >> 29;
+	}
+	
+	word = 0;
+	memcpy(&word, source+index, length-index);
+	hash = (hash ^ word)*0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+
+/* returns the file's contents, terminated, or NULL with errno set */
+static char *lexd_read_file(const char *path, size_t *length) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		return NULL;
+	} else if (!S_ISREG(info.st_mode) || (uint64_t)info.st_size > LEXD_MAX_SOURCE) {
+		close(fd);
+		errno = (S_ISREG(info.st_mode) ? EFBIG : EINVAL);
+		return NULL;
+	}
+	
+	size_t size = (size_t)info.st_size;
+	char *source = malloc(size+1);
+	size_t len = 0;
+	while (source != NULL && len < size) {
+		ssize_t got = read(fd, source+len, size-len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		} else if (got <= 0) {
+			// the file shrank - lex what's there
+			break;
+		}
+		len += (size_t)got;
+	}
+	close(fd);
+	
+	if (source != NULL) {
+		source[len] = 0;
+		*length = len;
+	}
+	return source;
+}
+
+
+/** cache **/
+
+/* lexes the source, which the entry takes over - returns NULL if out of memory */
+static lexd_entry_t *lexd_lex(char *source, size_t length, uint64_t hash, unsigned int options) {
+	lexer_t *lexer = lexer_new(source, source+length);
+	if (lexer == NULL) {
+		return NULL;
+	}
+	lexer_set_options(lexer, options);
+	int result = lexer_run(lexer);
+	
+	lexd_entry_t *entry = calloc(1, sizeof(lexd_entry_t));
+	size_t num_tokens = lexer_get_num_tokens(lexer);
+	token_ofs64_t *tokens = malloc((num_tokens > 0 ? num_tokens : 1)*sizeof(token_ofs64_t));
+	const char *error = lexer_get_error(lexer);
+	char *error_copy = (error != NULL ? strdup(error) : NULL);
+	if (entry == NULL || tokens == NULL || (error != NULL && error_copy == NULL)) {
+		free(entry);
+		free(tokens);
+		free(error_copy);
+		lexer_destroy(lexer);
+		return NULL;
+	}
+	
+	lexer_get_tokens_ofs64(lexer, 0, num_tokens, tokens);
+	lexer_destroy(lexer);
+	
+	entry->hash = hash;
+	entry->options = options;
+	entry->source = source;
+	entry->source_length = length;
+	entry->tokens = tokens;
+	entry->num_tokens = num_tokens;
+	entry->error = error_copy;
+	entry->error_length = (error_copy != NULL ? strlen(error_copy) : 0);
+	entry->status = (result == 0 ? LEXD_STATUS_OK : LEXD_STATUS_LEX_ERROR);
+	entry->size = sizeof(lexd_entry_t)+length+1+num_tokens*sizeof(token_ofs64_t)+entry->error_length;
+	return entry;
+}
+
+
+static void lexd_entry_free(lexd_entry_t *entry) {
+	free(entry->source);
+	free(entry->tokens);
+	free(entry->error);
+	free(entry);
+}
+
+
+static lexd_entry_t *lexd_find(lexd_t *daemon, uint64_t hash, unsigned int options, const char *source,
+		size_t length) {
+	lexd_entry_t *entry = daemon->buckets[hash & (daemon->num_buckets-1)];
+	for (; entry != NULL; entry = entry->chain) {
+		if (entry->hash == hash && entry->options == options && entry->source_length == length &&
+			memcmp(entry->source, source, length) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+
+static void lexd_unlink_lru(lexd_t *daemon, lexd_entry_t *entry) {
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	} else {
+		daemon->newest = entry->older;
+	}
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		daemon->oldest = entry->newer;
+	}
+	entry->newer = entry->older = NULL;
+}
+
+
+static void lexd_link_lru(lexd_t *daemon, lexd_entry_t *entry) {
+	entry->newer = NULL;
+	entry->older = daemon->newest;
+	if (daemon->newest != NULL) {
+		daemon->newest->newer = entry;
+	} else {
+		daemon->oldest = entry;
+	}
+	daemon->newest = entry;
+}
+
+
+static void lexd_insert(lexd_t *daemon, lexd_entry_t *entry) {
+	// keep the load factor at or below 1, unless the table can't grow
+	if (daemon->stats.cached_sources >= daemon->num_buckets) {
+		size_t num_buckets = daemon->num_buckets*2;
+		lexd_entry_t **buckets = calloc(num_buckets, sizeof(lexd_entry_t*));
+		if (buckets != NULL) {
+			size_t index = 0;
+			for (; index < daemon->num_buckets; ++index) {
+				lexd_entry_t *iter = daemon->buckets[index];
+				while (iter != NULL) {
+					lexd_entry_t *next = iter->chain;
+					lexd_entry_t **bucket = buckets+(iter->hash & (num_buckets-1));
+					iter->chain = *bucket;
+					*bucket = iter;
+					iter = next;
+				}
+			}
+			free(daemon->buckets);
+			daemon->buckets = buckets;
+			daemon->num_buckets = num_buckets;
+		}
+	}
+	
+	lexd_entry_t **bucket = daemon->buckets+(entry->hash & (daemon->num_buckets-1));
+	entry->chain = *bucket;
+	*bucket = entry;
+	entry->cached = true;
+	lexd_link_lru(daemon, entry);
+	daemon->stats.cached_sources += 1;
+	daemon->stats.cached_bytes += entry->size;
+}
+
+
+/* drops the least recently used sources until the cache fits its size */
+static void lexd_evict(lexd_t *daemon) {
+	while (daemon->stats.cached_bytes > daemon->cache_size && daemon->oldest != NULL) {
+		lexd_entry_t *entry = daemon->oldest;
+		lexd_entry_t **link = daemon->buckets+(entry->hash & (daemon->num_buckets-1));
+		while (*link != entry) {
+			link = &(*link)->chain;
+		}
+		*link = entry->chain;
+		lexd_unlink_lru(daemon, entry);
+		
+		entry->cached = false;
+		daemon->stats.cached_sources -= 1;
+		daemon->stats.cached_bytes -= entry->size;
+		if (entry->refs == 0) {
+			lexd_entry_free(entry);
+		}
+	}
+}
+
+
+static void lexd_release(lexd_t *daemon, lexd_entry_t *entry) {
+	pthread_mutex_lock(&daemon->lock);
+	if (--entry->refs == 0 && !entry->cached) {
+		lexd_entry_free(entry);
+	}
+	pthread_mutex_unlock(&daemon->lock);
+}
+
+
+/* returns the cached entry for the source, lexing and caching it if there isn't one - the source is either taken
+   over or freed; returns NULL if out of memory */
+static lexd_entry_t *lexd_lookup(lexd_t *daemon, char *source, size_t length, unsigned int options, bool *cached) {
+	uint64_t hash = lexd_hash(source, length, options);
+	
+	pthread_mutex_lock(&daemon->lock);
+	daemon->stats.requests += 1;
+	lexd_entry_t *entry = lexd_find(daemon, hash, options, source, length);
+	if (entry != NULL) {
+		daemon->stats.hits += 1;
+		++entry->refs;
+		lexd_unlink_lru(daemon, entry);
+		lexd_link_lru(daemon, entry);
+	}
+	pthread_mutex_unlock(&daemon->lock);
+	
+	*cached = (entry != NULL);
+	if (entry != NULL) {
+		free(source);
+		return entry;
+	}
+	
+	// lexed without holding the lock, so another connection may have cached the same source in the meantime
+	lexd_entry_t *lexed = lexd_lex(source, length, hash, options);
+	if (lexed == NULL) {
+		free(source);
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&daemon->lock);
+	entry = lexd_find(daemon, hash, options, lexed->source, length);
+	if (entry != NULL) {
+		++entry->refs;
+	} else {
+		entry = lexed;
+		entry->refs = 1;
+		lexd_insert(daemon, entry);
+		lexd_evict(daemon);
+	}
+	pthread_mutex_unlock(&daemon->lock);
+	
+	if (entry != lexed) {
+		lexd_entry_free(lexed);
+	}
+	return entry;
+}
+
+
+/** server **/
+
+/* entry is NULL for a request that failed, in which case error says why */
+static int lexd_write_result(int fd, lexd_status_t status, unsigned int flags, const lexd_entry_t *entry,
+		const char *error) {
+	lexd_result_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.status = status;
+	
+	struct iovec iov[5];
+	int count = 1;
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	
+	size_t error_length = (error != NULL ? strlen(error) : 0);
+	if (entry != NULL) {
+		header.num_tokens = entry->num_tokens;
+		header.source_length = entry->source_length;
+		iov[count].iov_base = entry->tokens;
+		iov[count++].iov_len = entry->num_tokens*sizeof(token_ofs64_t);
+		
+		if (flags & LEXD_RESULT_SOURCE) {
+			// the entry's source is terminated, so only the padding past its terminator comes from elsewhere
+			iov[count].iov_base = entry->source;
+			iov[count++].iov_len = entry->source_length+1;
+			iov[count].iov_base = (void*)lexd_zeroes;
+			iov[count++].iov_len = (size_t)(LEXD_STRING_SIZE(entry->source_length)-entry->source_length-1);
+		}
+		error = entry->error;
+		error_length = entry->error_length;
+	}
+	header.flags = flags;
+	header.error_length = error_length;
+	
+	if (error != NULL) {
+		iov[count].iov_base = (void*)error;
+		iov[count++].iov_len = error_length+1;
+		iov[count].iov_base = (void*)lexd_zeroes;
+		iov[count++].iov_len = (size_t)(LEXD_STRING_SIZE(error_length)-error_length-1);
+	}
+	return lexd_send_all(fd, iov, count);
+}
+
+
+static int lexd_answer(lexd_t *daemon, int fd, lexd_job_t *job) {
+	const lexd_request_t *request = &job->request;
+	unsigned int flags = ((request->flags & LEXD_REQUEST_WANT_SOURCE) ? LEXD_RESULT_SOURCE : 0);
+	if ((request->options & ~(uint32_t)LEXD_OPTIONS) != 0 ||
+		(request->kind != LEXD_REQUEST_PATH && request->kind != LEXD_REQUEST_BUFFER)) {
+		return lexd_write_result(fd, LEXD_STATUS_BAD_REQUEST, 0, NULL, "Unknown request kind or options\n");
+	}
+	
+	char *source = job->data;
+	size_t length = (size_t)request->length;
+	if (request->kind == LEXD_REQUEST_PATH) {
+		source = lexd_read_file(job->data, &length);
+		if (source == NULL) {
+			char message[128];
+			snprintf(message, sizeof(message), "Can't read the file: %s\n", strerror(errno));
+			return lexd_write_result(fd, LEXD_STATUS_READ_ERROR, 0, NULL, message);
+		}
+	} else {
+		job->data = NULL;
+	}
+	
+	bool cached;
+	lexd_entry_t *entry = lexd_lookup(daemon, source, length, request->options, &cached);
+	if (entry == NULL) {
+		return -1;
+	}
+	
+	int result = lexd_write_result(fd, entry->status, flags | (cached ? LEXD_RESULT_CACHED : 0), entry, NULL);
+	lexd_release(daemon, entry);
+	return result;
+}
+
+
+/* reads a batch and answers it - returns 0 on success or -1 if the connection should be closed */
+static int lexd_serve_batch(lexd_t *daemon, int fd) {
+	lexd_batch_header_t header;
+	if (lexd_read_all(fd, &header, sizeof(header)) != 0 || header.magic != LEXD_MAGIC ||
+		header.version != LEXD_VERSION || header.num_records > LEXD_MAX_RECORDS) {
+		return -1;
+	}
+	
+	// the whole batch is read before any of it is answered, so a client still writing a large batch is never
+	// blocked by replies it isn't reading yet
+	lexd_job_t *jobs = calloc(header.num_records+1, sizeof(lexd_job_t));
+	if (jobs == NULL) {
+		return -1;
+	}
+	
+	int result = 0;
+	uint64_t total = 0;
+	uint32_t index = 0;
+	for (; index < header.num_records && result == 0; ++index) {
+		lexd_job_t *job = jobs+index;
+		if (lexd_read_all(fd, &job->request, sizeof(job->request)) != 0 || job->request.length > LEXD_MAX_SOURCE ||
+			(total += LEXD_STRING_SIZE(job->request.length)) > LEXD_MAX_BATCH) {
+			result = -1;
+			break;
+		}
+		
+		size_t size = (size_t)LEXD_STRING_SIZE(job->request.length);
+		job->data = malloc(size);
+		if (job->data == NULL || lexd_read_all(fd, job->data, size) != 0) {
+			result = -1;
+			break;
+		}
+		job->data[job->request.length] = 0;
+	}
+	
+	if (result == 0) {
+		header.reserved = 0;
+		struct iovec iov = { &header, sizeof(header) };
+		result = lexd_send_all(fd, &iov, 1);
+	}
+	for (index = 0; index < header.num_records && result == 0; ++index) {
+		result = lexd_answer(daemon, fd, jobs+index);
+	}
+	
+	for (index = 0; index < header.num_records; ++index) {
+		free(jobs[index].data);
+	}
+	free(jobs);
+	return result;
+}
+
+
+static void *lexd_connection_main(void *connection) {
+	lexd_connection_t *self = connection;
+	lexd_t *daemon = self->daemon;
+	while (!atomic_load(&daemon->stopping) && lexd_serve_batch(daemon, self->fd) == 0) {
+	}
+	
+	// unlinked before it's closed, so lexd_serve never shuts down a descriptor that's been reused
+	pthread_mutex_lock(&daemon->lock);
+	lexd_connection_t **link = &daemon->connections;
+	while (*link != self) {
+		link = &(*link)->next;
+	}
+	*link = self->next;
+	daemon->stats.connections -= 1;
+	pthread_cond_signal(&daemon->idle);
+	pthread_mutex_unlock(&daemon->lock);
+	
+	close(self->fd);
+	free(self);
+	return NULL;
+}
+
+
+lexd_t *lexd_new(const char *socket_path, size_t cache_size) {
+	struct sockaddr_un address;
+	if (socket_path == NULL || strlen(socket_path) >= sizeof(address.sun_path)) {
+		return NULL;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	
+	// a socket nobody answers on was left behind by a daemon that died, but one that answers is in use - and
+	// anything else at the path isn't ours to remove
+	struct stat info;
+	if (lstat(socket_path, &info) == 0) {
+		if (!S_ISSOCK(info.st_mode)) {
+			return NULL;
+		}
+		
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1) {
+			return NULL;
+		} else if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+			close(fd);
+			return NULL;
+		}
+		close(fd);
+		unlink(socket_path);
+	}
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	// only the user running the daemon may connect - the paths it's sent are read with that user's rights.  the
+	// socket is created with those permissions rather than chmod'ed after bind, which would leave it open to everyone
+	// in between.  the umask is process wide, so files other threads create during the bind get it too
+	mode_t mask = umask(0177);
+	int bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+	umask(mask);
+	if (bound != 0) {
+		close(fd);
+		return NULL;
+	}
+	if (listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		unlink(socket_path);
+		return NULL;
+	}
+	
+	lexd_t *daemon = calloc(1, sizeof(lexd_t));
+	lexd_entry_t **buckets = calloc(LEXD_INITIAL_BUCKETS, sizeof(lexd_entry_t*));
+	char *path = strdup(socket_path);
+	if (daemon == NULL || buckets == NULL || path == NULL) {
+		free(daemon);
+		free(buckets);
+		free(path);
+		close(fd);
+		unlink(socket_path);
+		return NULL;
+	}
+	
+	daemon->fd = fd;
+	daemon->path = path;
+	atomic_init(&daemon->stopping, false);
+	pthread_mutex_init(&daemon->lock, NULL);
+	pthread_cond_init(&daemon->idle, NULL);
+	daemon->buckets = buckets;
+	daemon->num_buckets = LEXD_INITIAL_BUCKETS;
+	daemon->cache_size = cache_size;
+	return daemon;
+}
+
+
+int lexd_serve(lexd_t *daemon) {
+	if (daemon == NULL) {
+		return -1;
+	}
+	
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	
+	int result = 0;
+	while (!atomic_load(&daemon->stopping)) {
+		int fd = accept(daemon->fd, NULL, NULL);
+		if (fd == -1) {
+			if (atomic_load(&daemon->stopping)) {
+				break;
+			} else if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			} else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// out of descriptors or memory until some connections close
+				usleep(10000);
+				continue;
+			}
+			result = -1;
+			break;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		lexd_no_sigpipe(fd);
+		
+		lexd_connection_t *connection = malloc(sizeof(lexd_connection_t));
+		if (connection == NULL) {
+			close(fd);
+			continue;
+		}
+		connection->fd = fd;
+		connection->daemon = daemon;
+		
+		pthread_mutex_lock(&daemon->lock);
+		connection->next = daemon->connections;
+		daemon->connections = connection;
+		daemon->stats.connections += 1;
+		pthread_mutex_unlock(&daemon->lock);
+		
+		pthread_t thread;
+		if (pthread_create(&thread, &attributes, lexd_connection_main, connection) != 0) {
+			pthread_mutex_lock(&daemon->lock);
+			daemon->connections = connection->next;
+			daemon->stats.connections -= 1;
+			pthread_mutex_unlock(&daemon->lock);
+			close(fd);
+			free(connection);
+		}
+	}
+	pthread_attr_destroy(&attributes);
+	
+	// wake every connection out of its read and wait for them to finish
+	pthread_mutex_lock(&daemon->lock);
+	lexd_connection_t *connection = daemon->connections;
+	for (; connection != NULL; connection = connection->next) {
+		shutdown(connection->fd, SHUT_RDWR);
+	}
+	while (daemon->stats.connections > 0) {
+		pthread_cond_wait(&daemon->idle, &daemon->lock);
+	}
+	pthread_mutex_unlock(&daemon->lock);
+	
+	return result;
+}
+
+
+void lexd_stop(lexd_t *daemon) {
+	if (daemon == NULL) {
+		return;
+	}
+	
+	atomic_store(&daemon->stopping, true);
+	// wakes lexd_serve out of accept
+	shutdown(daemon->fd, SHUT_RDWR);
+}
+
+
+void lexd_destroy(lexd_t *daemon) {
+	if (daemon == NULL) {
+		return;
+	}
+	
+	close(daemon->fd);
+	unlink(daemon->path);
+	free(daemon->path);
+	
+	lexd_entry_t *entry = daemon->newest;
+	while (entry != NULL) {
+		lexd_entry_t *older = entry->older;
+		lexd_entry_free(entry);
+		entry = older;
+	}
+	free(daemon->buckets);
+	pthread_mutex_destroy(&daemon->lock);
+	pthread_cond_destroy(&daemon->idle);
+	free(daemon);
+}
+
+
+void lexd_get_stats(lexd_t *daemon, lexd_stats_t *stats) {
+	if (daemon == NULL || stats == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&daemon->lock);
+	*stats = daemon->stats;
+	pthread_mutex_unlock(&daemon->lock);
+}
+
+
+/** client **/
+
+int lexd_connect(const char *socket_path) {
+	struct sockaddr_un address;
+	if (socket_path == NULL || strlen(socket_path) >= sizeof(address.sun_path)) {
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	} else if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	lexd_no_sigpipe(fd);
+	return fd;
+}
+
+
+lexd_batch_t *lexd_batch_new(void) {
+	return calloc(1, sizeof(lexd_batch_t));
+}
+
+
+void lexd_batch_destroy(lexd_batch_t *batch) {
+	if (batch == NULL) {
+		return;
+	}
+	
+	int index = 0;
+	for (; index < batch->num_records; ++index) {
+		free(batch->records[index].path);
+	}
+	free(batch->records);
+	free(batch);
+}
+
+
+static lexd_record_t *lexd_batch_add(lexd_batch_t *batch) {
+	if (batch->num_records == LEXD_MAX_RECORDS) {
+		return NULL;
+	}
+	
+	if (batch->num_records == batch->capacity) {
+		int capacity = (batch->capacity > 0 ? batch->capacity*2 : 16);
+		lexd_record_t *records = realloc(batch->records, (size_t)capacity*sizeof(lexd_record_t));
+		if (records == NULL) {
+			return NULL;
+		}
+		batch->records = records;
+		batch->capacity = capacity;
+	}
+	
+	lexd_record_t *record = batch->records+batch->num_records;
+	memset(record, 0, sizeof(lexd_record_t));
+	return record;
+}
+
+
+int lexd_batch_add_path(lexd_batch_t *batch, const char *path, unsigned int flags, unsigned int options) {
+	if (batch == NULL || path == NULL) {
+		return -1;
+	}
+	
+	lexd_record_t *record = lexd_batch_add(batch);
+	if (record == NULL) {
+		return -1;
+	}
+	
+	// the daemon's working directory isn't ours
+	if (path[0] != '/') {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof(cwd)) == NULL) {
+			return -1;
+		}
+		size_t cwd_len = strlen(cwd);
+		record->path = malloc(cwd_len+strlen(path)+2);
+		if (record->path != NULL) {
+			sprintf(record->path, "%s/%s", cwd, path);
+		}
+	} else {
+		record->path = strdup(path);
+	}
+	if (record->path == NULL) {
+		return -1;
+	}
+	
+	record->request.kind = LEXD_REQUEST_PATH;
+	record->request.flags = flags;
+	record->request.options = options;
+	record->request.length = strlen(record->path);
+	record->data = record->path;
+	batch->num_records += 1;
+	return 0;
+}
+
+
+int lexd_batch_add_buffer(lexd_batch_t *batch, const char *source, size_t length, unsigned int flags,
+		unsigned int options) {
+	if (batch == NULL || (source == NULL && length > 0) || length > LEXD_MAX_SOURCE) {
+		return -1;
+	}
+	
+	lexd_record_t *record = lexd_batch_add(batch);
+	if (record == NULL) {
+		return -1;
+	}
+	
+	record->request.kind = LEXD_REQUEST_BUFFER;
+	record->request.flags = flags;
+	record->request.options = options;
+	record->request.length = length;
+	record->data = (source != NULL ? source : "");
+	batch->num_records += 1;
+	return 0;
+}
+
+
+lexd_reply_t *lexd_batch_send(int socket, lexd_batch_t *batch) {
+	if (socket < 0 || batch == NULL) {
+		return NULL;
+	}
+	
+	// a record's data is sent without its terminator, which comes from the padding instead
+	lexd_batch_header_t header = { LEXD_MAGIC, LEXD_VERSION, (uint32_t)batch->num_records, 0 };
+	int count = 1+batch->num_records*3;
+	struct iovec *iov = malloc((size_t)count*sizeof(struct iovec));
+	if (iov == NULL) {
+		return NULL;
+	}
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	int index = 0;
+	for (; index < batch->num_records; ++index) {
+		lexd_record_t *record = batch->records+index;
+		size_t length = (size_t)record->request.length;
+		struct iovec *place = iov+1+index*3;
+		place[0].iov_base = &record->request;
+		place[0].iov_len = sizeof(lexd_request_t);
+		place[1].iov_base = (void*)record->data;
+		place[1].iov_len = length;
+		place[2].iov_base = (void*)lexd_zeroes;
+		place[2].iov_len = (size_t)(LEXD_STRING_SIZE(length)-length);
+	}
+	int sent = lexd_send_all(socket, iov, count);
+	free(iov);
+	
+	lexd_batch_header_t reply_header;
+	if (sent != 0 || lexd_read_all(socket, &reply_header, sizeof(reply_header)) != 0 ||
+		reply_header.magic != LEXD_MAGIC || reply_header.num_records != (uint32_t)batch->num_records) {
+		return NULL;
+	}
+	
+	lexd_reply_t *reply = calloc(1, sizeof(lexd_reply_t));
+	if (reply == NULL) {
+		return NULL;
+	}
+	reply->results = malloc(((size_t)batch->num_records+1)*sizeof(size_t));
+	if (reply->results == NULL) {
+		free(reply);
+		return NULL;
+	}
+	
+	size_t length = 0;
+	size_t capacity = 0;
+	for (index = 0; index < batch->num_records; ++index) {
+		lexd_result_header_t result;
+		if (lexd_read_all(socket, &result, sizeof(result)) != 0 ||
+			result.num_tokens > 2*LEXD_MAX_SOURCE+2 || result.source_length > LEXD_MAX_SOURCE ||
+			result.error_length > LEXD_MAX_SOURCE) {
+			lexd_reply_destroy(reply);
+			return NULL;
+		}
+		
+		size_t body = (size_t)result.num_tokens*sizeof(token_ofs64_t);
+		if (result.flags & LEXD_RESULT_SOURCE) {
+			body += (size_t)LEXD_STRING_SIZE(result.source_length);
+		}
+		if (result.error_length > 0) {
+			body += (size_t)LEXD_STRING_SIZE(result.error_length);
+		}
+		
+		size_t needed = length+sizeof(result)+body;
+		if (needed > capacity) {
+			capacity = (needed > capacity*2 ? needed : capacity*2);
+			char *data = realloc(reply->data, capacity);
+			if (data == NULL) {
+				lexd_reply_destroy(reply);
+				return NULL;
+			}
+			reply->data = data;
+		}
+		
+		reply->results[index] = length;
+		memcpy(reply->data+length, &result, sizeof(result));
+		if (lexd_read_all(socket, reply->data+length+sizeof(result), body) != 0) {
+			lexd_reply_destroy(reply);
+			return NULL;
+		}
+		length = needed;
+		reply->num_results += 1;
+	}
+	
+	return reply;
+}
+
+
+void lexd_reply_destroy(lexd_reply_t *reply) {
+	if (reply == NULL) {
+		return;
+	}
+	
+	free(reply->data);
+	free(reply->results);
+	free(reply);
+}
+
+
+int lexd_reply_get_num_results(lexd_reply_t *reply) {
+	return (reply != NULL ? reply->num_results : 0);
+}
+
+
+int lexd_reply_get_result(lexd_reply_t *reply, int index, lexd_result_t *result) {
+	if (reply == NULL || result == NULL || index < 0 || reply->num_results <= index) {
+		return -1;
+	}
+	
+	const char *place = reply->data+reply->results[index];
+	lexd_result_header_t header;
+	memcpy(&header, place, sizeof(header));
+	place += sizeof(header);
+	
+	result->status = (lexd_status_t)header.status;
+	result->flags = header.flags;
+	result->tokens = (const token_ofs64_t*)place;
+	result->num_tokens = (size_t)header.num_tokens;
+	place += result->num_tokens*sizeof(token_ofs64_t);
+	
+	result->source = NULL;
+	result->source_length = (size_t)header.source_length;
+	if (header.flags & LEXD_RESULT_SOURCE) {
+		result->source = place;
+		place += LEXD_STRING_SIZE(header.source_length);
+	}
+	result->error = (header.error_length > 0 ? place : NULL);
+	return 0;
+}
+
+
+#ifdef LEXD_MAIN
+
+/*
+a standalone daemon - build with something along the lines of
+	cc -O2 -DLEXD_MAIN lexer.c lexer_daemon.c -lpthread -o lexd
+and run it as lexd /path/to/socket [cache size in MB]
+*/
+static lexd_t *lexd_main_daemon;
+
+static void lexd_main_stop(int signal) {
+	(void)signal;
+	lexd_stop(lexd_main_daemon);
+}
+
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s socket [cache size in MB]\n", argv[0]);
+		return 2;
+	}
+	
+	size_t cache_mb = (argc > 2 ? (size_t)strtoul(argv[2], NULL, 10) : 256);
+	lexd_main_daemon = lexd_new(argv[1], cache_mb << 20);
+	if (lexd_main_daemon == NULL) {
+		fprintf(stderr, "%s: can't listen on %s (is another daemon running?)\n", argv[0], argv[1]);
+		return 1;
+	}
+	
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = lexd_main_stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
+	
+	int result = lexd_serve(lexd_main_daemon);
+	lexd_destroy(lexd_main_daemon);
+	return (result == 0 ? 0 : 1);
+}
+
+#endif /* LEXD_MAIN */
@@ -0,0 +1,167 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_DAEMON_H_R4KD8WZT
+#define LEXER_DAEMON_H_R4KD8WZT
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+a lexing daemon for tools that would otherwise each start cold: it listens on a
+Unix domain socket, lexes batches of sources sent by path or inline, and keeps
+the results in a cache keyed by a hash of each source's contents, so every
+client connected to it shares one cache.
+
+the protocol is a request batch answered by a reply batch, as many times as the
+client likes over one connection.  integers are in host byte order, since both
+ends are on the same host.  every string is followed by at least one zero byte
+and padded to a multiple of 8 bytes (LEXD_STRING_SIZE), so the tokens of a reply
+can be used where they were read and the source can be lexed where it is:
+	
+	request batch   lexd_batch_header_t, then num_records of
+	                lexd_request_t followed by the path or source
+	reply batch     lexd_batch_header_t, then num_records (one per request) of
+	                lexd_result_header_t followed by num_tokens token_ofs64_t,
+	                the source if LEXD_RESULT_SOURCE is set and the error if
+	                error_length isn't 0
+
+a malformed or oversized batch closes the connection.
+*/
+
+#define LEXD_MAGIC 0x44584d42u /* "BMXD" */
+#define LEXD_VERSION 1
+/* size of a string of length n in the protocol, counting its terminator and padding */
+#define LEXD_STRING_SIZE(n) (((uint64_t)(n)+8) & ~(uint64_t)7)
+
+typedef struct s_lexd_batch_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_records;
+	uint32_t reserved;
+} lexd_batch_header_t;
+
+typedef enum {
+	LEXD_REQUEST_PATH=1, /* the source is read from the absolute path that follows */
+	LEXD_REQUEST_BUFFER=2, /* the source follows */
+} lexd_request_kind_t;
+
+typedef enum {
+	/* send the source back along with the tokens - useful for paths, since the file may change afterwards */
+	LEXD_REQUEST_WANT_SOURCE=1<<0,
+} lexd_request_flag_t;
+
+typedef struct s_lexd_request {
+	uint32_t kind; /* lexd_request_kind_t */
+	uint32_t flags; /* lexd_request_flag_t */
+	uint32_t options; /* lexer_option_t - only LEXER_OPT_FOLD_CONTINUATIONS and LEXER_OPT_UTF8_IDENTIFIERS */
+	uint32_t reserved;
+	uint64_t length; /* of the path or source, not padded */
+} lexd_request_t;
+
+typedef enum {
+	LEXD_STATUS_OK=0,
+	LEXD_STATUS_LEX_ERROR=1, /* the tokens end where lexing failed and the error says why */
+	LEXD_STATUS_READ_ERROR=-1, /* the path couldn't be read - there are no tokens */
+	LEXD_STATUS_BAD_REQUEST=-2, /* unknown kind or options - there are no tokens */
+} lexd_status_t;
+
+typedef enum {
+	LEXD_RESULT_CACHED=1<<0, /* the tokens came from the cache */
+	LEXD_RESULT_SOURCE=1<<1, /* the source follows the tokens */
+} lexd_result_flag_t;
+
+typedef struct s_lexd_result_header {
+	int32_t status; /* lexd_status_t */
+	uint32_t flags; /* lexd_result_flag_t */
+	uint64_t num_tokens;
+	uint64_t source_length; /* sent only with LEXD_RESULT_SOURCE, but always the length of the source lexed */
+	uint64_t error_length; /* 0 if there's no error */
+} lexd_result_header_t;
+
+typedef struct s_lexd_stats {
+	uint64_t requests, hits;
+	size_t cached_sources, cached_bytes;
+	int connections; /* open right now */
+} lexd_stats_t;
+
+/** server **/
+
+typedef struct s_lexd lexd_t;
+
+/* binds the socket, replacing a stale one at the path but failing if a daemon is listening on it, and keeps up to
+   cache_size bytes of sources and tokens - returns NULL on error */
+lexd_t *lexd_new(const char *socket_path, size_t cache_size);
+/* accepts connections and serves each on a thread of its own until lexd_stop - returns 0 once stopped, -1 on error */
+int lexd_serve(lexd_t *daemon);
+/* makes lexd_serve close every connection and return - safe to call from a signal handler */
+void lexd_stop(lexd_t *daemon);
+/* removes the socket and releases the daemon - lexd_serve must have returned */
+void lexd_destroy(lexd_t *daemon);
+void lexd_get_stats(lexd_t *daemon, lexd_stats_t *stats);
+
+/** client **/
+
+typedef struct s_lexd_batch lexd_batch_t;
+typedef struct s_lexd_reply lexd_reply_t;
+
+/* a result pointing into its reply - valid until the reply is destroyed */
+typedef struct s_lexd_result {
+	lexd_status_t status;
+	unsigned int flags; /* lexd_result_flag_t */
+	const token_ofs64_t *tokens;
+	size_t num_tokens;
+	const char *source; /* NULL unless LEXD_RESULT_SOURCE is set */
+	size_t source_length;
+	const char *error; /* NULL if there's no error */
+} lexd_result_t;
+
+/* connects to the daemon - returns the socket or -1 on error */
+int lexd_connect(const char *socket_path);
+lexd_batch_t *lexd_batch_new(void);
+void lexd_batch_destroy(lexd_batch_t *batch);
+/* adds a file to the batch - relative paths are made absolute first; returns 0 on success or -1 on error */
+int lexd_batch_add_path(lexd_batch_t *batch, const char *path, unsigned int flags, unsigned int options);
+/* adds a source to the batch without copying it, so it has to stay valid until the batch is sent - returns 0 on
+   success or -1 on error */
+int lexd_batch_add_buffer(lexd_batch_t *batch, const char *source, size_t length, unsigned int flags,
+		unsigned int options);
+/* sends the batch over the connection and waits for the reply, with one result per request in the order they were
+   added - returns NULL on error, after which the connection should be closed */
+lexd_reply_t *lexd_batch_send(int socket, lexd_batch_t *batch);
+void lexd_reply_destroy(lexd_reply_t *reply);
+int lexd_reply_get_num_results(lexd_reply_t *reply);
+/* copies the result at the index to result - returns 0 on success or -1 if out of range */
+int lexd_reply_get_result(lexd_reply_t *reply, int index, lexd_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_DAEMON_H_R4KD8WZT */
@@ -0,0 +1,734 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+// strdup, realpath and strcasecmp aren't declared in strict C99 otherwise
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lexer.h"
+#include "lexer_deps.h"
+
+const int DEP_GRAPH_INITIAL_CAPACITY = 256;
+
+typedef struct s_dep_edge {
+	int target;
+	dep_edge_kind_t kind;
+} dep_edge_t;
+
+typedef struct s_dep_node {
+	dep_node_kind_t kind;
+	char *name;
+	int num_edges, edges_capacity;
+	dep_edge_t *edges;
+	int cycle;
+} dep_node_t;
+
+struct s_dep_graph {
+	char *mod_path;
+	unsigned int flags;
+	
+	int num_nodes, capacity;
+	dep_node_t *nodes;
+	
+	// open-addressed map of node names to node indices, -1 for empty slots
+	int *map;
+	size_t map_capacity;
+	
+	// source nodes waiting to be scanned
+	int *queue;
+	int queue_head, queue_tail, queue_capacity;
+	int num_active;
+	bool failed;	// something couldn't be allocated while scanning, so dep_graph_scan fails
+	
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+};
+
+static size_t dep_hash_name(const char *name);
+static int dep_graph_find(dep_graph_t *graph, const char *name);
+static int dep_graph_add_node(dep_graph_t *graph, const char *name, dep_node_kind_t kind);
+static void dep_graph_add_edge(dep_graph_t *graph, int from, int to, dep_edge_kind_t kind);
+static bool dep_graph_enqueue(dep_graph_t *graph, int node);
+static char *dep_join_path(const char *dir, const char *path, size_t path_len);
+static bool dep_is_source(const char *path);
+static char *dep_read_file(const char *path, size_t *length);
+static void dep_graph_mark_missing(dep_graph_t *graph, int node, bool failed);
+static void dep_graph_scan_node(dep_graph_t *graph, int node);
+static void *dep_graph_worker(void *graph);
+
+
+dep_graph_t *dep_graph_new(const char *mod_path, unsigned int flags) {
+	dep_graph_t *graph = calloc(1, sizeof(dep_graph_t));
+	if (graph == NULL) {
+		return NULL;
+	}
+	
+	graph->mod_path = (mod_path != NULL ? strdup(mod_path) : NULL);
+	graph->flags = flags;
+	graph->num_nodes = 0;
+	graph->capacity = DEP_GRAPH_INITIAL_CAPACITY;
+	graph->nodes = malloc((size_t)graph->capacity*sizeof(dep_node_t));
+	graph->map_capacity = (size_t)DEP_GRAPH_INITIAL_CAPACITY*2;
+	graph->map = malloc(graph->map_capacity*sizeof(int));
+	graph->queue_head = graph->queue_tail = 0;
+	graph->queue_capacity = DEP_GRAPH_INITIAL_CAPACITY;
+	graph->queue = malloc((size_t)graph->queue_capacity*sizeof(int));
+	graph->num_active = 0;
+	graph->failed = false;
+	pthread_mutex_init(&graph->lock, NULL);
+	pthread_cond_init(&graph->work, NULL);
+	
+	if ((mod_path != NULL && graph->mod_path == NULL) || graph->nodes == NULL || graph->map == NULL ||
+		graph->queue == NULL) {
+		dep_graph_destroy(graph);
+		return NULL;
+	}
+	memset(graph->map, 0xff, graph->map_capacity*sizeof(int));
+	
+	return graph;
+}
+
+
+void dep_graph_destroy(dep_graph_t *graph) {
+	if (graph == NULL) {
+		return;
+	}
+	
+	int index = 0;
+	for (; index < graph->num_nodes; ++index) {
+		free(graph->nodes[index].name);
+		free(graph->nodes[index].edges);
+	}
+	free(graph->nodes);
+	free(graph->map);
+	free(graph->queue);
+	free(graph->mod_path);
+	pthread_mutex_destroy(&graph->lock);
+	pthread_cond_destroy(&graph->work);
+	
+	free(graph);
+}
+
+
+static size_t dep_hash_name(const char *name) {
+	// FNV-1a
+	size_t hash = (size_t)14695981039346656037ULL;
+	for (; *name; ++name) {
+		hash ^= (unsigned char)*name;
+		hash *= (size_t)1099511628211ULL;
+	}
+	return hash;
+}
+
+
+/* the graph must be locked, or not being scanned */
+static int dep_graph_find(dep_graph_t *graph, const char *name) {
+	size_t slot = dep_hash_name(name) & (graph->map_capacity-1);
+	while (graph->map[slot] != -1) {
+		if (strcmp(graph->nodes[graph->map[slot]].name, name) == 0) {
+			return graph->map[slot];
+		}
+		slot = (slot+1) & (graph->map_capacity-1);
+	}
+	return -1;
+}
+
+
+/*
+returns the existing node for the name or adds a new one, or returns -1 and
+fails the scan if it can't be added - the graph must be locked, or not being
+scanned
+*/
+static int dep_graph_add_node(dep_graph_t *graph, const char *name, dep_node_kind_t kind) {
+	int existing = dep_graph_find(graph, name);
+	if (existing != -1) {
+		return existing;
+	}
+	
+	if (graph->num_nodes == graph->capacity) {
+		dep_node_t *nodes = (graph->capacity <= INT_MAX/2 ?
+							 realloc(graph->nodes, (size_t)graph->capacity*2*sizeof(dep_node_t)) : NULL);
+		if (nodes == NULL) {
+			graph->failed = true;
+			return -1;
+		}
+		graph->nodes = nodes;
+		graph->capacity *= 2;
+	}
+	
+	char *copy = strdup(name);
+	if (copy == NULL) {
+		graph->failed = true;
+		return -1;
+	}
+	
+	// keep the map at most half full
+	if ((size_t)(graph->num_nodes+1)*2 > graph->map_capacity) {
+		size_t map_capacity = graph->map_capacity*2;
+		int *map = malloc(map_capacity*sizeof(int));
+		if (map == NULL) {
+			free(copy);
+			graph->failed = true;
+			return -1;
+		}
+		memset(map, 0xff, map_capacity*sizeof(int));
+		int index = 0;
+		for (; index < graph->num_nodes; ++index) {
+			size_t slot = dep_hash_name(graph->nodes[index].name) & (map_capacity-1);
+			while (map[slot] != -1) {
+				slot = (slot+1) & (map_capacity-1);
+			}
+			map[slot] = index;
+		}
+		free(graph->map);
+		graph->map = map;
+		graph->map_capacity = map_capacity;
+	}
+	
+	int index = graph->num_nodes++;
+	dep_node_t *node = graph->nodes+index;
+	node->kind = kind;
+	node->name = copy;
+	node->num_edges = node->edges_capacity = 0;
+	node->edges = NULL;
+	node->cycle = -1;
+	
+	size_t slot = dep_hash_name(name) & (graph->map_capacity-1);
+	while (graph->map[slot] != -1) {
+		slot = (slot+1) & (graph->map_capacity-1);
+	}
+	graph->map[slot] = index;
+	
+	// a source that can't be queued is never scanned, so it's as good as unreadable
+	if (kind == DEP_SOURCE && !dep_graph_enqueue(graph, index)) {
+		node->kind = DEP_MISSING;
+		graph->failed = true;
+	}
+	
+	return index;
+}
+
+
+/* fails the scan if the edge can't be added - the graph must be locked, or not being scanned */
+static void dep_graph_add_edge(dep_graph_t *graph, int from, int to, dep_edge_kind_t kind) {
+	dep_node_t *node = graph->nodes+from;
+	int index = 0;
+	for (; index < node->num_edges; ++index) {
+		if (node->edges[index].target == to && node->edges[index].kind == kind) {
+			return;
+		}
+	}
+	
+	if (node->num_edges == node->edges_capacity) {
+		int capacity = (node->edges_capacity < 4 ? 4 : node->edges_capacity*2);
+		dep_edge_t *edges = realloc(node->edges, (size_t)capacity*sizeof(dep_edge_t));
+		if (edges == NULL) {
+			graph->failed = true;
+			return;
+		}
+		node->edges = edges;
+		node->edges_capacity = capacity;
+	}
+	node->edges[node->num_edges].target = to;
+	node->edges[node->num_edges].kind = kind;
+	++node->num_edges;
+}
+
+
+/* returns false if the queue can't grow */
+static bool dep_graph_enqueue(dep_graph_t *graph, int node) {
+	if (graph->queue_tail == graph->queue_capacity) {
+		if (graph->queue_head > 0) {
+			memmove(graph->queue, graph->queue+graph->queue_head,
+					(graph->queue_tail-graph->queue_head)*sizeof(int));
+			graph->queue_tail -= graph->queue_head;
+			graph->queue_head = 0;
+		}
+		if (graph->queue_tail == graph->queue_capacity) {
+			int *queue = realloc(graph->queue, (size_t)graph->queue_capacity*2*sizeof(int));
+			if (queue == NULL) {
+				return false;
+			}
+			graph->queue = queue;
+			graph->queue_capacity *= 2;
+		}
+	}
+	graph->queue[graph->queue_tail++] = node;
+	pthread_cond_signal(&graph->work);
+	return true;
+}
+
+
+/* joins dir and path and resolves the result to a canonical path if it exists - returns NULL if out of memory */
+static char *dep_join_path(const char *dir, const char *path, size_t path_len) {
+	size_t dir_len = (dir != NULL && path[0] != '/' ? strlen(dir) : 0);
+	char *joined = malloc(dir_len+path_len+2);
+	if (joined == NULL) {
+		return NULL;
+	}
+	if (dir_len > 0) {
+		memcpy(joined, dir, dir_len);
+		joined[dir_len++] = '/';
+	}
+	memcpy(joined+dir_len, path, path_len);
+	joined[dir_len+path_len] = 0;
+	
+	char *resolved = realpath(joined, NULL);
+	if (resolved != NULL) {
+		free(joined);
+		return resolved;
+	}
+	return joined;
+}
+
+
+static bool dep_is_source(const char *path) {
+	size_t len = strlen(path);
+	return (len > 4 && strcasecmp(path+len-4, ".bmx") == 0);
+}
+
+
+/* returns NULL if the file can't be read, with errno set to ENOMEM if it didn't fit in memory */
+static char *dep_read_file(const char *path, size_t *length) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+	
+	char *buf = NULL;
+	size_t capacity = 0;
+	size_t len = 0;
+	size_t read;
+	do {
+		if (capacity-len < 4096) {
+			size_t grown_capacity = (capacity < 16384 ? 16384 : capacity*2);
+			char *grown = (grown_capacity > capacity ? realloc(buf, grown_capacity+1) : NULL);
+			if (grown == NULL) {
+				free(buf);
+				fclose(file);
+				errno = ENOMEM;
+				return NULL;
+			}
+			buf = grown;
+			capacity = grown_capacity;
+		}
+		read = fread(buf+len, 1, capacity-len, file);
+		len += read;
+	} while (read > 0);
+	fclose(file);
+	
+	buf[len] = 0;
+	*length = len;
+	return buf;
+}
+
+
+/* marks a node that couldn't be read or scanned (failed if that's for lack of memory) - the graph must be unlocked */
+static void dep_graph_mark_missing(dep_graph_t *graph, int node, bool failed) {
+	pthread_mutex_lock(&graph->lock);
+	graph->nodes[node].kind = DEP_MISSING;
+	graph->failed = graph->failed || failed;
+	pthread_mutex_unlock(&graph->lock);
+}
+
+
+static void dep_graph_scan_node(dep_graph_t *graph, int node) {
+	pthread_mutex_lock(&graph->lock);
+	char *path = strdup(graph->nodes[node].name);
+	pthread_mutex_unlock(&graph->lock);
+	if (path == NULL) {
+		dep_graph_mark_missing(graph, node, true);
+		return;
+	}
+	
+	size_t length;
+	errno = 0;
+	char *source = dep_read_file(path, &length);
+	if (source == NULL) {
+		dep_graph_mark_missing(graph, node, errno == ENOMEM);
+		free(path);
+		return;
+	}
+	
+	unsigned int kinds = DECL_FRAMEWORK | DECL_MODULE | DECL_IMPORT | DECL_INCLUDE;
+	if ((graph->flags & DEP_SCAN_HEADER_ONLY) != 0) {
+		kinds |= DECL_HEADER_ONLY;
+	}
+	
+	// a source missing some of its dependencies is marked missing rather than trusted
+	bool failed = false;
+	lexer_t *lexer = lexer_new(source, source+length);
+	if (lexer == NULL || lexer_run_outline(lexer, kinds) != 0) {
+		failed = true;
+	}
+	
+	char *dir = strdup(path);
+	char *slash = (dir != NULL ? strrchr(dir, '/') : NULL);
+	if (dir == NULL) {
+		failed = true;
+	} else if (slash != NULL) {
+		*slash = 0;
+	} else {
+		free(dir);
+		dir = NULL;
+	}
+	
+	int num_decls = (lexer != NULL ? lexer_get_num_decls(lexer) : 0);
+	int index = 0;
+	for (; index < num_decls; ++index) {
+		decl_t decl;
+		lexer_get_decl(lexer, index, &decl);
+		size_t len = (size_t)(decl.to-decl.from);
+		bool quoted = (decl.from > source && decl.from[-1] == '"');
+		char *name;
+		
+		if (quoted) {
+			name = dep_join_path(dir, decl.from, len);
+		} else {
+			name = malloc(len+1);
+			size_t iter = 0;
+			for (; name != NULL && iter < len; ++iter) {
+				name[iter] = (char)tolower((unsigned char)decl.from[iter]);
+			}
+			if (name != NULL) {
+				name[len] = 0;
+			}
+		}
+		if (name == NULL) {
+			failed = true;
+			continue;
+		}
+		
+		// module sources live at mod_path/a.mod/b.mod/b.bmx for a.b
+		char *module_source = NULL;
+		const char *dot = strchr(name, '.');
+		if (!quoted && graph->mod_path != NULL && dot != NULL) {
+			size_t scope_len = (size_t)(dot-name);
+			const char *mod = dot+1;
+			size_t source_len = strlen(graph->mod_path)+2*strlen(mod)+scope_len+16;
+			char *joined = malloc(source_len);
+			if (joined != NULL) {
+				snprintf(joined, source_len, "%s/%.*s.mod/%s.mod/%s.bmx", graph->mod_path, (int)scope_len, name, mod,
+					mod);
+				module_source = dep_join_path(NULL, joined, strlen(joined));
+				free(joined);
+			}
+			if (module_source == NULL) {
+				free(name);
+				failed = true;
+				continue;
+			}
+		}
+		
+		pthread_mutex_lock(&graph->lock);
+		
+		// the graph's failed flag is set for any node or edge that couldn't be added
+		if (decl.kind == DECL_MODULE) {
+			int module = dep_graph_add_node(graph, name, DEP_MODULE);
+			if (module != -1) {
+				dep_graph_add_edge(graph, module, node, DEP_PROVIDED_BY);
+			}
+		} else {
+			dep_edge_kind_t kind = (decl.kind == DECL_INCLUDE ? DEP_INCLUDE :
+									decl.kind == DECL_FRAMEWORK ? DEP_FRAMEWORK : DEP_IMPORT);
+			int target;
+			if (quoted) {
+				target = dep_graph_add_node(graph, name, dep_is_source(name) ? DEP_SOURCE : DEP_EXTERNAL);
+			} else {
+				target = dep_graph_add_node(graph, name, DEP_MODULE);
+				if (target != -1 && module_source != NULL) {
+					int provider = dep_graph_add_node(graph, module_source, DEP_SOURCE);
+					if (provider != -1) {
+						dep_graph_add_edge(graph, target, provider, DEP_PROVIDED_BY);
+					}
+				}
+			}
+			if (target != -1) {
+				dep_graph_add_edge(graph, node, target, kind);
+			}
+		}
+		
+		pthread_mutex_unlock(&graph->lock);
+		
+		free(module_source);
+		free(name);
+	}
+	
+	if (failed) {
+		dep_graph_mark_missing(graph, node, true);
+	}
+	
+	lexer_destroy(lexer);
+	free(source);
+	free(dir);
+	free(path);
+}
+
+
+static void *dep_graph_worker(void *arg) {
+	dep_graph_t *graph = (dep_graph_t*)arg;
+	
+	pthread_mutex_lock(&graph->lock);
+	for (;;) {
+		while (graph->queue_head == graph->queue_tail && graph->num_active > 0) {
+			pthread_cond_wait(&graph->work, &graph->lock);
+		}
+		if (graph->queue_head == graph->queue_tail) {
+			// nothing queued and nobody left to queue anything
+			break;
+		}
+		
+		int node = graph->queue[graph->queue_head++];
+		++graph->num_active;
+		pthread_mutex_unlock(&graph->lock);
+		
+		dep_graph_scan_node(graph, node);
+		
+		pthread_mutex_lock(&graph->lock);
+		--graph->num_active;
+		if (graph->num_active == 0 && graph->queue_head == graph->queue_tail) {
+			pthread_cond_broadcast(&graph->work);
+		}
+	}
+	pthread_mutex_unlock(&graph->lock);
+	
+	return NULL;
+}
+
+
+int dep_graph_add_file(dep_graph_t *graph, const char *path) {
+	if (graph == NULL || path == NULL) {
+		return -1;
+	}
+	
+	char *resolved = dep_join_path(NULL, path, strlen(path));
+	if (resolved == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&graph->lock);
+	int node = dep_graph_add_node(graph, resolved, DEP_SOURCE);
+	pthread_mutex_unlock(&graph->lock);
+	free(resolved);
+	
+	return node;
+}
+
+
+int dep_graph_scan(dep_graph_t *graph, int num_threads) {
+	if (graph == NULL) {
+		return -1;
+	}
+	
+	if (num_threads <= 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = (cores > 0 ? (int)cores : 1);
+	}
+	
+	// without room for threads, everything is scanned on this one
+	pthread_t *threads = malloc((size_t)num_threads*sizeof(pthread_t));
+	int num_started = 0;
+	for (; threads != NULL && num_started < num_threads; ++num_started) {
+		if (pthread_create(threads+num_started, NULL, dep_graph_worker, graph) != 0) {
+			break;
+		}
+	}
+	
+	if (num_started == 0) {
+		dep_graph_worker(graph);
+	}
+	
+	int index = 0;
+	for (; index < num_started; ++index) {
+		pthread_join(threads[index], NULL);
+	}
+	free(threads);
+	
+	return (graph->failed ? -1 : 0);
+}
+
+
+int dep_graph_get_num_nodes(dep_graph_t *graph) {
+	return graph->num_nodes;
+}
+
+
+const char *dep_graph_get_node(dep_graph_t *graph, int node, dep_node_kind_t *kind) {
+	if (graph == NULL || node < 0 || graph->num_nodes <= node) {
+		return NULL;
+	}
+	if (kind != NULL) {
+		*kind = graph->nodes[node].kind;
+	}
+	return graph->nodes[node].name;
+}
+
+
+int dep_graph_get_num_edges(dep_graph_t *graph, int node) {
+	if (graph == NULL || node < 0 || graph->num_nodes <= node) {
+		return 0;
+	}
+	return graph->nodes[node].num_edges;
+}
+
+
+int dep_graph_get_edge(dep_graph_t *graph, int node, int edge, dep_edge_kind_t *kind) {
+	if (graph == NULL || node < 0 || graph->num_nodes <= node ||
+		edge < 0 || graph->nodes[node].num_edges <= edge) {
+		return -1;
+	}
+	if (kind != NULL) {
+		*kind = graph->nodes[node].edges[edge].kind;
+	}
+	return graph->nodes[node].edges[edge].target;
+}
+
+
+/*
+Tarjan's strongly connected components, done iteratively so deep import
+chains can't overflow the stack.  components are completed dependencies
+first, which is exactly the order we want to hand out.
+*/
+int dep_graph_get_order(dep_graph_t *graph, int *order) {
+	int num_nodes = graph->num_nodes;
+	if (num_nodes == 0) {
+		return 0;
+	}
+	
+	int *index_of = malloc((size_t)num_nodes*sizeof(int));
+	int *lowlink = malloc((size_t)num_nodes*sizeof(int));
+	int *next_edge = malloc((size_t)num_nodes*sizeof(int));
+	bool *on_stack = calloc((size_t)num_nodes, sizeof(bool));
+	int *stack = malloc((size_t)num_nodes*sizeof(int));
+	int *call_stack = malloc((size_t)num_nodes*sizeof(int));
+	if (index_of == NULL || lowlink == NULL || next_edge == NULL || on_stack == NULL || stack == NULL ||
+		call_stack == NULL) {
+		free(index_of);
+		free(lowlink);
+		free(next_edge);
+		free(on_stack);
+		free(stack);
+		free(call_stack);
+		return -1;
+	}
+	
+	int stack_size = 0;
+	int next_index = 0;
+	int num_ordered = 0;
+	int num_cycles = 0;
+	
+	int root = 0;
+	for (; root < num_nodes; ++root) {
+		index_of[root] = -1;
+		graph->nodes[root].cycle = -1;
+	}
+	
+	for (root = 0; root < num_nodes; ++root) {
+		if (index_of[root] != -1) {
+			continue;
+		}
+		
+		int depth = 0;
+		call_stack[depth++] = root;
+		index_of[root] = lowlink[root] = next_index++;
+		next_edge[root] = 0;
+		stack[stack_size++] = root;
+		on_stack[root] = true;
+		
+		while (depth > 0) {
+			int node = call_stack[depth-1];
+			const dep_node_t *info = graph->nodes+node;
+			
+			if (next_edge[node] < info->num_edges) {
+				int target = info->edges[next_edge[node]++].target;
+				if (index_of[target] == -1) {
+					index_of[target] = lowlink[target] = next_index++;
+					next_edge[target] = 0;
+					stack[stack_size++] = target;
+					on_stack[target] = true;
+					call_stack[depth++] = target;
+				} else if (on_stack[target] && index_of[target] < lowlink[node]) {
+					lowlink[node] = index_of[target];
+				}
+				continue;
+			}
+			
+			--depth;
+			if (depth > 0 && lowlink[node] < lowlink[call_stack[depth-1]]) {
+				lowlink[call_stack[depth-1]] = lowlink[node];
+			}
+			
+			if (lowlink[node] != index_of[node]) {
+				continue;
+			}
+			
+			// node is the root of a component - pop it off
+			int first = num_ordered;
+			int member;
+			do {
+				member = stack[--stack_size];
+				on_stack[member] = false;
+				order[num_ordered++] = member;
+			} while (member != node);
+			
+			bool self_edge = false;
+			int edge = 0;
+			for (; edge < info->num_edges; ++edge) {
+				self_edge = self_edge || (info->edges[edge].target == node);
+			}
+			
+			if (num_ordered-first > 1 || self_edge) {
+				for (member = first; member < num_ordered; ++member) {
+					graph->nodes[order[member]].cycle = num_cycles;
+				}
+				++num_cycles;
+			}
+		}
+	}
+	
+	free(index_of);
+	free(lowlink);
+	free(next_edge);
+	free(on_stack);
+	free(stack);
+	free(call_stack);
+	
+	return num_cycles;
+}
+
+
+int dep_graph_get_node_cycle(dep_graph_t *graph, int node) {
+	if (graph == NULL || node < 0 || graph->num_nodes <= node) {
+		return -1;
+	}
+	return graph->nodes[node].cycle;
+}
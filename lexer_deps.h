@@ -0,0 +1,84 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_DEPS_H_QWJ3X0RE
+#define LEXER_DEPS_H_QWJ3X0RE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	DEP_SOURCE=0, /* a BlitzMax source file that was scanned */
+	DEP_MODULE, /* a module, e.g. brl.blitz - depends on its source if it could be resolved */
+	DEP_EXTERNAL, /* anything else that's imported - C sources, headers, libraries, etc. */
+	DEP_MISSING, /* a source file that couldn't be read, or couldn't be scanned for lack of memory */
+} dep_node_kind_t;
+
+typedef enum {
+	DEP_IMPORT=0,
+	DEP_INCLUDE,
+	DEP_FRAMEWORK,
+	DEP_PROVIDED_BY, /* from a module to the source declaring it (via Module or the module path) */
+} dep_edge_kind_t;
+
+typedef enum {
+	/* only look for dependencies in each file's header - Includes after the first statement are missed */
+	DEP_SCAN_HEADER_ONLY=1<<0,
+} dep_scan_flags_t;
+
+typedef struct s_dep_graph dep_graph_t;
+
+/* allocates a new, empty dependency graph - mod_path is the BlitzMax mod directory used to resolve module names
+   to their sources and may be NULL; returns NULL if out of memory */
+dep_graph_t *dep_graph_new(const char *mod_path, unsigned int flags);
+/* destroys the graph and releases its memory */
+void dep_graph_destroy(dep_graph_t *graph);
+/* adds a source file to the graph to be scanned - returns its node index or -1 on error */
+int dep_graph_add_file(dep_graph_t *graph, const char *path);
+/* scans every file added to the graph and every source file they depend on, using up to num_threads threads (or one
+   per core if num_threads <= 0) - returns 0 on success, or -1 if something couldn't be allocated, in which case the
+   sources affected are DEP_MISSING */
+int dep_graph_scan(dep_graph_t *graph, int num_threads);
+/* returns the number of nodes in the graph */
+int dep_graph_get_num_nodes(dep_graph_t *graph);
+/* returns the path (or module name) of the node at the index and copies its kind to the provided kind if it isn't null */
+const char *dep_graph_get_node(dep_graph_t *graph, int node, dep_node_kind_t *kind);
+/* returns the number of dependencies of the node at the index */
+int dep_graph_get_num_edges(dep_graph_t *graph, int node);
+/* returns the node the edge at the index points to (its dependency) and copies its kind to the provided kind if it
+   isn't null, or returns -1 if out of range */
+int dep_graph_get_edge(dep_graph_t *graph, int node, int edge, dep_edge_kind_t *kind);
+/* copies the node indices in dependency order (every node follows its dependencies) to order, which must have room
+   for dep_graph_get_num_nodes(graph) entries - nodes in a cycle are adjacent but their order among themselves is
+   arbitrary; returns the number of cycles found, or -1 if out of memory */
+int dep_graph_get_order(dep_graph_t *graph, int *order);
+/* returns the index of the cycle the node is part of, or -1 if it isn't part of one - only valid after
+   dep_graph_get_order */
+int dep_graph_get_node_cycle(dep_graph_t *graph, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_DEPS_H_QWJ3X0RE */
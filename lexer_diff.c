@@ -0,0 +1,298 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+
+#include "lexer.h"
+#include "lexer_diff.h"
+
+struct s_token_diff {
+	int num_hunks, hunks_capacity;
+	token_diff_hunk_t *hunks;
+	int distance;
+};
+
+/* working state of a diff - the hashes of both token streams and the furthest reaching paths of Myers' algorithm */
+typedef struct s_diff_state {
+	const uint64_t *old_hashes, *new_hashes;
+	int *forward, *backward;	// indexed by diagonal, offset by the largest distance a middle snake is searched to
+	int offset;
+	token_diff_t *diff;
+	bool failed;
+} diff_state_t;
+
+static void diff_add_hunk(diff_state_t *state, int old_first, int old_count, int new_first, int new_count);
+static bool diff_middle_snake(diff_state_t *state, int old_lo, int old_hi, int new_lo, int new_hi, int *old_split,
+		int *new_split);
+static void diff_compare(diff_state_t *state, int old_lo, int old_hi, int new_lo, int new_hi);
+static uint64_t *diff_hash_tokens(lexer_t *lexer, int num_tokens);
+static uint64_t diff_token_offset(lexer_t *lexer, int index, bool end);
+
+
+static void diff_add_hunk(diff_state_t *state, int old_first, int old_count, int new_first, int new_count) {
+	token_diff_t *diff = state->diff;
+	if (old_count == 0 && new_count == 0) {
+		return;
+	}
+	
+	diff->distance += old_count+new_count;
+	
+	// the recursion below can split one change in two - join hunks that touch
+	if (diff->num_hunks > 0) {
+		token_diff_hunk_t *last = diff->hunks+diff->num_hunks-1;
+		if (last->old_first+last->old_count == old_first && last->new_first+last->new_count == new_first) {
+			last->old_count += old_count;
+			last->new_count += new_count;
+			return;
+		}
+	}
+	
+	if (diff->num_hunks == diff->hunks_capacity) {
+		int capacity = (diff->hunks_capacity > 0 ? diff->hunks_capacity*2 : 16);
+		token_diff_hunk_t *hunks = realloc(diff->hunks, (size_t)capacity*sizeof(token_diff_hunk_t));
+		if (hunks == NULL) {
+			state->failed = true;
+			return;
+		}
+		diff->hunks = hunks;
+		diff->hunks_capacity = capacity;
+	}
+	
+	token_diff_hunk_t *hunk = diff->hunks+diff->num_hunks++;
+	hunk->old_first = old_first;
+	hunk->old_count = old_count;
+	hunk->new_first = new_first;
+	hunk->new_count = new_count;
+}
+
+
+/*
+finds the middle snake of the shortest edit script between the two ranges by
+running Myers' greedy algorithm from both ends until the paths overlap, and
+returns the point it splits the ranges at - both halves are strictly smaller,
+which is what keeps diff_compare linear in space.  the ranges must not share
+their first or last element, i.e. they're trimmed, and neither may be empty.
+*/
+static bool diff_middle_snake(diff_state_t *state, int old_lo, int old_hi, int new_lo, int new_hi, int *old_split,
+		int *new_split) {
+	const uint64_t *old_hashes = state->old_hashes+old_lo, *new_hashes = state->new_hashes+new_lo;
+	int *forward = state->forward+state->offset, *backward = state->backward+state->offset;
+	int old_length = old_hi-old_lo, new_length = new_hi-new_lo;
+	int delta = old_length-new_length;
+	bool odd = (delta & 1) != 0;
+	int max = (old_length+new_length+1)/2;
+	
+	forward[1] = 0;
+	backward[1] = 0;
+	
+	int distance = 0;
+	for (; distance <= max; ++distance) {
+		int diagonal = -distance;
+		for (; diagonal <= distance; diagonal += 2) {
+			int x = (diagonal == -distance || (diagonal != distance && forward[diagonal-1] < forward[diagonal+1]) ?
+					 forward[diagonal+1] : forward[diagonal-1]+1);
+			int y = x-diagonal;
+			while (x < old_length && y < new_length && old_hashes[x] == new_hashes[y]) {
+				++x;
+				++y;
+			}
+			forward[diagonal] = x;
+			
+			// backward paths are one step behind here, and searched on diagonals mirrored around delta
+			if (odd && delta-(distance-1) <= diagonal && diagonal <= delta+(distance-1) &&
+				old_length <= x+backward[delta-diagonal]) {
+				*old_split = old_lo+x;
+				*new_split = new_lo+y;
+				return true;
+			}
+		}
+		
+		for (diagonal = -distance; diagonal <= distance; diagonal += 2) {
+			int x = (diagonal == -distance || (diagonal != distance && backward[diagonal-1] < backward[diagonal+1]) ?
+					 backward[diagonal+1] : backward[diagonal-1]+1);
+			int y = x-diagonal;
+			while (x < old_length && y < new_length &&
+				   old_hashes[old_length-1-x] == new_hashes[new_length-1-y]) {
+				++x;
+				++y;
+			}
+			backward[diagonal] = x;
+			
+			if (!odd && delta-distance <= diagonal && diagonal <= delta+distance &&
+				old_length <= x+forward[delta-diagonal]) {
+				*old_split = old_hi-x;
+				*new_split = new_hi-y;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+static void diff_compare(diff_state_t *state, int old_lo, int old_hi, int new_lo, int new_hi) {
+	const uint64_t *old_hashes = state->old_hashes, *new_hashes = state->new_hashes;
+	
+	while (old_lo < old_hi && new_lo < new_hi && old_hashes[old_lo] == new_hashes[new_lo]) {
+		++old_lo;
+		++new_lo;
+	}
+	while (old_lo < old_hi && new_lo < new_hi && old_hashes[old_hi-1] == new_hashes[new_hi-1]) {
+		--old_hi;
+		--new_hi;
+	}
+	
+	int old_split, new_split;
+	if (old_lo == old_hi || new_lo == new_hi ||
+		!diff_middle_snake(state, old_lo, old_hi, new_lo, new_hi, &old_split, &new_split) ||
+		(old_split == old_lo && new_split == new_lo) || (old_split == old_hi && new_split == new_hi)) {
+		diff_add_hunk(state, old_lo, old_hi-old_lo, new_lo, new_hi-new_lo);
+		return;
+	}
+	
+	diff_compare(state, old_lo, old_split, new_lo, new_split);
+	diff_compare(state, old_split, old_hi, new_split, new_hi);
+}
+
+
+static uint64_t *diff_hash_tokens(lexer_t *lexer, int num_tokens) {
+	uint64_t *hashes = malloc((size_t)(num_tokens > 0 ? num_tokens : 1)*sizeof(uint64_t));
+	if (hashes == NULL) {
+		return NULL;
+	}
+	
+	int index = 0;
+	for (; index < num_tokens; ++index) {
+		token_t token;
+		lexer_get_token32(lexer, index, &token);
+		hashes[index] = token_hash(&token);
+	}
+	return hashes;
+}
+
+
+/* offset of the beginning (or end) of the token at the index, or of the end of the source past the last token */
+static uint64_t diff_token_offset(lexer_t *lexer, int index, bool end) {
+	token_ofs64_t token;
+	if (lexer_get_tokens_ofs64(lexer, (size_t)index, 1, &token) != 1) {
+		size_t length;
+		lexer_get_source(lexer, &length);
+		return (uint64_t)length;
+	}
+	return (end ? token.to : token.from);
+}
+
+
+token_diff_t *token_diff_new(lexer_t *old_lexer, lexer_t *new_lexer) {
+	if (old_lexer == NULL || new_lexer == NULL) {
+		return NULL;
+	}
+	
+	// hunks and diagonals index tokens with ints
+	int old_length = lexer_get_num_tokens32(old_lexer), new_length = lexer_get_num_tokens32(new_lexer);
+	if (old_length == -1 || new_length == -1 || (int64_t)old_length+new_length > INT_MAX-4) {
+		return NULL;
+	}
+	token_diff_t *diff = malloc(sizeof(token_diff_t));
+	if (diff == NULL) {
+		return NULL;
+	}
+	diff->num_hunks = 0;
+	diff->hunks_capacity = 0;
+	diff->hunks = NULL;
+	diff->distance = 0;
+	
+	diff_state_t state = {
+		.old_hashes = diff_hash_tokens(old_lexer, old_length),
+		.new_hashes = diff_hash_tokens(new_lexer, new_length),
+		.offset = (old_length+new_length+1)/2+1,
+		.diff = diff,
+		.failed = false,
+	};
+	state.forward = malloc((size_t)(2*state.offset+1)*sizeof(int));
+	state.backward = malloc((size_t)(2*state.offset+1)*sizeof(int));
+	
+	if (state.old_hashes != NULL && state.new_hashes != NULL && state.forward != NULL && state.backward != NULL) {
+		diff_compare(&state, 0, old_length, 0, new_length);
+	} else {
+		state.failed = true;
+	}
+	
+	free((void*)state.old_hashes);
+	free((void*)state.new_hashes);
+	free(state.forward);
+	free(state.backward);
+	
+	if (state.failed) {
+		token_diff_destroy(diff);
+		return NULL;
+	}
+	
+	int index = 0;
+	for (; index < diff->num_hunks; ++index) {
+		token_diff_hunk_t *hunk = diff->hunks+index;
+		hunk->old_from = diff_token_offset(old_lexer, hunk->old_first, false);
+		hunk->old_to = (hunk->old_count > 0 ?
+						diff_token_offset(old_lexer, hunk->old_first+hunk->old_count-1, true) : hunk->old_from);
+		hunk->new_from = diff_token_offset(new_lexer, hunk->new_first, false);
+		hunk->new_to = (hunk->new_count > 0 ?
+						diff_token_offset(new_lexer, hunk->new_first+hunk->new_count-1, true) : hunk->new_from);
+	}
+	
+	return diff;
+}
+
+
+void token_diff_destroy(token_diff_t *diff) {
+	if (diff == NULL) {
+		return;
+	}
+	
+	free(diff->hunks);
+	free(diff);
+}
+
+
+int token_diff_get_num_hunks(token_diff_t *diff) {
+	return (diff != NULL ? diff->num_hunks : 0);
+}
+
+
+int token_diff_get_hunk(token_diff_t *diff, int index, token_diff_hunk_t *hunk) {
+	if (diff == NULL || index < 0 || diff->num_hunks <= index) {
+		return -1;
+	}
+	if (hunk != NULL) {
+		*hunk = diff->hunks[index];
+	}
+	return 0;
+}
+
+
+int token_diff_get_distance(token_diff_t *diff) {
+	return (diff != NULL ? diff->distance : 0);
+}
@@ -0,0 +1,66 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_DIFF_H_K3W9QZTB
+#define LEXER_DIFF_H_K3W9QZTB
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+the tokens that changed between two lexers' sources, as a minimal list of
+hunks - tokens are compared by kind and text (see token_hash), so moving a
+token, or changing whitespace around it, doesn't change it
+*/
+typedef struct s_token_diff token_diff_t;
+
+/* a run of tokens in the old source replaced by a run of tokens in the new one - either run may be empty */
+typedef struct s_token_diff_hunk {
+	int old_first, old_count; /* token indices in the old lexer */
+	int new_first, new_count; /* token indices in the new lexer */
+	uint64_t old_from, old_to; /* byte offsets of the old run, both at the insertion point if it's empty */
+	uint64_t new_from, new_to; /* byte offsets of the new run, both at the deletion point if it's empty */
+} token_diff_hunk_t;
+
+/* diffs the tokens of two lexers that have been run - returns NULL on error */
+token_diff_t *token_diff_new(lexer_t *old_lexer, lexer_t *new_lexer);
+/* releases the diff's memory */
+void token_diff_destroy(token_diff_t *diff);
+/* returns the number of hunks, 0 if the token streams are the same */
+int token_diff_get_num_hunks(token_diff_t *diff);
+/* copies the hunk at the index to the provided hunk if it isn't null - returns 0, or -1 if out of range */
+int token_diff_get_hunk(token_diff_t *diff, int index, token_diff_hunk_t *hunk);
+/* returns the number of tokens inserted plus the number deleted */
+int token_diff_get_distance(token_diff_t *diff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_DIFF_H_K3W9QZTB */
@@ -0,0 +1,394 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lexer.h"
+#include "lexer_lsp.h"
+#include "lexer_ctype.h"
+
+const char *const lsp_token_types[LSP_TYPE_COUNT] = {
+	"keyword",
+	"type",
+	"variable",
+	"number",
+	"string",
+	"comment",
+	"operator",
+};
+
+typedef struct s_lsp_output {
+	uint32_t *data;
+	size_t length, capacity;
+	uint32_t prev_line, prev_char;
+	bool failed;	// ran out of memory, so nothing more is emitted
+} lsp_output_t;
+
+/* UTF-16 column of a place on a line, moving forward from the last one asked for on the same line */
+typedef struct s_lsp_cursor {
+	const char *line_start;
+	const char *place;
+	uint32_t units;
+} lsp_cursor_t;
+
+static bool lsp_is_word(const char *word, size_t len, const char *keyword);
+static const char *lsp_find_restart(const char *begin, const char *end, int line, int *restart_line);
+static uint32_t lsp_utf16_length(const char *from, const char *to);
+static uint32_t lsp_cursor_column(lsp_cursor_t *cursor, const char *line_start, const char *place);
+static void lsp_emit(lsp_output_t *out, uint32_t line, uint32_t character, uint32_t length, uint32_t type,
+		uint32_t modifiers);
+static const char *lsp_find_stop(const char *restart, const char *source_end, int64_t restart_line, int end_line);
+static int lsp_encode(lexer_t *lexer, const char *restart, int64_t restart_line, int start_line, int end_line,
+		const lsp_legend_t *legend, uint32_t **data, size_t *length);
+
+
+void lsp_legend_init(lsp_legend_t *legend) {
+	int kind = 0;
+	for (; kind < TOK_COUNT; ++kind) {
+		int type = -1;
+		if (TOK_END_KW <= kind && kind <= TOK_IMPLEMENTS_KW) {
+			type = LSP_TYPE_KEYWORD;
+			if (TOK_FLOAT_KW <= kind && kind <= TOK_OBJECT_KW) {
+				type = LSP_TYPE_TYPE;
+			}
+		} else if ((TOK_COLON <= kind && kind < TOK_NEWLINE) || (TOK_ASSIGN_ADD <= kind && kind <= TOK_DOUBLEPLUS)) {
+			type = LSP_TYPE_OPERATOR;
+		}
+		
+		switch (kind) {
+			case TOK_ID: type = LSP_TYPE_VARIABLE; break;
+			case TOK_NUMBER_LIT: case TOK_HEX_LIT: case TOK_BIN_LIT: type = LSP_TYPE_NUMBER; break;
+			case TOK_STRING_LIT: type = LSP_TYPE_STRING; break;
+			case TOK_REM_KW: case TOK_ENDREM_KW:
+			case TOK_LINE_COMMENT: case TOK_BLOCK_COMMENT: case TOK_SKIPPED: type = LSP_TYPE_COMMENT; break;
+			default: break;
+		}
+		
+		legend->types[kind] = type;
+		legend->modifiers[kind] = 0;
+	}
+}
+
+
+static bool lsp_is_word(const char *word, size_t len, const char *keyword) {
+	return (len == strlen(keyword) && strncasecmp(word, keyword, len) == 0);
+}
+
+
+/*
+finds the beginning of the last line at or before line that doesn't start in a
+Rem block - the only state the lexer carries from one line to the next.  this
+only skims for words, strings, comments and numbers the way lexer_run reads
+them, so it's much cheaper than lexing up to the line.
+*/
+static const char *lsp_find_restart(const char *begin, const char *end, int line, int *restart_line) {
+	const char *place = begin;
+	const char *restart = begin;
+	int current_line = 1;
+	bool in_rem = false;
+	
+	*restart_line = 1;
+	while (place < end && current_line < line) {
+		char cur = *place;
+		
+		if (cur == '\n') {
+			++place;
+			++current_line;
+			if (!in_rem) {
+				restart = place;
+				*restart_line = current_line;
+			}
+			continue;
+		}
+		
+		if (cur == '_' || lexer_is_alpha(cur)) {
+			const char *word = place;
+			while (place < end && (*place == '_' || lexer_is_alpha(*place) || lexer_is_digit(*place))) {
+				++place;
+			}
+			
+			size_t len = (size_t)(place-word);
+			if (!in_rem) {
+				in_rem = lsp_is_word(word, len, "rem");
+			} else if (lsp_is_word(word, len, "endrem")) {
+				in_rem = false;
+			} else if (lsp_is_word(word, len, "end")) {
+				// lexer_run allows a single space between End and Rem
+				const char *next = (place < end && *place == ' ' ? place+1 : place);
+				const char *next_word = next;
+				while (next < end && (*next == '_' || lexer_is_alpha(*next) || lexer_is_digit(*next))) {
+					++next;
+				}
+				if (lsp_is_word(next_word, (size_t)(next-next_word), "rem")) {
+					in_rem = false;
+					place = next;
+				}
+			}
+			continue;
+		}
+		
+		++place;
+		if (in_rem) {
+			continue;
+		}
+		
+		char next = (place < end ? *place : 0);
+		if (cur == '\'') {
+			while (place < end && *place != '\n') {
+				++place;
+			}
+		} else if (cur == '"') {
+			while (place < end && *place != '"' && *place != '\n') {
+				++place;
+			}
+			if (place < end && *place == '"') {
+				++place;
+			}
+		} else if (lexer_is_digit(cur) || (cur == '.' && lexer_is_digit(next))) {
+			while (place < end) {
+				if (lexer_is_digit(*place) || *place == '.') {
+					++place;
+				} else if ((*place | 0x20) == 'e') {
+					const char *exponent = place+1;
+					if (exponent < end && (*exponent == '-' || *exponent == '+')) {
+						++exponent;
+					}
+					if (exponent >= end || !lexer_is_digit(*exponent)) {
+						break;
+					}
+					place = exponent;
+				} else {
+					break;
+				}
+			}
+		} else if (cur == '$' && lexer_is_xdigit(next)) {
+			while (place < end && lexer_is_xdigit(*place)) {
+				++place;
+			}
+		} else if (cur == '%' && (next == '0' || next == '1')) {
+			while (place < end && (*place == '0' || *place == '1')) {
+				++place;
+			}
+		}
+	}
+	
+	return restart;
+}
+
+
+static uint32_t lsp_utf16_length(const char *from, const char *to) {
+	uint32_t length = 0;
+	for (; from < to; ++from) {
+		unsigned char cur = (unsigned char)*from;
+		if ((cur & 0xc0) != 0x80) {
+			++length;
+		}
+		// four-byte sequences take a surrogate pair
+		if (cur >= 0xf0) {
+			++length;
+		}
+	}
+	return length;
+}
+
+
+static uint32_t lsp_cursor_column(lsp_cursor_t *cursor, const char *line_start, const char *place) {
+	if (cursor->line_start != line_start || place < cursor->place) {
+		cursor->line_start = cursor->place = line_start;
+		cursor->units = 0;
+	}
+	cursor->units += lsp_utf16_length(cursor->place, place);
+	cursor->place = place;
+	return cursor->units;
+}
+
+
+static void lsp_emit(lsp_output_t *out, uint32_t line, uint32_t character, uint32_t length, uint32_t type,
+		uint32_t modifiers) {
+	if (out->failed) {
+		return;
+	}
+	if (out->length+5 > out->capacity) {
+		size_t capacity = out->capacity*2;
+		if (capacity < 320) {
+			capacity = 320;
+		}
+		uint32_t *data = realloc(out->data, capacity*sizeof(uint32_t));
+		if (data == NULL) {
+			out->failed = true;
+			return;
+		}
+		out->data = data;
+		out->capacity = capacity;
+	}
+	
+	uint32_t *quintuple = out->data+out->length;
+	quintuple[0] = line-out->prev_line;
+	quintuple[1] = (line == out->prev_line ? character-out->prev_char : character);
+	quintuple[2] = length;
+	quintuple[3] = type;
+	quintuple[4] = modifiers;
+	out->length += 5;
+	out->prev_line = line;
+	out->prev_char = character;
+}
+
+
+static const char *lsp_find_stop(const char *restart, const char *source_end, int64_t restart_line, int end_line) {
+	// the beginning of end_line (counted from 0), NULL if that's past the end of the source
+	const char *stop = restart;
+	int64_t line = restart_line;
+	while (stop != NULL && line <= end_line) {
+		stop = memchr(stop, '\n', (size_t)(source_end-stop));
+		if (stop != NULL) {
+			++stop;
+			++line;
+		}
+	}
+	return stop;
+}
+
+
+/* runs a lexer set up to start at the beginning of restart_line and encodes its tokens - destroys the lexer; returns
+   -1 if the tokens didn't fit in memory */
+static int lsp_encode(lexer_t *lexer, const char *restart, int64_t restart_line, int start_line, int end_line,
+		const lsp_legend_t *legend, uint32_t **data, size_t *length) {
+	int result = lexer_run(lexer);
+	
+	lsp_output_t out = { .data = NULL, .length = 0, .capacity = 0, .prev_line = 0, .prev_char = 0, .failed = false };
+	lsp_cursor_t cursor = { .line_start = NULL, .place = NULL, .units = 0 };
+	const char *place = restart;
+	const char *line_start = restart;
+	int64_t line = restart_line-1;
+	size_t num_tokens = lexer_get_num_tokens(lexer);
+	size_t index = 0;
+	for (; index < num_tokens; ++index) {
+		token_t token;
+		token_kind_t kind = lexer_get_token(lexer, index, &token);
+		if (legend->types[kind] < 0 || token.from == NULL || token.to <= token.from) {
+			continue;
+		}
+		
+		// a block comment resumed from a checkpoint begins before the restart
+		if (token.from < restart) {
+			token.from = restart;
+		}
+		
+		// block comments are given the Rem's position, so positions come from the source instead
+		const char *newline;
+		while ((newline = memchr(place, '\n', (size_t)(token.from-place))) != NULL) {
+			place = line_start = newline+1;
+			++line;
+		}
+		place = token.from;
+		
+		// one token per line for tokens spanning several
+		const char *segment_start = line_start;
+		const char *segment = token.from;
+		int64_t segment_line = line;
+		while (segment < token.to && segment_line < end_line) {
+			const char *segment_end = memchr(segment, '\n', (size_t)(token.to-segment));
+			const char *next = (segment_end != NULL ? segment_end+1 : token.to);
+			if (segment_end == NULL) {
+				segment_end = token.to;
+			}
+			if (segment < segment_end && segment_end[-1] == '\r') {
+				--segment_end;
+			}
+			
+			if (start_line <= segment_line && segment < segment_end) {
+				uint32_t character = lsp_cursor_column(&cursor, segment_start, segment);
+				lsp_emit(&out, (uint32_t)segment_line, character, lsp_utf16_length(segment, segment_end),
+						(uint32_t)legend->types[kind], legend->modifiers[kind]);
+			}
+			
+			segment_start = segment = next;
+			++segment_line;
+		}
+	}
+	
+	lexer_destroy(lexer);
+	
+	if (out.failed) {
+		free(out.data);
+		return -1;
+	}
+	*data = out.data;
+	*length = out.length;
+	return (result != 0 ? 1 : 0);
+}
+
+int lsp_semantic_tokens(const char *source_begin, const char *source_end, int start_line, int end_line,
+		const lsp_legend_t *legend, uint32_t **data, size_t *length) {
+	if (source_begin == NULL || source_end == NULL || source_end < source_begin || legend == NULL ||
+		data == NULL || length == NULL || start_line < 0 || end_line < start_line) {
+		return -1;
+	}
+	
+	*data = NULL;
+	*length = 0;
+	if (start_line == end_line) {
+		return 0;
+	}
+	
+	int restart_line;
+	const char *restart = lsp_find_restart(source_begin, source_end, start_line+1, &restart_line);
+	const char *stop = lsp_find_stop(restart, source_end, restart_line, end_line);
+	lexer_t *lexer = lexer_new_range(source_begin, source_end, restart, stop, restart_line);
+	if (lexer == NULL) {
+		return -1;
+	}
+	return lsp_encode(lexer, restart, restart_line, start_line, end_line, legend, data, length);
+}
+
+
+int lsp_semantic_tokens_indexed(lexer_t *index, int start_line, int end_line, const lsp_legend_t *legend,
+		uint32_t **data, size_t *length) {
+	size_t source_length;
+	const char *source_begin = lexer_get_source(index, &source_length);
+	const char *source_end = source_begin+source_length;
+	int found = lexer_find_checkpoint(index, start_line+1);
+	if (found == -1 || start_line < 0 || end_line <= start_line) {
+		return lsp_semantic_tokens(source_begin, source_end, start_line, end_line, legend, data, length);
+	}
+	if (legend == NULL || data == NULL || length == NULL) {
+		return -1;
+	}
+	
+	*data = NULL;
+	*length = 0;
+	
+	lexer_checkpoint_t checkpoint;
+	lexer_get_checkpoint(index, found, &checkpoint);
+	const char *restart = source_begin+checkpoint.offset-(checkpoint.column-1);
+	const char *stop = lsp_find_stop(restart, source_end, checkpoint.line, end_line);
+	lexer_t *lexer = lexer_new_at(source_begin, source_end, &checkpoint, stop);
+	if (lexer == NULL) {
+		return -1;
+	}
+	return lsp_encode(lexer, restart, checkpoint.line, start_line, end_line, legend, data, length);
+}
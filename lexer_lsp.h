@@ -0,0 +1,77 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_LSP_H_M2WQ8FYT
+#define LEXER_LSP_H_M2WQ8FYT
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* indices of the token types in lsp_token_types - what lsp_legend_init maps the token kinds to */
+typedef enum {
+	LSP_TYPE_KEYWORD=0,
+	LSP_TYPE_TYPE,
+	LSP_TYPE_VARIABLE,
+	LSP_TYPE_NUMBER,
+	LSP_TYPE_STRING,
+	LSP_TYPE_COMMENT,
+	LSP_TYPE_OPERATOR,
+	LSP_TYPE_COUNT
+} lsp_token_type_t;
+
+/* the names of the token types above, for the legend a server sends in its semanticTokensProvider capability */
+extern const char *const lsp_token_types[LSP_TYPE_COUNT];
+
+/* maps token kinds to the indices of token types and modifiers in the client's legend */
+typedef struct s_lsp_legend {
+	int types[TOK_COUNT]; /* -1 to leave tokens of the kind out */
+	uint32_t modifiers[TOK_COUNT]; /* bit set of modifier indices */
+} lsp_legend_t;
+
+/* fills the legend with the default mapping to lsp_token_types and no modifiers - newlines, EOF and invalid tokens
+   are left out */
+void lsp_legend_init(lsp_legend_t *legend);
+
+/* lexes just enough of the source to produce the semantic tokens of lines [start_line, end_line) - lines are counted
+   from 0 as in LSP, and tokens spanning several lines are split into one per line.  data is set to a malloc'd array
+   of LSP's relative (deltaLine, deltaStart, length, type, modifiers) integers with positions in UTF-16 code units,
+   and length to the number of integers in it.  returns 0 on success, 1 if the lexer failed (data then holds the
+   tokens before the error), or -1 on bad arguments or if out of memory (data is then NULL). */
+int lsp_semantic_tokens(const char *source_begin, const char *source_end, int start_line, int end_line,
+		const lsp_legend_t *legend, uint32_t **data, size_t *length);
+/* same as lsp_semantic_tokens, restarting from the nearest checkpoint recorded by index - a lexer run over the
+   whole source, without options, after lexer_set_checkpoints - so nothing before the range has to be read */
+int lsp_semantic_tokens_indexed(lexer_t *index, int start_line, int end_line, const lsp_legend_t *legend,
+		uint32_t **data, size_t *length);
+		
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_LSP_H_M2WQ8FYT */
@@ -0,0 +1,337 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lexer.h"
+#include "lexer_pack.h"
+
+/*
+each token is one record in the stream, starting with a varint holding the
+gap since the end of the previous token (shifted left by two) and two flags:
+	
+	bit 1 - the token's length follows, because its kind doesn't fix it or it
+	        isn't the usual one (e.g. End Function rather than EndFunction)
+	bit 0 - the token isn't where the line/column tracking below predicts, or
+	        has flags, so its line delta, column and flags follow
+
+the decoder follows lines by itself: a TOK_NEWLINE starts a new one, and a
+token's column is its distance from the start of its line.  only tokens after
+multi-line comments, skipped regions and the like have to spell theirs out.
+*/
+#define PACK_EXPLICIT_LENGTH (1<<1)
+#define PACK_EXPLICIT_POSITION (1<<0)
+
+/* largest record: four varints of up to 10 bytes and one of up to 5 */
+#define PACK_MAX_RECORD 45
+
+/* decoder state at the start of a block */
+typedef struct s_pack_block {
+	uint64_t stream;	// offset of the block's first record
+	uint64_t prev_to;
+	uint64_t line_start;
+	int64_t line;
+} pack_block_t;
+
+typedef struct s_pack_state {
+	uint64_t prev_to;
+	uint64_t line_start;
+	int64_t line;
+} pack_state_t;
+
+struct s_token_pack {
+	size_t num_tokens;
+	uint8_t *kinds;
+	
+	uint8_t *stream;
+	size_t stream_size, stream_capacity;
+	
+	size_t num_blocks;
+	pack_block_t *blocks;
+	
+	uint8_t lengths[TOK_COUNT];	// token_kind_length for each kind, 0 if variable or too long for a byte
+};
+
+static uint8_t *pack_write_varint(uint8_t *out, uint64_t value);
+static uint64_t pack_read_varint(const uint8_t **in);
+static uint64_t pack_zigzag(int64_t value);
+static int64_t pack_unzigzag(uint64_t value);
+static bool token_pack_encode(token_pack_t *pack, pack_state_t *state, const token_ofs64_t *token);
+static const uint8_t *token_pack_decode_one(token_pack_t *pack, pack_state_t *state, const uint8_t *in,
+		token_kind_t kind, token_ofs64_t *token);
+
+
+static uint8_t *pack_write_varint(uint8_t *out, uint64_t value) {
+	while (value >= 0x80) {
+		*out++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+
+static uint64_t pack_read_varint(const uint8_t **in) {
+	const uint8_t *cur = *in;
+	uint64_t value = *cur++;
+	// nearly every varint in a pack is a single byte
+	if (value >= 0x80) {
+		value &= 0x7f;
+		int shift = 7;
+		uint8_t byte;
+		do {
+			byte = *cur++;
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+	}
+	*in = cur;
+	return value;
+}
+
+
+static uint64_t pack_zigzag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+static int64_t pack_unzigzag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+static bool token_pack_encode(token_pack_t *pack, pack_state_t *state, const token_ofs64_t *token) {
+	if (token->from < state->prev_to || token->to < token->from) {
+		return false;
+	}
+	
+	if (pack->stream_capacity-pack->stream_size < PACK_MAX_RECORD) {
+		size_t capacity = pack->stream_capacity*2;
+		if (capacity < 4096) {
+			capacity = 4096;
+		}
+		uint8_t *stream = realloc(pack->stream, capacity);
+		if (stream == NULL) {
+			return false;
+		}
+		pack->stream = stream;
+		pack->stream_capacity = capacity;
+	}
+	
+	uint64_t length = token->to-token->from;
+	uint64_t column = token->from-state->line_start+1;
+	uint64_t header = (token->from-state->prev_to) << 2;
+	if (pack->lengths[token->kind] == 0 || length != pack->lengths[token->kind]) {
+		header |= PACK_EXPLICIT_LENGTH;
+	}
+	if (token->line != state->line || (uint64_t)token->column != column || token->flags != 0) {
+		header |= PACK_EXPLICIT_POSITION;
+	}
+	
+	uint8_t *out = pack->stream+pack->stream_size;
+	out = pack_write_varint(out, header);
+	if (header & PACK_EXPLICIT_LENGTH) {
+		out = pack_write_varint(out, length);
+	}
+	if (header & PACK_EXPLICIT_POSITION) {
+		out = pack_write_varint(out, pack_zigzag(token->line-state->line));
+		out = pack_write_varint(out, pack_zigzag(token->column));
+		out = pack_write_varint(out, (uint64_t)(unsigned int)token->flags);
+		state->line = token->line;
+		state->line_start = token->from-(uint64_t)(token->column-1);
+	}
+	pack->stream_size = (size_t)(out-pack->stream);
+	
+	state->prev_to = token->to;
+	if (token->kind == TOK_NEWLINE) {
+		++state->line;
+		state->line_start = token->to;
+	}
+	return true;
+}
+
+
+token_pack_t *token_pack_new(lexer_t *lexer) {
+	if (lexer == NULL) {
+		return NULL;
+	}
+	
+	token_pack_t *pack = calloc(1, sizeof(token_pack_t));
+	if (pack == NULL) {
+		return NULL;
+	}
+	int kind = 0;
+	for (; kind < TOK_COUNT; ++kind) {
+		size_t length = token_kind_length((token_kind_t)kind);
+		pack->lengths[kind] = (uint8_t)(length <= UINT8_MAX ? length : 0);
+	}
+	
+	pack->num_tokens = lexer_get_num_tokens(lexer);
+	pack->num_blocks = (pack->num_tokens+TOKEN_PACK_BLOCK_SIZE-1)/TOKEN_PACK_BLOCK_SIZE;
+	pack->kinds = malloc(pack->num_tokens+1);
+	pack->blocks = malloc((pack->num_blocks+1)*sizeof(pack_block_t));
+	if (pack->kinds == NULL || pack->blocks == NULL) {
+		token_pack_destroy(pack);
+		return NULL;
+	}
+	
+	pack_state_t state = { .prev_to = 0, .line_start = 0, .line = 1 };
+	token_ofs64_t tokens[TOKEN_PACK_BLOCK_SIZE];
+	size_t block = 0;
+	for (; block < pack->num_blocks; ++block) {
+		pack->blocks[block] = (pack_block_t){
+			.stream = pack->stream_size,
+			.prev_to = state.prev_to,
+			.line_start = state.line_start,
+			.line = state.line,
+		};
+		
+		size_t first = block*TOKEN_PACK_BLOCK_SIZE;
+		size_t num = lexer_get_tokens_ofs64(lexer, first, TOKEN_PACK_BLOCK_SIZE, tokens);
+		size_t index = 0;
+		for (; index < num; ++index) {
+			pack->kinds[first+index] = (uint8_t)tokens[index].kind;
+			if (!token_pack_encode(pack, &state, tokens+index)) {
+				token_pack_destroy(pack);
+				return NULL;
+			}
+		}
+	}
+	
+	// slack past the end so the decoder never has to check for it
+	uint8_t *stream = realloc(pack->stream, pack->stream_size+PACK_MAX_RECORD);
+	if (stream == NULL) {
+		token_pack_destroy(pack);
+		return NULL;
+	}
+	pack->stream = stream;
+	pack->stream_capacity = pack->stream_size+PACK_MAX_RECORD;
+	memset(pack->stream+pack->stream_size, 0, PACK_MAX_RECORD);
+	
+	return pack;
+}
+
+
+void token_pack_destroy(token_pack_t *pack) {
+	if (pack == NULL) {
+		return;
+	}
+	
+	free(pack->kinds);
+	free(pack->stream);
+	free(pack->blocks);
+	free(pack);
+}
+
+
+size_t token_pack_get_num_tokens(token_pack_t *pack) {
+	return (pack != NULL ? pack->num_tokens : 0);
+}
+
+
+size_t token_pack_get_size(token_pack_t *pack) {
+	if (pack == NULL) {
+		return 0;
+	}
+	return sizeof(token_pack_t)+pack->num_tokens+pack->stream_size+pack->num_blocks*sizeof(pack_block_t);
+}
+
+
+const uint8_t *token_pack_get_kinds(token_pack_t *pack) {
+	return (pack != NULL ? pack->kinds : NULL);
+}
+
+
+static const uint8_t *token_pack_decode_one(token_pack_t *pack, pack_state_t *state, const uint8_t *in,
+		token_kind_t kind, token_ofs64_t *token) {
+	uint64_t header = pack_read_varint(&in);
+	uint64_t from = state->prev_to+(header >> 2);
+	uint64_t length = pack->lengths[kind];
+	if (header & PACK_EXPLICIT_LENGTH) {
+		length = pack_read_varint(&in);
+	}
+	
+	token->kind = kind;
+	token->from = from;
+	token->to = from+length;
+	if (header & PACK_EXPLICIT_POSITION) {
+		state->line += pack_unzigzag(pack_read_varint(&in));
+		token->column = pack_unzigzag(pack_read_varint(&in));
+		token->flags = (int)pack_read_varint(&in);
+		state->line_start = from-(uint64_t)(token->column-1);
+	} else {
+		token->column = (int64_t)(from-state->line_start+1);
+		token->flags = 0;
+	}
+	token->line = state->line;
+	
+	state->prev_to = token->to;
+	if (kind == TOK_NEWLINE) {
+		++state->line;
+		state->line_start = token->to;
+	}
+	return in;
+}
+
+
+size_t token_pack_decode(token_pack_t *pack, size_t first, size_t max_tokens, token_ofs64_t *tokens) {
+	if (pack == NULL || tokens == NULL || max_tokens == 0 || pack->num_tokens <= first) {
+		return 0;
+	}
+	
+	size_t num = pack->num_tokens-first;
+	if (num > max_tokens) {
+		num = max_tokens;
+	}
+	
+	const pack_block_t *block = pack->blocks+first/TOKEN_PACK_BLOCK_SIZE;
+	pack_state_t state = { .prev_to = block->prev_to, .line_start = block->line_start, .line = block->line };
+	const uint8_t *in = pack->stream+block->stream;
+	
+	// tokens before first in its block are decoded into the output and overwritten
+	size_t index = first-first%TOKEN_PACK_BLOCK_SIZE;
+	for (; index < first; ++index) {
+		in = token_pack_decode_one(pack, &state, in, (token_kind_t)pack->kinds[index], tokens);
+	}
+	
+	token_ofs64_t *out = tokens;
+	const size_t end = first+num;
+	for (; index < end; ++index, ++out) {
+		in = token_pack_decode_one(pack, &state, in, (token_kind_t)pack->kinds[index], out);
+	}
+	return num;
+}
+
+
+token_kind_t token_pack_get_token(token_pack_t *pack, size_t index, token_ofs64_t *token) {
+	if (pack == NULL || pack->num_tokens <= index) {
+		return TOK_INVALID;
+	}
+	if (token != NULL) {
+		token_pack_decode(pack, index, 1, token);
+	}
+	return (token_kind_t)pack->kinds[index];
+}
@@ -0,0 +1,66 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_PACK_H_R4N8VDLE
+#define LEXER_PACK_H_R4N8VDLE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* number of tokens per block - decoding a token at random only has to start at its block */
+#define TOKEN_PACK_BLOCK_SIZE 128
+
+/*
+a compressed, read-only copy of a lexer's tokens - usually under 4 bytes per
+token.  kinds are kept as a plain byte array (one per token) so they can be
+scanned without decoding anything, positions are delta-coded varints and
+lengths are left out where the kind fixes them (see token_kind_length).
+*/
+typedef struct s_token_pack token_pack_t;
+
+/* compresses the tokens of a lexer that has been run - returns NULL on error */
+token_pack_t *token_pack_new(lexer_t *lexer);
+/* releases the pack's memory */
+void token_pack_destroy(token_pack_t *pack);
+/* returns the number of tokens in the pack */
+size_t token_pack_get_num_tokens(token_pack_t *pack);
+/* returns the number of bytes used by the pack, including its block index */
+size_t token_pack_get_size(token_pack_t *pack);
+/* returns the kind of every token in the pack, one byte each */
+const uint8_t *token_pack_get_kinds(token_pack_t *pack);
+/* returns the kind of the token at the index and copies it to the provided token if it isn't null */
+token_kind_t token_pack_get_token(token_pack_t *pack, size_t index, token_ofs64_t *token);
+/* decodes up to max_tokens tokens, starting at the index first, to tokens - returns the number of tokens decoded */
+size_t token_pack_decode(token_pack_t *pack, size_t first, size_t max_tokens, token_ofs64_t *tokens);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_PACK_H_R4N8VDLE */
@@ -0,0 +1,1627 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lexer.h"
+#include "lexer_parse.h"
+
+/* nesting of blocks and expressions past which the parser gives up rather than run out of stack */
+#define PARSE_MAX_DEPTH 1000
+/* keeps the size of the node array within 32 bits */
+#define PARSE_MAX_NODES (uint32_t)(UINT32_MAX/sizeof(ast_node_t))
+
+/* closing keywords that aren't tokens of their own (Try isn't a keyword to the lexer) */
+enum {
+	PARSE_CATCH=TOK_COUNT,
+	PARSE_ENDTRY,
+};
+
+struct s_ast {
+	ast_node_t *nodes;
+	uint32_t num_nodes, capacity;
+	char *error;
+	int num_errors;
+};
+
+typedef struct s_parser {
+	lexer_t *lexer;
+	const token_t *tokens; /* NULL with LEXER_OPT_SEGMENTED_TOKENS, which are looked up through the lexer instead */
+	size_t num_tokens;
+	size_t pos; /* the current token, never trivia */
+	ast_t *ast;
+	int depth;
+	int declarative; /* > 0 inside Extern and Protocol blocks, where functions have no bodies */
+	int open[PARSE_ENDTRY+1]; /* number of enclosing blocks each closer would end */
+	bool failed, out_of_memory;
+} parser_t;
+
+static const char *const ast_kind_names[AST_KIND_COUNT] = {
+	[AST_ROOT] = "Root",
+	[AST_ERROR] = "Error",
+	[AST_EMPTY] = "Empty",
+	[AST_STRICT] = "Strict",
+	[AST_FRAMEWORK] = "Framework",
+	[AST_MODULE] = "Module",
+	[AST_MODULEINFO] = "ModuleInfo",
+	[AST_IMPORT] = "Import",
+	[AST_INCLUDE] = "Include",
+	[AST_VISIBILITY] = "Visibility",
+	[AST_TYPE] = "Type",
+	[AST_PROTOCOL] = "Protocol",
+	[AST_EXTENDS] = "Extends",
+	[AST_IMPLEMENTS] = "Implements",
+	[AST_EXTERN] = "Extern",
+	[AST_FUNCTION] = "Function",
+	[AST_PARAMS] = "Params",
+	[AST_LOCAL] = "Local",
+	[AST_GLOBAL] = "Global",
+	[AST_CONST] = "Const",
+	[AST_FIELD] = "Field",
+	[AST_VAR] = "Var",
+	[AST_TYPE_REF] = "TypeRef",
+	[AST_DIMS] = "Dims",
+	[AST_LABEL] = "Label",
+	[AST_BLOCK] = "Block",
+	[AST_IF] = "If",
+	[AST_WHILE] = "While",
+	[AST_REPEAT] = "Repeat",
+	[AST_FOR] = "For",
+	[AST_SELECT] = "Select",
+	[AST_CASE] = "Case",
+	[AST_DEFAULT] = "Default",
+	[AST_TRY] = "Try",
+	[AST_CATCH] = "Catch",
+	[AST_RETURN] = "Return",
+	[AST_EXIT] = "Exit",
+	[AST_CONTINUE] = "Continue",
+	[AST_END] = "End",
+	[AST_THROW] = "Throw",
+	[AST_GOTO] = "Goto",
+	[AST_ASSERT] = "Assert",
+	[AST_ASSIGN] = "Assign",
+	[AST_INCREMENT] = "Increment",
+	[AST_IDENT] = "Ident",
+	[AST_LITERAL] = "Literal",
+	[AST_SELF] = "Self",
+	[AST_SUPER] = "Super",
+	[AST_UNARY] = "Unary",
+	[AST_BINARY] = "Binary",
+	[AST_MEMBER] = "Member",
+	[AST_CALL] = "Call",
+	[AST_INDEX] = "Index",
+	[AST_SLICE] = "Slice",
+	[AST_NEW] = "New",
+	[AST_CAST] = "Cast",
+	[AST_ARRAY] = "Array",
+};
+
+static const token_t *parse_token(const parser_t *p, size_t pos);
+static token_kind_t parse_kind_at(const parser_t *p, size_t pos);
+static token_kind_t parse_kind(const parser_t *p);
+static bool parse_is_trivia(const parser_t *p, size_t pos);
+static void parse_skip_trivia(parser_t *p);
+static size_t parse_advance(parser_t *p);
+static bool parse_accept(parser_t *p, token_kind_t kind);
+static bool parse_is_word(const parser_t *p, size_t pos, const char *word);
+static bool parse_adjacent(const parser_t *p, size_t token);
+static bool parse_ends_statement(token_kind_t kind);
+static int parse_closer(const parser_t *p, size_t *width);
+static void parse_skip_line(parser_t *p);
+static uint32_t parse_fail(parser_t *p, const char *message);
+static bool parse_expect(parser_t *p, token_kind_t kind, const char *message);
+static bool parse_expect_closer(parser_t *p, int closer, int alternative, const char *message);
+static uint32_t parse_node(parser_t *p, ast_kind_t kind, int op, size_t token);
+static void parse_append(parser_t *p, uint32_t parent, uint32_t *last, uint32_t child);
+static uint32_t parse_node2(parser_t *p, ast_kind_t kind, int op, size_t token, uint32_t first, uint32_t second);
+static void parse_recover(parser_t *p, uint32_t parent, uint32_t *last);
+static void parse_header_end(parser_t *p, uint32_t node, uint32_t *last);
+static void parse_open(parser_t *p, int first, int second, int third, int delta);
+
+static void parse_statements(parser_t *p, uint32_t parent, uint32_t *last);
+static uint32_t parse_block(parser_t *p, int first, int second, int third);
+static uint32_t parse_line_block(parser_t *p);
+static uint32_t parse_statement(parser_t *p);
+static uint32_t parse_operand_statement(parser_t *p, ast_kind_t kind);
+static uint32_t parse_expression_statement(parser_t *p);
+static uint32_t parse_if(parser_t *p);
+static uint32_t parse_if_line(parser_t *p, uint32_t node, uint32_t *last);
+static uint32_t parse_while(parser_t *p);
+static uint32_t parse_repeat(parser_t *p);
+static uint32_t parse_for(parser_t *p);
+static uint32_t parse_select(parser_t *p);
+static uint32_t parse_try(parser_t *p);
+static uint32_t parse_type(parser_t *p);
+static uint32_t parse_extern(parser_t *p);
+static uint32_t parse_function(parser_t *p);
+static uint32_t parse_vars(parser_t *p, ast_kind_t kind, int op, uint32_t flags);
+static uint32_t parse_var(parser_t *p, bool value);
+static uint32_t parse_params(parser_t *p);
+
+static bool parse_is_type_keyword(token_kind_t kind);
+static bool parse_is_sigil(token_kind_t kind);
+static uint32_t parse_type_base(parser_t *p, bool qualified);
+static uint32_t parse_type_ref(parser_t *p, bool function);
+static void parse_type_suffix(parser_t *p, uint32_t type, bool dims, bool function);
+static uint32_t parse_dims(parser_t *p);
+
+static uint32_t parse_expression(parser_t *p);
+static int parse_binary_op(const parser_t *p, int *op, size_t *width);
+static uint32_t parse_binary(parser_t *p, int precedence);
+static uint32_t parse_unary(parser_t *p);
+static uint32_t parse_primary(parser_t *p);
+static uint32_t parse_postfix(parser_t *p, uint32_t node);
+static void parse_arguments(parser_t *p, uint32_t call, uint32_t *last, token_kind_t close);
+static uint32_t parse_string(parser_t *p);
+
+
+/** token cursor **/
+
+/* the token at pos, which has to be below num_tokens */
+static const token_t *parse_token(const parser_t *p, size_t pos) {
+	return (p->tokens != NULL ? p->tokens+pos : lexer_get_token_span(p->lexer, pos, NULL));
+}
+
+
+static token_kind_t parse_kind_at(const parser_t *p, size_t pos) {
+	return (pos < p->num_tokens ? parse_token(p, pos)->kind : TOK_EOF);
+}
+
+
+static token_kind_t parse_kind(const parser_t *p) {
+	return parse_kind_at(p, p->pos);
+}
+
+
+/* comments, skipped regions and a .. continuing the line along with the newline after it */
+static bool parse_is_trivia(const parser_t *p, size_t pos) {
+	switch (parse_kind_at(p, pos)) {
+		case TOK_LINE_COMMENT: case TOK_BLOCK_COMMENT: case TOK_REM_KW: case TOK_ENDREM_KW: case TOK_SKIPPED:
+			return true;
+		case TOK_DOUBLEDOT:
+			++pos;
+			while (parse_kind_at(p, pos) == TOK_LINE_COMMENT) {
+				++pos;
+			}
+			return (parse_kind_at(p, pos) == TOK_NEWLINE);
+		default:
+			return false;
+	}
+}
+
+
+static void parse_skip_trivia(parser_t *p) {
+	while (parse_is_trivia(p, p->pos)) {
+		if (parse_kind(p) == TOK_DOUBLEDOT) {
+			while (parse_kind(p) != TOK_NEWLINE) {
+				++p->pos;
+			}
+		}
+		++p->pos;
+	}
+}
+
+
+/* moves past the current token and returns its index */
+static size_t parse_advance(parser_t *p) {
+	size_t pos = p->pos;
+	if (pos < p->num_tokens) {
+		++p->pos;
+		parse_skip_trivia(p);
+	}
+	return pos;
+}
+
+
+static bool parse_accept(parser_t *p, token_kind_t kind) {
+	if (parse_kind(p) != kind) {
+		return false;
+	}
+	parse_advance(p);
+	return true;
+}
+
+
+/* Field, Return, Try and so on aren't keywords to the lexer, so they're matched by name */
+static bool parse_is_word(const parser_t *p, size_t pos, const char *word) {
+	if (parse_kind_at(p, pos) != TOK_ID) {
+		return false;
+	}
+	const token_t *token = parse_token(p, pos);
+	size_t len = (size_t)(token->to-token->from);
+	return (len == strlen(word) && strncasecmp(token->from, word, len) == 0);
+}
+
+
+/* whether the current token immediately follows the token, without even a space between them */
+static bool parse_adjacent(const parser_t *p, size_t token) {
+	return (p->pos == token+1 && p->pos < p->num_tokens && parse_token(p, p->pos)->from == parse_token(p, token)->to);
+}
+
+
+static bool parse_ends_statement(token_kind_t kind) {
+	switch (kind) {
+		case TOK_NEWLINE: case TOK_SEMICOLON: case TOK_EOF:
+		case TOK_ELSE_KW: case TOK_ELSEIF_KW: case TOK_ENDIF_KW:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/* returns the kind of the keyword closing (or continuing) a block at the current token, or TOK_INVALID - End and
+   the keyword after it are separate tokens unless a single space separates them, so width is set to the number
+   of tokens the closer takes up */
+static int parse_closer(const parser_t *p, size_t *width) {
+	token_kind_t kind = parse_kind(p);
+	*width = 1;
+	switch (kind) {
+		case TOK_ENDIF_KW: case TOK_ELSE_KW: case TOK_ELSEIF_KW:
+		case TOK_WEND_KW: case TOK_ENDWHILE_KW: case TOK_UNTIL_KW: case TOK_FOREVER_KW: case TOK_NEXT_KW:
+		case TOK_CASE_KW: case TOK_DEFAULT_KW: case TOK_ENDSELECT_KW:
+		case TOK_ENDFUNCTION_KW: case TOK_ENDMETHOD_KW: case TOK_ENDTYPE_KW: case TOK_ENDEXTERN_KW:
+		case TOK_ENDPROTOCOL_KW:
+			return kind;
+		
+		case TOK_END_KW:
+			*width = 2;
+			switch (parse_kind_at(p, p->pos+1)) {
+				case TOK_IF_KW: return TOK_ENDIF_KW;
+				case TOK_WHILE_KW: return TOK_ENDWHILE_KW;
+				case TOK_SELECT_KW: return TOK_ENDSELECT_KW;
+				case TOK_FUNCTION_KW: return TOK_ENDFUNCTION_KW;
+				case TOK_METHOD_KW: return TOK_ENDMETHOD_KW;
+				case TOK_TYPE_KW: return TOK_ENDTYPE_KW;
+				case TOK_EXTERN_KW: return TOK_ENDEXTERN_KW;
+				case TOK_PROTOCOL_KW: return TOK_ENDPROTOCOL_KW;
+				default: break;
+			}
+			if (parse_is_word(p, p->pos+1, "try")) {
+				return PARSE_ENDTRY;
+			}
+			*width = 1;
+			return TOK_INVALID;
+		
+		case TOK_ID:
+			if (parse_is_word(p, p->pos, "catch")) {
+				return PARSE_CATCH;
+			} else if (parse_is_word(p, p->pos, "endtry")) {
+				return PARSE_ENDTRY;
+			}
+			return TOK_INVALID;
+		
+		default:
+			return TOK_INVALID;
+	}
+}
+
+
+static void parse_skip_line(parser_t *p) {
+	token_kind_t kind;
+	while ((kind = parse_kind(p)) != TOK_NEWLINE && kind != TOK_SEMICOLON && kind != TOK_EOF) {
+		parse_advance(p);
+	}
+}
+
+
+/** errors and nodes **/
+
+/* flags the statement being parsed as failed, keeping the message if it's the first error - always returns 0 so it
+   can stand in for a node */
+static uint32_t parse_fail(parser_t *p, const char *message) {
+	if (p->failed) {
+		return 0;
+	}
+	p->failed = true;
+	
+	ast_t *ast = p->ast;
+	if (ast->error != NULL) {
+		return 0;
+	}
+	
+	size_t pos = p->pos;
+	token_kind_t kind = parse_kind_at(p, pos);
+	// the EOF token has no place of its own, so point at the end of the last one
+	if (kind == TOK_EOF && pos > 0) {
+		pos = (pos < p->num_tokens ? pos : p->num_tokens)-1;
+	}
+	
+	const token_t *token = (pos < p->num_tokens ? parse_token(p, pos) : NULL);
+	const char *found = "end of file";
+	int found_len = 11;
+	if (kind == TOK_NEWLINE) {
+		found = "end of line";
+	} else if (kind != TOK_EOF) {
+		found = token->from;
+		found_len = (int)(token->to-token->from);
+	}
+	
+	long long line = (token != NULL ? (long long)token->line : 0);
+	long long column = (token != NULL ? (long long)token->column : 0);
+	int len = snprintf(NULL, 0, "[%lld:%lld] %s but found %.*s\n", line, column, message, found_len, found);
+	if (len < 0 || (ast->error = malloc((size_t)len+1)) == NULL) {
+		return 0;
+	}
+	snprintf(ast->error, (size_t)len+1, "[%lld:%lld] %s but found %.*s\n", line, column, message, found_len, found);
+	return 0;
+}
+
+
+static bool parse_expect(parser_t *p, token_kind_t kind, const char *message) {
+	if (parse_accept(p, kind)) {
+		return true;
+	}
+	parse_fail(p, message);
+	return false;
+}
+
+
+/* alternative is another closer that's accepted as well, e.g. EndWhile for Wend, or TOK_INVALID */
+static bool parse_expect_closer(parser_t *p, int closer, int alternative, const char *message) {
+	size_t width;
+	int kind = parse_closer(p, &width);
+	if (kind == TOK_INVALID || (kind != closer && kind != alternative)) {
+		parse_fail(p, message);
+		return false;
+	}
+	
+	for (; width > 0; --width) {
+		parse_advance(p);
+	}
+	return true;
+}
+
+
+/* adds a node and returns its index, or 0 if out of memory */
+static uint32_t parse_node(parser_t *p, ast_kind_t kind, int op, size_t token) {
+	ast_t *ast = p->ast;
+	if (ast->num_nodes == ast->capacity) {
+		uint32_t capacity = (ast->capacity <= PARSE_MAX_NODES/2 ? ast->capacity*2 : PARSE_MAX_NODES);
+		ast_node_t *nodes = NULL;
+		if (capacity > ast->num_nodes) {
+			nodes = realloc(ast->nodes, (size_t)capacity*sizeof(ast_node_t));
+		}
+		if (nodes == NULL) {
+			p->out_of_memory = true;
+			p->failed = true;
+			return 0;
+		}
+		ast->nodes = nodes;
+		ast->capacity = capacity;
+	}
+	
+	ast_node_t *node = ast->nodes+ast->num_nodes;
+	node->kind = (uint16_t)kind;
+	node->op = (uint16_t)op;
+	node->flags = 0;
+	node->child = 0;
+	node->next = 0;
+	node->token = token;
+	return ast->num_nodes++;
+}
+
+
+/* links child in after last, the last child added to parent so far (0 if none) */
+static void parse_append(parser_t *p, uint32_t parent, uint32_t *last, uint32_t child) {
+	if (child == 0 || p->out_of_memory) {
+		return;
+	}
+	
+	ast_node_t *nodes = p->ast->nodes;
+	if (*last == 0) {
+		nodes[parent].child = child;
+	} else {
+		nodes[*last].next = child;
+	}
+	*last = child;
+}
+
+
+static uint32_t parse_node2(parser_t *p, ast_kind_t kind, int op, size_t token, uint32_t first, uint32_t second) {
+	uint32_t node = parse_node(p, kind, op, token);
+	uint32_t last = 0;
+	parse_append(p, node, &last, first);
+	parse_append(p, node, &last, second);
+	return node;
+}
+
+
+/* ends a failed statement with an AST_ERROR node and carries on with the next one */
+static void parse_recover(parser_t *p, uint32_t parent, uint32_t *last) {
+	if (p->out_of_memory) {
+		return;
+	}
+	
+	parse_append(p, parent, last, parse_node(p, AST_ERROR, TOK_INVALID, p->pos));
+	++p->ast->num_errors;
+	p->failed = false;
+	parse_skip_line(p);
+}
+
+
+/* ends the first line of a block statement - a broken one is recovered from right away so the block's body is
+   still parsed as part of it */
+static void parse_header_end(parser_t *p, uint32_t node, uint32_t *last) {
+	if (!p->failed) {
+		token_kind_t kind = parse_kind(p);
+		if (kind == TOK_NEWLINE || kind == TOK_SEMICOLON || kind == TOK_EOF) {
+			return;
+		}
+		parse_fail(p, "Expected end of line");
+	}
+	parse_recover(p, node, last);
+}
+
+
+/* counts the closers as ending a block that's being parsed (delta 1) or no longer (delta -1) - a closer that
+   doesn't end any is an error rather than the end of the statements */
+static void parse_open(parser_t *p, int first, int second, int third, int delta) {
+	p->open[first] += delta;
+	p->open[second] += delta;
+	p->open[third] += delta;
+	p->open[TOK_INVALID] = 0;
+}
+
+
+/** statements **/
+
+static void parse_statements(parser_t *p, uint32_t parent, uint32_t *last) {
+	if (p->depth >= PARSE_MAX_DEPTH) {
+		parse_fail(p, "Blocks nested too deeply");
+		return;
+	}
+	++p->depth;
+	
+	for (;;) {
+		token_kind_t kind = parse_kind(p);
+		size_t width;
+		if (kind == TOK_NEWLINE || kind == TOK_SEMICOLON) {
+			parse_advance(p);
+			continue;
+		} else if (kind == TOK_EOF) {
+			break;
+		}
+		
+		size_t start = p->pos;
+		int closer = parse_closer(p, &width);
+		if (closer != TOK_INVALID && p->open[closer] > 0) {
+			break;
+		} else if (closer != TOK_INVALID) {
+			parse_fail(p, "Expected a statement");
+		} else {
+			parse_append(p, parent, last, parse_statement(p));
+		}
+		
+		if (!p->failed) {
+			kind = parse_kind(p);
+			if (!parse_ends_statement(kind) && parse_closer(p, &width) == TOK_INVALID) {
+				parse_fail(p, "Expected end of statement");
+			}
+		}
+		
+		if (p->out_of_memory) {
+			break;
+		} else if (p->failed) {
+			parse_recover(p, parent, last);
+		}
+		
+		if (p->pos == start) {
+			parse_advance(p);
+		}
+	}
+	
+	--p->depth;
+}
+
+
+/* statements up to one of the closers given, TOK_INVALID for none */
+static uint32_t parse_block(parser_t *p, int first, int second, int third) {
+	uint32_t block = parse_node(p, AST_BLOCK, TOK_INVALID, p->pos);
+	uint32_t last = 0;
+	parse_open(p, first, second, third, 1);
+	parse_statements(p, block, &last);
+	parse_open(p, first, second, third, -1);
+	return block;
+}
+
+
+/* the statements of a single-line If, up to the end of the line or an Else, ElseIf or EndIf */
+static uint32_t parse_line_block(parser_t *p) {
+	uint32_t block = parse_node(p, AST_BLOCK, TOK_INVALID, p->pos);
+	uint32_t last = 0;
+	
+	while (!p->failed) {
+		token_kind_t kind = parse_kind(p);
+		size_t width;
+		if (kind == TOK_SEMICOLON) {
+			parse_advance(p);
+			continue;
+		} else if (kind == TOK_NEWLINE || kind == TOK_EOF || kind == TOK_ELSE_KW || kind == TOK_ELSEIF_KW ||
+				parse_closer(p, &width) == TOK_ENDIF_KW) {
+			break;
+		}
+		
+		parse_append(p, block, &last, parse_statement(p));
+	}
+	
+	return block;
+}
+
+
+static uint32_t parse_statement(parser_t *p) {
+	token_kind_t kind = parse_kind(p);
+	switch (kind) {
+		case TOK_STRICT_KW: case TOK_SUPERSTRICT_KW:
+			return parse_node(p, AST_STRICT, kind, parse_advance(p));
+		case TOK_FRAMEWORK_KW:
+			return parse_operand_statement(p, AST_FRAMEWORK);
+		case TOK_MODULE_KW:
+			return parse_operand_statement(p, AST_MODULE);
+		case TOK_MODULEINFO_KW:
+			return parse_operand_statement(p, AST_MODULEINFO);
+		case TOK_IMPORT_KW:
+			return parse_operand_statement(p, AST_IMPORT);
+		case TOK_INCLUDE_KW:
+			return parse_operand_statement(p, AST_INCLUDE);
+		case TOK_PRIVATE_KW: case TOK_PUBLIC_KW:
+			return parse_node(p, AST_VISIBILITY, kind, parse_advance(p));
+		
+		case TOK_TYPE_KW: case TOK_PROTOCOL_KW:
+			return parse_type(p);
+		case TOK_EXTERN_KW:
+			return parse_extern(p);
+		case TOK_FUNCTION_KW: case TOK_METHOD_KW:
+			return parse_function(p);
+		case TOK_LOCAL_KW:
+			return parse_vars(p, AST_LOCAL, kind, 0);
+		case TOK_AUTO_KW:
+			return parse_vars(p, AST_LOCAL, kind, AST_FLAG_AUTO);
+		case TOK_GLOBAL_KW:
+			return parse_vars(p, AST_GLOBAL, kind, 0);
+		case TOK_CONST_KW:
+			return parse_vars(p, AST_CONST, kind, 0);
+		
+		case TOK_IF_KW:
+			return parse_if(p);
+		case TOK_WHILE_KW:
+			return parse_while(p);
+		case TOK_REPEAT_KW:
+			return parse_repeat(p);
+		case TOK_FOR_KW:
+			return parse_for(p);
+		case TOK_SELECT_KW:
+			return parse_select(p);
+		case TOK_END_KW:
+			return parse_node(p, AST_END, kind, parse_advance(p));
+		
+		case TOK_HASH:
+			parse_advance(p);
+			if (parse_kind(p) != TOK_ID) {
+				return parse_fail(p, "Expected a label");
+			}
+			return parse_node(p, AST_LABEL, TOK_INVALID, parse_advance(p));
+		
+		case TOK_QUESTION:
+			// a ?Condition line the lexer didn't evaluate
+			parse_skip_line(p);
+			return 0;
+		
+		case TOK_DOUBLEPLUS: case TOK_DOUBLEMINUS: {
+			size_t token = parse_advance(p);
+			return parse_node2(p, AST_INCREMENT, kind, token, parse_postfix(p, parse_primary(p)), 0);
+		}
+		
+		case TOK_ID:
+			if (parse_is_word(p, p->pos, "field")) {
+				return parse_vars(p, AST_FIELD, TOK_INVALID, 0);
+			} else if (parse_is_word(p, p->pos, "return")) {
+				size_t token = parse_advance(p);
+				uint32_t value = (parse_ends_statement(parse_kind(p)) ? 0 : parse_expression(p));
+				return parse_node2(p, AST_RETURN, TOK_INVALID, token, value, 0);
+			} else if (parse_is_word(p, p->pos, "exit")) {
+				return parse_node(p, AST_EXIT, TOK_INVALID, parse_advance(p));
+			} else if (parse_is_word(p, p->pos, "continue")) {
+				return parse_node(p, AST_CONTINUE, TOK_INVALID, parse_advance(p));
+			} else if (parse_is_word(p, p->pos, "throw")) {
+				size_t token = parse_advance(p);
+				return parse_node2(p, AST_THROW, TOK_INVALID, token, parse_expression(p), 0);
+			} else if (parse_is_word(p, p->pos, "try")) {
+				return parse_try(p);
+			} else if (parse_is_word(p, p->pos, "goto")) {
+				parse_advance(p);
+				parse_accept(p, TOK_HASH);
+				if (parse_kind(p) != TOK_ID) {
+					return parse_fail(p, "Expected a label");
+				}
+				return parse_node(p, AST_GOTO, TOK_INVALID, parse_advance(p));
+			} else if (parse_is_word(p, p->pos, "assert")) {
+				size_t token = parse_advance(p);
+				uint32_t condition = parse_expression(p);
+				uint32_t message = 0;
+				if (!p->failed && (parse_accept(p, TOK_ELSE_KW) || parse_accept(p, TOK_COMMA))) {
+					message = parse_expression(p);
+				}
+				return parse_node2(p, AST_ASSERT, TOK_INVALID, token, condition, message);
+			}
+			break;
+		
+		default:
+			break;
+	}
+	
+	return parse_expression_statement(p);
+}
+
+
+/* a keyword followed by a module name or string, e.g. Import brl.linkedlist */
+static uint32_t parse_operand_statement(parser_t *p, ast_kind_t kind) {
+	token_kind_t keyword = parse_kind(p);
+	size_t token = parse_advance(p);
+	return parse_node2(p, kind, keyword, token, parse_expression(p), 0);
+}
+
+
+static uint32_t parse_expression_statement(parser_t *p) {
+	size_t start = p->pos;
+	uint32_t target = parse_postfix(p, parse_primary(p));
+	if (p->failed) {
+		return target;
+	}
+	
+	token_kind_t kind = parse_kind(p);
+	switch (kind) {
+		case TOK_EQUALS: case TOK_ASSIGN_AUTO:
+		case TOK_ASSIGN_ADD: case TOK_ASSIGN_SUBTRACT: case TOK_ASSIGN_DIVIDE: case TOK_ASSIGN_MULTIPLY:
+		case TOK_ASSIGN_POWER: case TOK_ASSIGN_SHL: case TOK_ASSIGN_SHR: case TOK_ASSIGN_SAR: case TOK_ASSIGN_MOD:
+		case TOK_ASSIGN_XOR: case TOK_ASSIGN_AND: case TOK_ASSIGN_OR: {
+			size_t token = parse_advance(p);
+			return parse_node2(p, AST_ASSIGN, kind, token, target, parse_expression(p));
+		}
+		
+		case TOK_DOUBLEPLUS: case TOK_DOUBLEMINUS:
+			return parse_node2(p, AST_INCREMENT, kind, parse_advance(p), target, 0);
+		
+		default:
+			break;
+	}
+	
+	uint16_t target_kind = p->ast->nodes[target].kind;
+	if (target_kind != AST_IDENT && target_kind != AST_MEMBER) {
+		return target;
+	}
+	
+	// a name on its own is a call, with any arguments following it without parentheses, e.g. Print x
+	uint32_t call = parse_node(p, AST_CALL, TOK_INVALID, start);
+	uint32_t last = 0;
+	if (call != 0) {
+		p->ast->nodes[call].flags |= AST_FLAG_NO_PARENS;
+	}
+	parse_append(p, call, &last, target);
+	parse_arguments(p, call, &last, TOK_INVALID);
+	return call;
+}
+
+
+static uint32_t parse_if(parser_t *p) {
+	uint32_t node = parse_node(p, AST_IF, TOK_IF_KW, parse_advance(p));
+	uint32_t last = 0;
+	parse_append(p, node, &last, parse_expression(p));
+	if (p->failed) {
+		return node;
+	}
+	
+	parse_accept(p, TOK_THEN_KW);
+	token_kind_t kind = parse_kind(p);
+	if (kind != TOK_NEWLINE && kind != TOK_EOF) {
+		return parse_if_line(p, node, &last);
+	}
+	
+	parse_append(p, node, &last, parse_block(p, TOK_ENDIF_KW, TOK_ELSE_KW, TOK_ELSEIF_KW));
+	
+	// ElseIf (or Else If) branches are nested Ifs
+	uint32_t branch = node;
+	uint32_t branch_last = last;
+	while (!p->failed) {
+		size_t width;
+		int closer = parse_closer(p, &width);
+		if (closer == TOK_ELSEIF_KW || (closer == TOK_ELSE_KW && parse_kind_at(p, p->pos+1) == TOK_IF_KW)) {
+			size_t token = parse_advance(p);
+			if (closer == TOK_ELSE_KW) {
+				parse_advance(p);
+			}
+			
+			uint32_t elseif = parse_node(p, AST_IF, TOK_ELSEIF_KW, token);
+			parse_append(p, branch, &branch_last, elseif);
+			branch = elseif;
+			branch_last = 0;
+			
+			parse_append(p, branch, &branch_last, parse_expression(p));
+			parse_accept(p, TOK_THEN_KW);
+			parse_header_end(p, branch, &branch_last);
+			parse_append(p, branch, &branch_last, parse_block(p, TOK_ENDIF_KW, TOK_ELSE_KW, TOK_ELSEIF_KW));
+		} else {
+			if (closer == TOK_ELSE_KW) {
+				parse_advance(p);
+				parse_append(p, branch, &branch_last, parse_block(p, TOK_ENDIF_KW, TOK_INVALID, TOK_INVALID));
+			}
+			parse_expect_closer(p, TOK_ENDIF_KW, TOK_INVALID, "Expected EndIf");
+			break;
+		}
+	}
+	
+	return node;
+}
+
+
+static uint32_t parse_if_line(parser_t *p, uint32_t node, uint32_t *last) {
+	if (!p->out_of_memory) {
+		p->ast->nodes[node].flags |= AST_FLAG_SINGLE_LINE;
+	}
+	
+	parse_append(p, node, last, parse_line_block(p));
+	if (p->failed) {
+		return node;
+	}
+	
+	if (parse_kind(p) == TOK_ELSEIF_KW) {
+		uint32_t elseif = parse_node(p, AST_IF, TOK_ELSEIF_KW, parse_advance(p));
+		uint32_t elseif_last = 0;
+		parse_append(p, node, last, elseif);
+		parse_append(p, elseif, &elseif_last, parse_expression(p));
+		if (!p->failed) {
+			parse_accept(p, TOK_THEN_KW);
+			parse_if_line(p, elseif, &elseif_last);
+		}
+	} else if (parse_accept(p, TOK_ELSE_KW)) {
+		parse_append(p, node, last, parse_line_block(p));
+	}
+	
+	size_t width;
+	if (!p->failed && parse_closer(p, &width) == TOK_ENDIF_KW) {
+		parse_expect_closer(p, TOK_ENDIF_KW, TOK_INVALID, "Expected EndIf");
+	}
+	return node;
+}
+
+
+static uint32_t parse_while(parser_t *p) {
+	uint32_t node = parse_node(p, AST_WHILE, TOK_WHILE_KW, parse_advance(p));
+	uint32_t last = 0;
+	parse_append(p, node, &last, parse_expression(p));
+	parse_header_end(p, node, &last);
+	parse_append(p, node, &last, parse_block(p, TOK_WEND_KW, TOK_ENDWHILE_KW, TOK_INVALID));
+	parse_expect_closer(p, TOK_WEND_KW, TOK_ENDWHILE_KW, "Expected Wend");
+	return node;
+}
+
+
+static uint32_t parse_repeat(parser_t *p) {
+	uint32_t node = parse_node(p, AST_REPEAT, TOK_REPEAT_KW, parse_advance(p));
+	uint32_t last = 0;
+	parse_header_end(p, node, &last);
+	parse_append(p, node, &last, parse_block(p, TOK_UNTIL_KW, TOK_FOREVER_KW, TOK_INVALID));
+	
+	if (parse_accept(p, TOK_UNTIL_KW)) {
+		parse_append(p, node, &last, parse_expression(p));
+	} else if (!parse_accept(p, TOK_FOREVER_KW)) {
+		parse_fail(p, "Expected Until or Forever");
+	}
+	return node;
+}
+
+
+static uint32_t parse_for(parser_t *p) {
+	uint32_t node = parse_node(p, AST_FOR, TOK_FOR_KW, parse_advance(p));
+	uint32_t last = 0;
+	uint32_t flags = 0;
+	
+	if (parse_kind(p) == TOK_LOCAL_KW) {
+		uint32_t local = parse_node(p, AST_LOCAL, TOK_LOCAL_KW, parse_advance(p));
+		uint32_t local_last = 0;
+		parse_append(p, local, &local_last, parse_var(p, false));
+		parse_append(p, node, &last, local);
+	} else {
+		parse_append(p, node, &last, parse_postfix(p, parse_primary(p)));
+	}
+	
+	if (!p->failed && !parse_accept(p, TOK_EQUALS) && !parse_accept(p, TOK_ASSIGN_AUTO)) {
+		parse_fail(p, "Expected =");
+	}
+	
+	if (!p->failed && parse_accept(p, TOK_EACHIN_KW)) {
+		flags |= AST_FLAG_EACHIN;
+		parse_append(p, node, &last, parse_expression(p));
+	} else if (!p->failed) {
+		parse_append(p, node, &last, parse_expression(p));
+		if (parse_accept(p, TOK_UNTIL_KW)) {
+			flags |= AST_FLAG_UNTIL;
+		} else {
+			parse_expect(p, TOK_TO_KW, "Expected To or Until");
+		}
+		parse_append(p, node, &last, parse_expression(p));
+		
+		if (!p->failed && parse_is_word(p, p->pos, "step")) {
+			parse_advance(p);
+			flags |= AST_FLAG_STEP;
+			parse_append(p, node, &last, parse_expression(p));
+		}
+	}
+	
+	if (!p->out_of_memory) {
+		p->ast->nodes[node].flags |= flags;
+	}
+	parse_header_end(p, node, &last);
+	parse_append(p, node, &last, parse_block(p, TOK_NEXT_KW, TOK_INVALID, TOK_INVALID));
+	parse_expect_closer(p, TOK_NEXT_KW, TOK_INVALID, "Expected Next");
+	return node;
+}
+
+
+static uint32_t parse_select(parser_t *p) {
+	uint32_t node = parse_node(p, AST_SELECT, TOK_SELECT_KW, parse_advance(p));
+	uint32_t last = 0;
+	parse_append(p, node, &last, parse_expression(p));
+	parse_header_end(p, node, &last);
+	
+	while (!p->failed) {
+		token_kind_t kind = parse_kind(p);
+		if (kind == TOK_NEWLINE || kind == TOK_SEMICOLON) {
+			parse_advance(p);
+			continue;
+		}
+		
+		size_t width;
+		int closer = parse_closer(p, &width);
+		if (closer == TOK_CASE_KW) {
+			uint32_t branch = parse_node(p, AST_CASE, TOK_CASE_KW, parse_advance(p));
+			uint32_t branch_last = 0;
+			parse_append(p, node, &last, branch);
+			do {
+				parse_append(p, branch, &branch_last, parse_expression(p));
+			} while (!p->failed && parse_accept(p, TOK_COMMA));
+			parse_header_end(p, branch, &branch_last);
+			parse_append(p, branch, &branch_last, parse_block(p, TOK_CASE_KW, TOK_DEFAULT_KW, TOK_ENDSELECT_KW));
+		} else if (closer == TOK_DEFAULT_KW) {
+			uint32_t branch = parse_node(p, AST_DEFAULT, TOK_DEFAULT_KW, parse_advance(p));
+			uint32_t branch_last = 0;
+			parse_append(p, node, &last, branch);
+			parse_header_end(p, branch, &branch_last);
+			parse_append(p, branch, &branch_last, parse_block(p, TOK_CASE_KW, TOK_DEFAULT_KW, TOK_ENDSELECT_KW));
+		} else {
+			parse_expect_closer(p, TOK_ENDSELECT_KW, TOK_INVALID, "Expected Case, Default or EndSelect");
+			break;
+		}
+	}
+	
+	return node;
+}
+
+
+static uint32_t parse_try(parser_t *p) {
+	uint32_t node = parse_node(p, AST_TRY, TOK_INVALID, parse_advance(p));
+	uint32_t last = 0;
+	parse_header_end(p, node, &last);
+	parse_append(p, node, &last, parse_block(p, PARSE_CATCH, PARSE_ENDTRY, TOK_INVALID));
+	
+	while (!p->failed) {
+		size_t width;
+		if (parse_closer(p, &width) != PARSE_CATCH) {
+			parse_expect_closer(p, PARSE_ENDTRY, TOK_INVALID, "Expected Catch or EndTry");
+			break;
+		}
+		
+		uint32_t branch = parse_node(p, AST_CATCH, TOK_INVALID, parse_advance(p));
+		uint32_t branch_last = 0;
+		parse_append(p, node, &last, branch);
+		parse_append(p, branch, &branch_last, parse_var(p, false));
+		parse_header_end(p, branch, &branch_last);
+		parse_append(p, branch, &branch_last, parse_block(p, PARSE_CATCH, PARSE_ENDTRY, TOK_INVALID));
+	}
+	
+	return node;
+}
+
+
+/** declarations **/
+
+static uint32_t parse_type(parser_t *p) {
+	token_kind_t keyword = parse_kind(p);
+	bool protocol = (keyword == TOK_PROTOCOL_KW);
+	parse_advance(p);
+	if (parse_kind(p) != TOK_ID) {
+		return parse_fail(p, "Expected a name");
+	}
+	
+	uint32_t node = parse_node(p, (protocol ? AST_PROTOCOL : AST_TYPE), keyword, parse_advance(p));
+	uint32_t last = 0;
+	
+	static const struct { token_kind_t keyword; ast_kind_t kind; } lists[] = {
+		{ TOK_EXTENDS_KW, AST_EXTENDS },
+		{ TOK_IMPLEMENTS_KW, AST_IMPLEMENTS },
+	};
+	size_t index = 0;
+	for (; index < sizeof(lists)/sizeof(lists[0]) && !p->failed; ++index) {
+		if (parse_kind(p) != lists[index].keyword) {
+			continue;
+		}
+		
+		uint32_t list = parse_node(p, lists[index].kind, lists[index].keyword, parse_advance(p));
+		uint32_t list_last = 0;
+		parse_append(p, node, &last, list);
+		do {
+			parse_append(p, list, &list_last, parse_type_base(p, true));
+		} while (!p->failed && parse_accept(p, TOK_COMMA));
+	}
+	
+	uint32_t flags = 0;
+	while (!p->failed) {
+		token_kind_t kind = parse_kind(p);
+		if (kind == TOK_ABSTRACT_KW) {
+			flags |= AST_FLAG_ABSTRACT;
+		} else if (kind == TOK_FINAL_KW) {
+			flags |= AST_FLAG_FINAL;
+		} else if (kind == TOK_NODEBUG_KW) {
+			flags |= AST_FLAG_NODEBUG;
+		} else {
+			break;
+		}
+		parse_advance(p);
+	}
+	if (!p->out_of_memory) {
+		p->ast->nodes[node].flags |= flags;
+	}
+	
+	int closer = (protocol ? TOK_ENDPROTOCOL_KW : TOK_ENDTYPE_KW);
+	parse_header_end(p, node, &last);
+	p->declarative += protocol;
+	parse_open(p, closer, TOK_INVALID, TOK_INVALID, 1);
+	parse_statements(p, node, &last);
+	parse_open(p, closer, TOK_INVALID, TOK_INVALID, -1);
+	p->declarative -= protocol;
+	
+	if (protocol) {
+		parse_expect_closer(p, TOK_ENDPROTOCOL_KW, TOK_INVALID, "Expected EndProtocol");
+	} else {
+		parse_expect_closer(p, TOK_ENDTYPE_KW, TOK_INVALID, "Expected EndType");
+	}
+	return node;
+}
+
+
+static uint32_t parse_extern(parser_t *p) {
+	uint32_t node = parse_node(p, AST_EXTERN, TOK_EXTERN_KW, parse_advance(p));
+	uint32_t last = 0;
+	if (parse_kind(p) == TOK_STRING_LIT) {
+		parse_append(p, node, &last, parse_string(p));
+	}
+	parse_header_end(p, node, &last);
+	
+	++p->declarative;
+	parse_open(p, TOK_ENDEXTERN_KW, TOK_INVALID, TOK_INVALID, 1);
+	parse_statements(p, node, &last);
+	parse_open(p, TOK_ENDEXTERN_KW, TOK_INVALID, TOK_INVALID, -1);
+	--p->declarative;
+	
+	parse_expect_closer(p, TOK_ENDEXTERN_KW, TOK_INVALID, "Expected EndExtern");
+	return node;
+}
+
+
+static uint32_t parse_function(parser_t *p) {
+	token_kind_t keyword = parse_kind(p);
+	parse_advance(p);
+	token_kind_t kind = parse_kind(p);
+	if (kind != TOK_ID && kind != TOK_NEW_KW) {
+		return parse_fail(p, "Expected a name");
+	}
+	
+	uint32_t node = parse_node(p, AST_FUNCTION, keyword, parse_advance(p));
+	uint32_t last = 0;
+	kind = parse_kind(p);
+	if (kind == TOK_COLON || parse_is_sigil(kind)) {
+		parse_append(p, node, &last, parse_type_ref(p, false));
+	}
+	if (!p->failed) {
+		parse_append(p, node, &last, parse_params(p));
+	}
+	
+	uint32_t flags = 0;
+	while (!p->failed) {
+		kind = parse_kind(p);
+		if (kind == TOK_ABSTRACT_KW) {
+			flags |= AST_FLAG_ABSTRACT;
+		} else if (kind == TOK_FINAL_KW) {
+			flags |= AST_FLAG_FINAL;
+		} else if (kind == TOK_NODEBUG_KW) {
+			flags |= AST_FLAG_NODEBUG;
+		} else if (kind == TOK_EQUALS) {
+			// the symbol an Extern function is linked to
+			parse_advance(p);
+			parse_append(p, node, &last, parse_string(p));
+			continue;
+		} else {
+			break;
+		}
+		parse_advance(p);
+	}
+	if (!p->out_of_memory) {
+		p->ast->nodes[node].flags |= flags;
+	}
+	
+	parse_header_end(p, node, &last);
+	if (p->declarative > 0 || (flags & AST_FLAG_ABSTRACT)) {
+		return node;
+	}
+	
+	int closer = (keyword == TOK_FUNCTION_KW ? TOK_ENDFUNCTION_KW : TOK_ENDMETHOD_KW);
+	parse_append(p, node, &last, parse_block(p, closer, TOK_INVALID, TOK_INVALID));
+	if (keyword == TOK_FUNCTION_KW) {
+		parse_expect_closer(p, TOK_ENDFUNCTION_KW, TOK_INVALID, "Expected EndFunction");
+	} else {
+		parse_expect_closer(p, TOK_ENDMETHOD_KW, TOK_INVALID, "Expected EndMethod");
+	}
+	return node;
+}
+
+
+static uint32_t parse_vars(parser_t *p, ast_kind_t kind, int op, uint32_t flags) {
+	uint32_t node = parse_node(p, kind, op, parse_advance(p));
+	uint32_t last = 0;
+	if (!p->out_of_memory) {
+		p->ast->nodes[node].flags |= flags;
+	}
+	
+	do {
+		parse_append(p, node, &last, parse_var(p, true));
+	} while (!p->failed && parse_accept(p, TOK_COMMA));
+	return node;
+}
+
+
+/* a name with its type and, if value is true, its initial or default value */
+static uint32_t parse_var(parser_t *p, bool value) {
+	if (parse_kind(p) != TOK_ID) {
+		return parse_fail(p, "Expected a name");
+	}
+	
+	uint32_t node = parse_node(p, AST_VAR, TOK_INVALID, parse_advance(p));
+	uint32_t last = 0;
+	token_kind_t kind = parse_kind(p);
+	if (kind == TOK_COLON || kind == TOK_OPENBRACKET || parse_is_sigil(kind)) {
+		parse_append(p, node, &last, parse_type_ref(p, true));
+	}
+	
+	kind = parse_kind(p);
+	if (value && !p->failed && (kind == TOK_EQUALS || kind == TOK_ASSIGN_AUTO)) {
+		parse_advance(p);
+		parse_append(p, node, &last, parse_expression(p));
+	}
+	return node;
+}
+
+
+static uint32_t parse_params(parser_t *p) {
+	uint32_t node = parse_node(p, AST_PARAMS, TOK_INVALID, p->pos);
+	uint32_t last = 0;
+	if (!parse_expect(p, TOK_OPENPAREN, "Expected (") || parse_accept(p, TOK_CLOSEPAREN)) {
+		return node;
+	}
+	
+	do {
+		uint32_t param;
+		if (parse_kind(p) == TOK_TRIPLEDOT) {
+			param = parse_node(p, AST_VAR, TOK_INVALID, parse_advance(p));
+		} else {
+			param = parse_var(p, true);
+			if (!parse_accept(p, TOK_TRIPLEDOT)) {
+				parse_append(p, node, &last, param);
+				continue;
+			}
+		}
+		if (!p->out_of_memory) {
+			p->ast->nodes[param].flags |= AST_FLAG_VARIADIC;
+		}
+		parse_append(p, node, &last, param);
+	} while (!p->failed && parse_accept(p, TOK_COMMA));
+	
+	parse_expect(p, TOK_CLOSEPAREN, "Expected )");
+	return node;
+}
+
+
+/** types **/
+
+static bool parse_is_type_keyword(token_kind_t kind) {
+	return ((TOK_FLOAT_KW <= kind && kind <= TOK_OBJECT_KW));
+}
+
+
+static bool parse_is_sigil(token_kind_t kind) {
+	switch (kind) {
+		case TOK_PERCENT: case TOK_HASH: case TOK_BANG: case TOK_DOLLAR: case TOK_AT: case TOK_DOUBLEAT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/* a type keyword or a type's name - qualified names like brl.linkedlist.TList are only allowed in declarations,
+   since New TList.Create() means (New TList).Create() */
+static uint32_t parse_type_base(parser_t *p, bool qualified) {
+	token_kind_t kind = parse_kind(p);
+	if (parse_is_type_keyword(kind)) {
+		return parse_node(p, AST_TYPE_REF, kind, parse_advance(p));
+	} else if (kind != TOK_ID) {
+		return parse_fail(p, "Expected a type");
+	}
+	
+	size_t token = parse_advance(p);
+	while (qualified && parse_kind(p) == TOK_DOT && parse_kind_at(p, p->pos+1) == TOK_ID) {
+		parse_advance(p);
+		token = parse_advance(p);
+	}
+	return parse_node(p, AST_TYPE_REF, TOK_ID, token);
+}
+
+
+/* the type of a declaration: a : and a type, a sigil, or only array dimensions */
+static uint32_t parse_type_ref(parser_t *p, bool function) {
+	token_kind_t kind = parse_kind(p);
+	uint32_t type;
+	if (parse_accept(p, TOK_COLON)) {
+		type = parse_type_base(p, true);
+	} else if (parse_is_sigil(kind)) {
+		size_t token = parse_advance(p);
+		type = parse_node(p, AST_TYPE_REF, kind, token);
+		// $z and $w are C and wide strings in Extern declarations and %% is a Long
+		if ((kind == TOK_DOLLAR && parse_adjacent(p, token) &&
+				(parse_is_word(p, p->pos, "z") || parse_is_word(p, p->pos, "w"))) ||
+			(kind == TOK_PERCENT && parse_adjacent(p, token) && parse_kind(p) == TOK_PERCENT)) {
+			parse_advance(p);
+		}
+	} else {
+		type = parse_node(p, AST_TYPE_REF, TOK_INVALID, p->pos);
+	}
+	
+	if (!p->failed) {
+		parse_type_suffix(p, type, true, function);
+	}
+	return type;
+}
+
+
+/* Ptrs, array dimensions, a function type's parameters and Var */
+static void parse_type_suffix(parser_t *p, uint32_t type, bool dims, bool function) {
+	uint32_t last = 0;
+	while (!p->failed) {
+		token_kind_t kind = parse_kind(p);
+		if (kind == TOK_PTR_KW) {
+			parse_advance(p);
+			ast_node_t *node = p->ast->nodes+type;
+			if ((node->flags & 0xff) < 0xff) {
+				++node->flags;
+			}
+		} else if (kind == TOK_VAR_KW) {
+			parse_advance(p);
+			p->ast->nodes[type].flags |= AST_FLAG_VAR;
+		} else if (kind == TOK_OPENBRACKET && dims) {
+			parse_append(p, type, &last, parse_dims(p));
+		} else if (kind == TOK_OPENPAREN && function) {
+			parse_append(p, type, &last, parse_params(p));
+		} else {
+			break;
+		}
+	}
+}
+
+
+/* [] or [,] or [10, 20] */
+static uint32_t parse_dims(parser_t *p) {
+	uint32_t node = parse_node(p, AST_DIMS, TOK_INVALID, parse_advance(p));
+	uint32_t last = 0;
+	uint32_t rank = 1;
+	
+	while (!p->failed && !parse_accept(p, TOK_CLOSEBRACKET)) {
+		if (parse_accept(p, TOK_COMMA)) {
+			++rank;
+			continue;
+		}
+		parse_append(p, node, &last, parse_expression(p));
+		if (!p->failed && parse_kind(p) != TOK_COMMA && parse_kind(p) != TOK_CLOSEBRACKET) {
+			parse_fail(p, "Expected ]");
+		}
+	}
+	
+	if (!p->out_of_memory) {
+		p->ast->nodes[node].flags |= (rank < 0xff ? rank : 0xff);
+	}
+	return node;
+}
+
+
+/** expressions **/
+
+static uint32_t parse_expression(parser_t *p) {
+	return parse_binary(p, 1);
+}
+
+
+/* returns the precedence of the binary operator at the current token or 0 if there isn't one - op is set to its
+   kind and width to the number of tokens it takes up */
+static int parse_binary_op(const parser_t *p, int *op, size_t *width) {
+	token_kind_t kind = parse_kind(p);
+	*op = kind;
+	*width = 1;
+	switch (kind) {
+		case TOK_OR_KW:
+			return 1;
+		case TOK_AND_KW:
+			return 2;
+		
+		case TOK_LESSTHAN: case TOK_GREATERTHAN: case TOK_EQUALS: {
+			// <>, <= and >= (or =< and =>) are two tokens to the lexer
+			token_kind_t next = parse_kind_at(p, p->pos+1);
+			if (next != TOK_EOF && parse_token(p, p->pos+1)->from == parse_token(p, p->pos)->to) {
+				*width = 2;
+				if (kind == TOK_LESSTHAN && next == TOK_GREATERTHAN) {
+					*op = AST_OP_NOT_EQUAL;
+				} else if ((kind == TOK_LESSTHAN && next == TOK_EQUALS) || (kind == TOK_EQUALS && next == TOK_LESSTHAN)) {
+					*op = AST_OP_LESS_EQUAL;
+				} else if ((kind == TOK_GREATERTHAN && next == TOK_EQUALS) ||
+					(kind == TOK_EQUALS && next == TOK_GREATERTHAN)) {
+					*op = AST_OP_GREATER_EQUAL;
+				} else {
+					*width = 1;
+				}
+			}
+			return 3;
+		}
+		
+		case TOK_AMPERSAND: case TOK_PIPE: case TOK_TILDE:
+			return 4;
+		case TOK_PLUS: case TOK_MINUS:
+			return 5;
+		case TOK_ASTERISK: case TOK_SLASH: case TOK_MOD_KW: case TOK_SHL_KW: case TOK_SHR_KW: case TOK_SAR_KW:
+			return 6;
+		case TOK_CARET:
+			return 7;
+		default:
+			return 0;
+	}
+}
+
+
+/* operators of at least the given precedence, all left-associative - Not binds looser than comparisons, so
+   Not a = b is Not (a = b) */
+static uint32_t parse_binary(parser_t *p, int precedence) {
+	uint32_t left;
+	if (precedence <= 3 && parse_kind(p) == TOK_NOT_KW) {
+		size_t token = parse_advance(p);
+		left = parse_node2(p, AST_UNARY, TOK_NOT_KW, token, parse_binary(p, 3), 0);
+	} else {
+		left = parse_unary(p);
+	}
+	
+	int op;
+	size_t width;
+	int next;
+	while (!p->failed && (next = parse_binary_op(p, &op, &width)) >= precedence) {
+		size_t token = p->pos;
+		for (; width > 0; --width) {
+			parse_advance(p);
+		}
+		left = parse_node2(p, AST_BINARY, op, token, left, parse_binary(p, next+1));
+	}
+	return left;
+}
+
+
+static uint32_t parse_unary(parser_t *p) {
+	if (p->depth >= PARSE_MAX_DEPTH) {
+		return parse_fail(p, "Expression nested too deeply");
+	}
+	++p->depth;
+	
+	uint32_t node;
+	token_kind_t kind = parse_kind(p);
+	switch (kind) {
+		case TOK_MINUS: case TOK_PLUS: case TOK_TILDE: case TOK_NOT_KW: case TOK_VARPTR_KW: {
+			size_t token = parse_advance(p);
+			node = parse_node2(p, AST_UNARY, kind, token, parse_unary(p), 0);
+			break;
+		}
+		default:
+			node = parse_postfix(p, parse_primary(p));
+			break;
+	}
+	
+	--p->depth;
+	return node;
+}
+
+
+static uint32_t parse_primary(parser_t *p) {
+	token_kind_t kind = parse_kind(p);
+	uint32_t node;
+	switch (kind) {
+		case TOK_ID:
+			node = parse_node(p, AST_IDENT, TOK_INVALID, parse_advance(p));
+			break;
+		case TOK_NUMBER_LIT: case TOK_HEX_LIT: case TOK_BIN_LIT: case TOK_STRING_LIT: case TOK_NULL_KW:
+		case TOK_PI_KW:
+			node = parse_node(p, AST_LITERAL, kind, parse_advance(p));
+			break;
+		
+		case TOK_SELF_KW:
+			return parse_node(p, AST_SELF, kind, parse_advance(p));
+		case TOK_SUPER_KW:
+			return parse_node(p, AST_SUPER, kind, parse_advance(p));
+		
+		case TOK_NEW_KW: {
+			size_t token = parse_advance(p);
+			uint32_t type = parse_type_base(p, false);
+			if (!p->failed) {
+				parse_type_suffix(p, type, true, false);
+			}
+			return parse_node2(p, AST_NEW, kind, token, type, 0);
+		}
+		
+		case TOK_OPENPAREN:
+			parse_advance(p);
+			node = parse_expression(p);
+			if (!p->failed) {
+				parse_expect(p, TOK_CLOSEPAREN, "Expected )");
+			}
+			return node;
+		
+		case TOK_OPENBRACKET: {
+			node = parse_node(p, AST_ARRAY, TOK_INVALID, parse_advance(p));
+			uint32_t last = 0;
+			if (!parse_accept(p, TOK_CLOSEBRACKET)) {
+				do {
+					parse_append(p, node, &last, parse_expression(p));
+				} while (!p->failed && parse_accept(p, TOK_COMMA));
+				if (!p->failed) {
+					parse_expect(p, TOK_CLOSEBRACKET, "Expected ]");
+				}
+			}
+			return node;
+		}
+		
+		default:
+			if (!parse_is_type_keyword(kind)) {
+				return parse_fail(p, "Expected an expression");
+			}
+			
+			// Int(x) and the like, otherwise the type itself, e.g. as the argument to SizeOf
+			node = parse_type_base(p, false);
+			parse_type_suffix(p, node, false, false);
+			if (p->failed || parse_kind(p) != TOK_OPENPAREN) {
+				return node;
+			}
+			
+			size_t token = p->ast->nodes[node].token;
+			parse_advance(p);
+			uint32_t value = parse_expression(p);
+			if (!p->failed) {
+				parse_expect(p, TOK_CLOSEPAREN, "Expected )");
+			}
+			return parse_node2(p, AST_CAST, kind, token, node, value);
+	}
+	
+	// a sigil right after a name or literal gives its type
+	if (parse_is_sigil(parse_kind(p))) {
+		uint32_t last = 0;
+		parse_append(p, node, &last, parse_type_ref(p, false));
+	}
+	return node;
+}
+
+
+static uint32_t parse_postfix(parser_t *p, uint32_t node) {
+	while (!p->failed) {
+		token_kind_t kind = parse_kind(p);
+		if (kind == TOK_DOT) {
+			// any word can be a member's name
+			parse_advance(p);
+			kind = parse_kind(p);
+			if (kind != TOK_ID && !(TOK_END_KW <= kind && kind <= TOK_IMPLEMENTS_KW)) {
+				parse_fail(p, "Expected a member name");
+				break;
+			}
+			
+			uint32_t member = parse_node2(p, AST_MEMBER, TOK_DOT, parse_advance(p), node, 0);
+			if (parse_is_sigil(parse_kind(p))) {
+				uint32_t last = node;
+				parse_append(p, member, &last, parse_type_ref(p, false));
+			}
+			node = member;
+		} else if (kind == TOK_OPENPAREN) {
+			uint32_t call = parse_node(p, AST_CALL, TOK_INVALID, parse_advance(p));
+			uint32_t last = 0;
+			parse_append(p, call, &last, node);
+			parse_arguments(p, call, &last, TOK_CLOSEPAREN);
+			node = call;
+		} else if (kind == TOK_OPENBRACKET) {
+			size_t token = parse_advance(p);
+			uint32_t first = 0;
+			if (parse_kind(p) == TOK_DOUBLEDOT) {
+				first = parse_node(p, AST_EMPTY, TOK_INVALID, p->pos);
+			} else if (parse_kind(p) != TOK_CLOSEBRACKET) {
+				first = parse_expression(p);
+			}
+			
+			if (!p->failed && parse_kind(p) == TOK_DOUBLEDOT) {
+				// a slice, either bound of which may be left out
+				parse_advance(p);
+				uint32_t second = (parse_kind(p) == TOK_CLOSEBRACKET ?
+					parse_node(p, AST_EMPTY, TOK_INVALID, p->pos) : parse_expression(p));
+				uint32_t slice = parse_node(p, AST_SLICE, TOK_INVALID, token);
+				uint32_t last = 0;
+				parse_append(p, slice, &last, node);
+				parse_append(p, slice, &last, first);
+				parse_append(p, slice, &last, second);
+				node = slice;
+			} else {
+				uint32_t index = parse_node2(p, AST_INDEX, TOK_INVALID, token, node, first);
+				uint32_t last = first;
+				while (!p->failed && parse_accept(p, TOK_COMMA)) {
+					parse_append(p, index, &last, parse_expression(p));
+				}
+				node = index;
+			}
+			
+			if (!p->failed) {
+				parse_expect(p, TOK_CLOSEBRACKET, "Expected ]");
+			}
+		} else {
+			break;
+		}
+	}
+	return node;
+}
+
+
+/* arguments up to close, or to the end of the statement for TOK_INVALID - left out ones are AST_EMPTY */
+static void parse_arguments(parser_t *p, uint32_t call, uint32_t *last, token_kind_t close) {
+	token_kind_t kind = parse_kind(p);
+	if (close == TOK_INVALID ? parse_ends_statement(kind) : parse_accept(p, close)) {
+		return;
+	}
+	
+	do {
+		kind = parse_kind(p);
+		if (kind == TOK_COMMA || kind == close || (close == TOK_INVALID && parse_ends_statement(kind))) {
+			parse_append(p, call, last, parse_node(p, AST_EMPTY, TOK_INVALID, p->pos));
+		} else {
+			parse_append(p, call, last, parse_expression(p));
+		}
+	} while (!p->failed && parse_accept(p, TOK_COMMA));
+	
+	if (close != TOK_INVALID && !p->failed) {
+		parse_expect(p, close, "Expected )");
+	}
+}
+
+
+static uint32_t parse_string(parser_t *p) {
+	if (parse_kind(p) != TOK_STRING_LIT) {
+		return parse_fail(p, "Expected a string");
+	}
+	return parse_node(p, AST_LITERAL, TOK_STRING_LIT, parse_advance(p));
+}
+
+
+/** public API **/
+
+ast_t *ast_parse(lexer_t *lexer) {
+	if (lexer == NULL) {
+		return NULL;
+	}
+	
+	ast_t *ast = calloc(1, sizeof(ast_t));
+	if (ast == NULL) {
+		return NULL;
+	}
+	
+	parser_t parser;
+	memset(&parser, 0, sizeof(parser));
+	parser.lexer = lexer;
+	parser.tokens = lexer_get_tokens(lexer, &parser.num_tokens);
+	parser.ast = ast;
+	
+	// a tree usually has a little over half as many nodes as there are tokens, so this rarely has to grow
+	size_t capacity = parser.num_tokens/3*2+64;
+	ast->capacity = (capacity < PARSE_MAX_NODES ? (uint32_t)capacity : PARSE_MAX_NODES);
+	ast->nodes = malloc(ast->capacity*sizeof(ast_node_t));
+	if (ast->nodes == NULL) {
+		free(ast);
+		return NULL;
+	}
+	
+	parser_t *p = &parser;
+	parse_skip_trivia(p);
+	uint32_t root = parse_node(p, AST_ROOT, TOK_INVALID, 0);
+	uint32_t last = 0;
+	parse_statements(p, root, &last);
+	
+	if (p->out_of_memory) {
+		ast_destroy(ast);
+		return NULL;
+	}
+	return ast;
+}
+
+
+void ast_destroy(ast_t *ast) {
+	if (ast == NULL) {
+		return;
+	}
+	
+	free(ast->nodes);
+	free(ast->error);
+	free(ast);
+}
+
+
+uint32_t ast_get_num_nodes(ast_t *ast) {
+	return (ast != NULL ? ast->num_nodes : 0);
+}
+
+
+const ast_node_t *ast_get_nodes(ast_t *ast) {
+	return (ast != NULL ? ast->nodes : NULL);
+}
+
+
+const ast_node_t *ast_get_node(ast_t *ast, uint32_t index) {
+	if (ast == NULL || index >= ast->num_nodes) {
+		return NULL;
+	}
+	return ast->nodes+index;
+}
+
+
+const char *ast_get_error(ast_t *ast) {
+	return (ast != NULL ? ast->error : NULL);
+}
+
+
+int ast_get_num_errors(ast_t *ast) {
+	return (ast != NULL ? ast->num_errors : 0);
+}
+
+
+const char *ast_kind_name(ast_kind_t kind) {
+	if ((unsigned)kind >= AST_KIND_COUNT) {
+		return NULL;
+	}
+	return ast_kind_names[kind];
+}
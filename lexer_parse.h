@@ -0,0 +1,169 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_PARSE_H_V6HX2PQN
+#define LEXER_PARSE_H_V6HX2PQN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+a syntax tree built straight from a lexer's tokens - nodes refer to tokens by
+index rather than copying their text, and live in a single array linked by
+index, so the whole tree is freed at once by ast_destroy
+*/
+typedef struct s_ast ast_t;
+
+/* node kinds - the children each kind has are listed in order, [optional] */
+typedef enum {
+	AST_ROOT=0, /* the source: statements */
+	AST_ERROR, /* a statement that couldn't be parsed - token is where it went wrong */
+	AST_EMPTY, /* an omitted argument or slice bound */
+	
+	/* declarations */
+	AST_STRICT, /* op is TOK_STRICT_KW or TOK_SUPERSTRICT_KW */
+	AST_FRAMEWORK, /* module name */
+	AST_MODULE, /* module name */
+	AST_MODULEINFO, /* string */
+	AST_IMPORT, /* module name or string */
+	AST_INCLUDE, /* string */
+	AST_VISIBILITY, /* op is TOK_PRIVATE_KW or TOK_PUBLIC_KW */
+	AST_TYPE, /* token is the name: [AST_EXTENDS] [AST_IMPLEMENTS] members */
+	AST_PROTOCOL, /* token is the name: [AST_EXTENDS] members */
+	AST_EXTENDS, /* type refs */
+	AST_IMPLEMENTS, /* type refs */
+	AST_EXTERN, /* [calling convention string] declarations */
+	AST_FUNCTION, /* op is TOK_FUNCTION_KW or TOK_METHOD_KW, token is the name: [return type ref] AST_PARAMS
+	                 [alias string] [AST_BLOCK] - there's no body in Extern and Protocol blocks or if it's Abstract */
+	AST_PARAMS, /* AST_VARs */
+	AST_LOCAL, /* AST_VARs, flags has AST_FLAG_AUTO if declared with Auto */
+	AST_GLOBAL, /* AST_VARs */
+	AST_CONST, /* AST_VARs */
+	AST_FIELD, /* AST_VARs */
+	AST_VAR, /* token is the name: [type ref] [initial or default value] */
+	AST_TYPE_REF, /* op is the kind of the type's token (a type keyword, TOK_ID or a sigil like TOK_PERCENT) or
+	                 TOK_INVALID for a bare array, and the low byte of flags is the number of Ptrs: AST_DIMS...
+	                 [AST_PARAMS of a function type] */
+	AST_DIMS, /* the low byte of flags is the number of dimensions: sizes, if given */
+	AST_LABEL, /* token is the name */
+	
+	/* statements */
+	AST_BLOCK, /* statements */
+	AST_IF, /* condition AST_BLOCK [AST_IF for ElseIf or AST_BLOCK for Else] */
+	AST_WHILE, /* condition AST_BLOCK */
+	AST_REPEAT, /* AST_BLOCK [Until condition, none for Forever] */
+	AST_FOR, /* AST_LOCAL or variable, start (or collection with AST_FLAG_EACHIN), [end] [step with AST_FLAG_STEP]
+	            AST_BLOCK */
+	AST_SELECT, /* value AST_CASE... [AST_DEFAULT] */
+	AST_CASE, /* values... AST_BLOCK */
+	AST_DEFAULT, /* AST_BLOCK */
+	AST_TRY, /* AST_BLOCK AST_CATCH... */
+	AST_CATCH, /* AST_VAR AST_BLOCK */
+	AST_RETURN, /* [value] */
+	AST_EXIT,
+	AST_CONTINUE,
+	AST_END,
+	AST_THROW, /* value */
+	AST_GOTO, /* token is the label */
+	AST_ASSERT, /* condition [message] */
+	AST_ASSIGN, /* op is TOK_EQUALS, TOK_ASSIGN_AUTO or one of the other TOK_ASSIGN_ kinds: target value */
+	AST_INCREMENT, /* op is TOK_DOUBLEPLUS or TOK_DOUBLEMINUS: target */
+	
+	/* expressions - calls are statements as well */
+	AST_IDENT, /* [sigil type ref] */
+	AST_LITERAL, /* op is TOK_NUMBER_LIT, TOK_HEX_LIT, TOK_BIN_LIT, TOK_STRING_LIT, TOK_NULL_KW or TOK_PI_KW:
+	                [sigil type ref] */
+	AST_SELF,
+	AST_SUPER,
+	AST_UNARY, /* op is TOK_MINUS, TOK_PLUS, TOK_TILDE, TOK_NOT_KW or TOK_VARPTR_KW: operand */
+	AST_BINARY, /* op is the operator's token kind or one of the AST_OP_ values below: left right */
+	AST_MEMBER, /* token is the member's name: object */
+	AST_CALL, /* token is the (: function arguments... - flags has AST_FLAG_NO_PARENS for a call statement like
+	             Print x, whose token is the function's first */
+	AST_INDEX, /* token is the [: array indices... */
+	AST_SLICE, /* token is the [: array from to - either bound may be AST_EMPTY */
+	AST_NEW, /* type ref */
+	AST_CAST, /* type ref value */
+	AST_ARRAY, /* elements... */
+	
+	AST_KIND_COUNT
+} ast_kind_t;
+
+/* comparisons spelled with two tokens */
+enum {
+	AST_OP_NOT_EQUAL=TOK_COUNT,
+	AST_OP_LESS_EQUAL,
+	AST_OP_GREATER_EQUAL,
+};
+
+typedef enum {
+	AST_FLAG_ABSTRACT=1<<8,
+	AST_FLAG_FINAL=1<<9,
+	AST_FLAG_NODEBUG=1<<10,
+	AST_FLAG_VAR=1<<11, /* a Var parameter's type ref */
+	AST_FLAG_VARIADIC=1<<12, /* a ... parameter */
+	AST_FLAG_AUTO=1<<13,
+	AST_FLAG_SINGLE_LINE=1<<14, /* an If written on one line */
+	AST_FLAG_EACHIN=1<<15,
+	AST_FLAG_UNTIL=1<<16, /* a For loop up to but not including its end */
+	AST_FLAG_STEP=1<<17,
+	AST_FLAG_NO_PARENS=1<<18,
+} ast_flag_t;
+
+typedef struct s_ast_node {
+	uint16_t kind; /* ast_kind_t */
+	uint16_t op; /* token_kind_t of the node's keyword or operator, TOK_INVALID if it has neither */
+	uint32_t flags; /* ast_flag_t */
+	uint32_t child, next; /* index of the first child and of the next sibling, 0 if none (the root is nobody's child) */
+	size_t token; /* index of the node's name, keyword or operator in the lexer's tokens */
+} ast_node_t;
+
+/* parses the tokens of a lexer that has been run, which has to outlive the tree - returns NULL if out of memory,
+   syntax errors leave AST_ERROR nodes in the tree instead of failing */
+ast_t *ast_parse(lexer_t *lexer);
+/* releases the tree's memory */
+void ast_destroy(ast_t *ast);
+/* returns the number of nodes - node 0 is the AST_ROOT */
+uint32_t ast_get_num_nodes(ast_t *ast);
+/* returns all nodes, indexed by the child and next fields of each */
+const ast_node_t *ast_get_nodes(ast_t *ast);
+/* returns the node at the index or NULL if out of range */
+const ast_node_t *ast_get_node(ast_t *ast, uint32_t index);
+/* returns the first syntax error or NULL if there were none */
+const char *ast_get_error(ast_t *ast);
+/* returns the number of AST_ERROR nodes */
+int ast_get_num_errors(ast_t *ast);
+/* returns the name of the kind, e.g. "If" for AST_IF */
+const char *ast_kind_name(ast_kind_t kind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_PARSE_H_V6HX2PQN */
@@ -0,0 +1,318 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+// ftruncate, shm_open and mmap aren't declared in strict C99 otherwise
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lexer.h"
+#include "lexer_shm.h"
+
+#define LEXER_SHM_MAGIC 0x4c584d42u	// "BMXL"
+#define LEXER_SHM_ALIGN(n) (((n)+63) & ~(size_t)63)
+
+/*
+the segment is a header followed by two slots.  a publish writes to the slot
+readers aren't pointed at, then flips the header over to it, so readers only
+retry if they're still on a slot when it's reused two publishes later.  each
+slot is guarded by its own seqlock - its seq is odd while it's being written.
+*/
+typedef struct s_shm_slot {
+	_Atomic uint64_t seq;
+	uint64_t generation;
+	uint64_t num_tokens, tokens_offset;
+	uint64_t source_length, source_offset;
+	uint64_t num_lines, lines_offset;
+	uint64_t error_length, error_offset;	// error_length is 0 if there's no error
+} shm_slot_t;
+
+typedef struct s_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t slot_size;	// including the slot's own header
+	_Atomic uint64_t generation;
+	_Atomic uint32_t active;
+} shm_header_t;
+
+struct s_lexer_shm {
+	int fd;
+	bool writer;
+	size_t size;
+	shm_header_t *header;
+};
+
+static shm_slot_t *lexer_shm_slot(lexer_shm_t *shm, uint32_t index);
+
+
+static shm_slot_t *lexer_shm_slot(lexer_shm_t *shm, uint32_t index) {
+	char *base = (char*)shm->header+LEXER_SHM_ALIGN(sizeof(shm_header_t));
+	return (shm_slot_t*)(base+index*shm->header->slot_size);
+}
+
+
+lexer_shm_t *lexer_shm_create(const char *name, size_t slot_size) {
+	if (name == NULL) {
+		return NULL;
+	}
+	
+	slot_size = LEXER_SHM_ALIGN(LEXER_SHM_ALIGN(sizeof(shm_slot_t))+slot_size);
+	size_t size = LEXER_SHM_ALIGN(sizeof(shm_header_t))+2*slot_size;
+	
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		return NULL;
+	}
+	
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	
+	lexer_shm_t *shm = malloc(sizeof(lexer_shm_t));
+	if (shm == NULL) {
+		munmap(mapping, size);
+		close(fd);
+		return NULL;
+	}
+	shm->fd = fd;
+	shm->writer = true;
+	shm->size = size;
+	shm->header = (shm_header_t*)mapping;
+	
+	shm->header->size = size;
+	shm->header->slot_size = slot_size;
+	atomic_store(&shm->header->generation, 0);
+	atomic_store(&shm->header->active, 0);
+	atomic_store(&lexer_shm_slot(shm, 0)->seq, 0);
+	atomic_store(&lexer_shm_slot(shm, 1)->seq, 0);
+	shm->header->version = LEXER_SHM_VERSION;
+	// written last so readers never see a half-initialized header as valid
+	atomic_thread_fence(memory_order_release);
+	shm->header->magic = LEXER_SHM_MAGIC;
+	
+	return shm;
+}
+
+
+lexer_shm_t *lexer_shm_open(const char *name) {
+	if (name == NULL) {
+		return NULL;
+	}
+	
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(shm_header_t)) {
+		close(fd);
+		return NULL;
+	}
+	
+	size_t size = (size_t)info.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	
+	shm_header_t *header = (shm_header_t*)mapping;
+	if (header->magic != LEXER_SHM_MAGIC || header->version != LEXER_SHM_VERSION || header->size != size) {
+		munmap(mapping, size);
+		close(fd);
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	
+	lexer_shm_t *shm = malloc(sizeof(lexer_shm_t));
+	if (shm == NULL) {
+		munmap(mapping, size);
+		close(fd);
+		return NULL;
+	}
+	shm->fd = fd;
+	shm->writer = false;
+	shm->size = size;
+	shm->header = header;
+	return shm;
+}
+
+
+void lexer_shm_close(lexer_shm_t *shm) {
+	if (shm == NULL) {
+		return;
+	}
+	
+	munmap(shm->header, shm->size);
+	close(shm->fd);
+	free(shm);
+}
+
+
+int lexer_shm_unlink(const char *name) {
+	return shm_unlink(name);
+}
+
+
+int lexer_shm_publish(lexer_shm_t *shm, lexer_t *lexer) {
+	if (shm == NULL || !shm->writer || lexer == NULL) {
+		return -1;
+	}
+	
+	size_t source_length;
+	const char *source = lexer_get_source(lexer, &source_length);
+	const char *error = lexer_get_error(lexer);
+	size_t error_length = (error != NULL ? strlen(error) : 0);
+	size_t num_tokens = lexer_get_num_tokens(lexer);
+	
+	size_t num_lines = 1;
+	const char *newline = source;
+	while ((newline = memchr(newline, '\n', (size_t)(source+source_length-newline))) != NULL) {
+		++num_lines;
+		++newline;
+	}
+	
+	size_t tokens_offset = LEXER_SHM_ALIGN(sizeof(shm_slot_t));
+	size_t lines_offset = LEXER_SHM_ALIGN(tokens_offset+num_tokens*sizeof(token_ofs64_t));
+	size_t source_offset = LEXER_SHM_ALIGN(lines_offset+num_lines*sizeof(uint64_t));
+	size_t error_offset = source_offset+source_length+1;
+	if (error_offset+error_length+1 > shm->header->slot_size) {
+		return -1;
+	}
+	
+	uint32_t index = 1-atomic_load(&shm->header->active);
+	shm_slot_t *slot = lexer_shm_slot(shm, index);
+	char *base = (char*)slot;
+	
+	uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq+1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	
+	lexer_get_tokens_ofs64(lexer, 0, num_tokens, (token_ofs64_t*)(base+tokens_offset));
+	
+	uint64_t *lines = (uint64_t*)(base+lines_offset);
+	size_t line = 0;
+	lines[line++] = 0;
+	newline = source;
+	while ((newline = memchr(newline, '\n', (size_t)(source+source_length-newline))) != NULL) {
+		++newline;
+		lines[line++] = (uint64_t)(newline-source);
+	}
+	
+	memcpy(base+source_offset, source, source_length);
+	base[source_offset+source_length] = 0;
+	if (error != NULL) {
+		memcpy(base+error_offset, error, error_length+1);
+	}
+	
+	uint64_t generation = atomic_load(&shm->header->generation)+1;
+	slot->generation = generation;
+	slot->num_tokens = num_tokens;
+	slot->tokens_offset = tokens_offset;
+	slot->num_lines = num_lines;
+	slot->lines_offset = lines_offset;
+	slot->source_length = source_length;
+	slot->source_offset = source_offset;
+	slot->error_length = error_length;
+	slot->error_offset = (error != NULL ? error_offset : 0);
+	
+	atomic_store_explicit(&slot->seq, seq+2, memory_order_release);
+	
+	atomic_store(&shm->header->active, index);
+	atomic_store(&shm->header->generation, generation);
+	
+	return 0;
+}
+
+
+uint64_t lexer_shm_get_generation(lexer_shm_t *shm) {
+	return (shm != NULL ? atomic_load(&shm->header->generation) : 0);
+}
+
+
+int lexer_shm_read_begin(lexer_shm_t *shm, lexer_shm_view_t *view) {
+	if (shm == NULL || view == NULL || atomic_load(&shm->header->generation) == 0) {
+		return -1;
+	}
+	
+	const shm_slot_t *slot = lexer_shm_slot(shm, atomic_load(&shm->header->active));
+	uint64_t seq = atomic_load_explicit(&((shm_slot_t*)slot)->seq, memory_order_acquire);
+	if (seq & 1) {
+		return -1;
+	}
+	
+	const char *base = (const char*)slot;
+	view->generation = slot->generation;
+	view->num_tokens = (size_t)slot->num_tokens;
+	view->source_length = (size_t)slot->source_length;
+	view->num_lines = (size_t)slot->num_lines;
+	
+	// a torn read of the offsets could point anywhere - keep everything inside the slot
+	size_t slot_size = shm->header->slot_size;
+	if (slot->tokens_offset+view->num_tokens*sizeof(token_ofs64_t) > slot_size ||
+		slot->lines_offset+view->num_lines*sizeof(uint64_t) > slot_size ||
+		slot->source_offset+view->source_length > slot_size ||
+		slot->error_offset+slot->error_length > slot_size) {
+		return -1;
+	}
+	
+	view->tokens = (const token_ofs64_t*)(base+slot->tokens_offset);
+	view->lines = (const uint64_t*)(base+slot->lines_offset);
+	view->source = base+slot->source_offset;
+	view->error = (slot->error_offset != 0 ? base+slot->error_offset : NULL);
+	view->slot = slot;
+	view->seq = seq;
+	
+	if (!lexer_shm_read_valid(shm, view)) {
+		return -1;
+	}
+	return 0;
+}
+
+
+int lexer_shm_read_valid(lexer_shm_t *shm, const lexer_shm_view_t *view) {
+	if (shm == NULL || view == NULL || view->slot == NULL) {
+		return 0;
+	}
+	
+	atomic_thread_fence(memory_order_acquire);
+	shm_slot_t *slot = (shm_slot_t*)view->slot;
+	return (atomic_load_explicit(&slot->seq, memory_order_relaxed) == view->seq);
+}
@@ -0,0 +1,87 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_SHM_H_7TZC2MKA
+#define LEXER_SHM_H_7TZC2MKA
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bumped whenever the layout of the segment changes - readers refuse segments with a different version */
+#define LEXER_SHM_VERSION 2
+
+typedef struct s_lexer_shm lexer_shm_t;
+
+/*
+a published lexer result, pointing straight into the shared segment - nothing
+is copied, so the view is only valid for as long as lexer_shm_read_valid says
+so (see below)
+*/
+typedef struct s_lexer_shm_view {
+	uint64_t generation; /* number of the publish this view refers to, starting at 1 */
+	const token_ofs64_t *tokens;
+	size_t num_tokens;
+	const char *source; /* the source the token offsets refer to */
+	size_t source_length;
+	const uint64_t *lines; /* offset of the beginning of each line */
+	size_t num_lines;
+	const char *error; /* the lexer's error or NULL */
+	
+	/* private */
+	const void *slot;
+	uint64_t seq;
+} lexer_shm_view_t;
+
+/* creates (or replaces) the named POSIX shared memory segment with room for slot_size bytes of lexer output per
+   version and opens it for publishing - returns NULL on error */
+lexer_shm_t *lexer_shm_create(const char *name, size_t slot_size);
+/* opens an existing segment for reading - returns NULL on error or if the segment's version doesn't match */
+lexer_shm_t *lexer_shm_open(const char *name);
+/* unmaps the segment and releases the handle - the segment itself stays until lexer_shm_unlink */
+void lexer_shm_close(lexer_shm_t *shm);
+/* removes the named segment */
+int lexer_shm_unlink(const char *name);
+/* writes the lexer's tokens, source, line index and error to the segment as a new version - readers see either
+   the previous version or this one, never a mix; returns 0 on success or -1 if the output doesn't fit in a slot or
+   the segment wasn't created by this process */
+int lexer_shm_publish(lexer_shm_t *shm, lexer_t *lexer);
+/* returns the generation of the latest published version, 0 if nothing has been published yet */
+uint64_t lexer_shm_get_generation(lexer_shm_t *shm);
+/* points view at the latest published version - returns 0 on success, -1 if nothing has been published or a
+   publish is being written over the version (try again) */
+int lexer_shm_read_begin(lexer_shm_t *shm, lexer_shm_view_t *view);
+/* returns 1 if nothing in the view was overwritten since lexer_shm_read_begin, in which case everything read from
+   it so far is consistent, or 0 if it was and the reads have to be retried */
+int lexer_shm_read_valid(lexer_shm_t *shm, const lexer_shm_view_t *view);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_SHM_H_7TZC2MKA */
@@ -0,0 +1,848 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+// O_CLOEXEC, CLOCK_MONOTONIC, d_type, strdup and friends aren't declared in strict C99 otherwise
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "lexer.h"
+#include "lexer_watch.h"
+
+#define WATCH_INITIAL_BUCKETS 256
+/* a burst that keeps going is flushed after this long anyway, so files don't wait on it forever */
+#define WATCH_MAX_DELAY_MS 1000
+#define WATCH_FILE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define WATCH_DIR_EVENTS (WATCH_FILE_EVENTS | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* one lexed version of a file, shared with the snapshots of it */
+typedef struct s_watch_lexed {
+	int refs;
+	uint64_t version;
+	char *source;
+	size_t length;
+	lexer_t *lexer;
+} watch_lexed_t;
+
+/*
+a file is either idle, pending (waiting for the tree to settle), queued for
+the pool or running on it - if it changes again while running, dirty makes it
+pending again once it's done.  files are never removed from the map, so their
+paths stay valid and their versions keep counting if they come back.
+*/
+typedef struct s_watch_file {
+	char *path;
+	size_t hash;
+	uint64_t version;
+	watch_lexed_t *current;
+	bool pending, queued, running, dirty;
+	struct s_watch_file *chain;
+	struct s_watch_file *next; /* in the pending list or the queue */
+} watch_file_t;
+
+struct s_lexer_watch {
+	char *root;
+	unsigned int options;
+	int settle_ms;
+	watch_callback_t callback;
+	void *context;
+	
+	int inotify;
+	int stop_pipe[2];
+	char **dirs; /* path of each watch descriptor's directory, only touched by the event thread once it runs */
+	int dirs_capacity;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	watch_file_t **buckets;
+	size_t num_buckets, num_files;
+	watch_file_t *pending, *queue, *queue_tail;
+	struct timespec first_pending, last_event;
+	int num_running;
+	uint64_t generation;
+	bool stopping;
+	
+	pthread_t events;
+	pthread_t *threads;
+	int num_threads;
+};
+
+static size_t watch_hash_path(const char *path);
+static bool watch_is_source(const char *name);
+static char *watch_join_path(const char *dir, const char *name);
+static char *watch_read_file(const char *path, size_t *length);
+static long watch_ms_since(const struct timespec *then, const struct timespec *now);
+
+static watch_file_t *watch_find(lexer_watch_t *watch, const char *path, bool add);
+static void watch_mark(lexer_watch_t *watch, const char *path);
+static void watch_mark_file(lexer_watch_t *watch, watch_file_t *file);
+static void watch_mark_prefix(lexer_watch_t *watch, const char *prefix);
+static void watch_flush(lexer_watch_t *watch);
+static bool watch_is_idle(lexer_watch_t *watch);
+static void watch_lexed_release(lexer_watch_t *watch, watch_lexed_t *lexed);
+
+static void watch_add_dir(lexer_watch_t *watch, const char *path);
+static void watch_remove_dirs(lexer_watch_t *watch, const char *prefix);
+static void watch_handle_event(lexer_watch_t *watch, const struct inotify_event *event);
+static void *watch_event_main(void *watch);
+static void watch_update(lexer_watch_t *watch, watch_file_t *file);
+static void *watch_worker_main(void *watch);
+
+
+static size_t watch_hash_path(const char *path) {
+	// FNV-1a
+	size_t hash = (size_t)14695981039346656037ULL;
+	for (; *path; ++path) {
+		hash = (hash ^ (unsigned char)*path)*(size_t)1099511628211ULL;
+	}
+	return hash;
+}
+
+
+static bool watch_is_source(const char *name) {
+	size_t len = strlen(name);
+	return (len > 4 && strcasecmp(name+len-4, ".bmx") == 0);
+}
+
+
+static char *watch_join_path(const char *dir, const char *name) {
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	char *path = malloc(dir_len+name_len+2);
+	if (path != NULL) {
+		memcpy(path, dir, dir_len);
+		path[dir_len] = '/';
+		memcpy(path+dir_len+1, name, name_len+1);
+	}
+	return path;
+}
+
+
+/* returns the file's contents, terminated, or NULL with errno set */
+static char *watch_read_file(const char *path, size_t *length) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+		close(fd);
+		errno = ENOENT;
+		return NULL;
+	}
+	
+	// read up to the end rather than the size, since the file may be written to meanwhile
+	size_t capacity = (size_t)info.st_size+1;
+	size_t len = 0;
+	char *source = malloc(capacity+1);
+	while (source != NULL) {
+		if (len == capacity) {
+			capacity *= 2;
+			char *grown = realloc(source, capacity+1);
+			if (grown == NULL) {
+				free(source);
+				source = NULL;
+				break;
+			}
+			source = grown;
+		}
+		
+		ssize_t got = read(fd, source+len, capacity-len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		} else if (got < 0) {
+			free(source);
+			source = NULL;
+		} else if (got == 0) {
+			break;
+		} else {
+			len += (size_t)got;
+		}
+	}
+	close(fd);
+	
+	if (source != NULL) {
+		source[len] = 0;
+		*length = len;
+	}
+	return source;
+}
+
+
+static long watch_ms_since(const struct timespec *then, const struct timespec *now) {
+	return (long)(now->tv_sec-then->tv_sec)*1000+(now->tv_nsec-then->tv_nsec)/1000000;
+}
+
+
+/** files - all of these expect the lock to be held **/
+
+static watch_file_t *watch_find(lexer_watch_t *watch, const char *path, bool add) {
+	size_t hash = watch_hash_path(path);
+	watch_file_t *file = watch->buckets[hash & (watch->num_buckets-1)];
+	for (; file != NULL; file = file->chain) {
+		if (file->hash == hash && strcmp(file->path, path) == 0) {
+			return file;
+		}
+	}
+	if (!add) {
+		return NULL;
+	}
+	
+	// keep the load factor at or below 1, unless the table can't grow
+	if (watch->num_files >= watch->num_buckets) {
+		size_t num_buckets = watch->num_buckets*2;
+		watch_file_t **buckets = calloc(num_buckets, sizeof(watch_file_t*));
+		if (buckets != NULL) {
+			size_t index = 0;
+			for (; index < watch->num_buckets; ++index) {
+				watch_file_t *iter = watch->buckets[index];
+				while (iter != NULL) {
+					watch_file_t *next = iter->chain;
+					watch_file_t **bucket = buckets+(iter->hash & (num_buckets-1));
+					iter->chain = *bucket;
+					*bucket = iter;
+					iter = next;
+				}
+			}
+			free(watch->buckets);
+			watch->buckets = buckets;
+			watch->num_buckets = num_buckets;
+		}
+	}
+	
+	file = calloc(1, sizeof(watch_file_t));
+	char *copy = strdup(path);
+	if (file == NULL || copy == NULL) {
+		free(file);
+		free(copy);
+		return NULL;
+	}
+	file->path = copy;
+	file->hash = hash;
+	watch_file_t **bucket = watch->buckets+(hash & (watch->num_buckets-1));
+	file->chain = *bucket;
+	*bucket = file;
+	watch->num_files += 1;
+	return file;
+}
+
+
+/* notes that the file may have changed, to be looked at once the tree settles */
+static void watch_mark(lexer_watch_t *watch, const char *path) {
+	watch_file_t *file = watch_find(watch, path, true);
+	if (file != NULL) {
+		watch_mark_file(watch, file);
+	}
+}
+
+
+static void watch_mark_file(lexer_watch_t *watch, watch_file_t *file) {
+	clock_gettime(CLOCK_MONOTONIC, &watch->last_event);
+	if (file->running) {
+		file->dirty = true;
+	} else if (!file->pending && !file->queued) {
+		if (watch->pending == NULL) {
+			watch->first_pending = watch->last_event;
+		}
+		file->pending = true;
+		file->next = watch->pending;
+		watch->pending = file;
+	}
+}
+
+
+/* marks every indexed file below the directory, e.g. when it's moved away, so the ones that are gone get removed */
+static void watch_mark_prefix(lexer_watch_t *watch, const char *prefix) {
+	size_t len = strlen(prefix);
+	size_t index = 0;
+	for (; index < watch->num_buckets; ++index) {
+		watch_file_t *file = watch->buckets[index];
+		for (; file != NULL; file = file->chain) {
+			if (strncmp(file->path, prefix, len) == 0 && (prefix[len-1] == '/' || file->path[len] == '/')) {
+				watch_mark_file(watch, file);
+			}
+		}
+	}
+}
+
+
+/* hands the pending files to the pool */
+static void watch_flush(lexer_watch_t *watch) {
+	while (watch->pending != NULL) {
+		watch_file_t *file = watch->pending;
+		watch->pending = file->next;
+		file->pending = false;
+		file->queued = true;
+		file->next = NULL;
+		if (watch->queue_tail != NULL) {
+			watch->queue_tail->next = file;
+		} else {
+			watch->queue = file;
+		}
+		watch->queue_tail = file;
+	}
+	pthread_cond_broadcast(&watch->work);
+}
+
+
+static bool watch_is_idle(lexer_watch_t *watch) {
+	return (watch->pending == NULL && watch->queue == NULL && watch->num_running == 0);
+}
+
+
+static void watch_lexed_release(lexer_watch_t *watch, watch_lexed_t *lexed) {
+	if (lexed == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&watch->lock);
+	bool last = (--lexed->refs == 0);
+	pthread_mutex_unlock(&watch->lock);
+	
+	if (last) {
+		lexer_destroy(lexed->lexer);
+		free(lexed->source);
+		free(lexed);
+	}
+}
+
+
+/** events **/
+
+/* watches the directory and everything below it, marking the sources found - only called by lexer_watch_new and
+   then the event thread */
+static void watch_add_dir(lexer_watch_t *watch, const char *path) {
+	int wd = inotify_add_watch(watch->inotify, path, WATCH_DIR_EVENTS);
+	if (wd < 0) {
+		return;
+	}
+	
+	if (wd >= watch->dirs_capacity) {
+		int capacity = (watch->dirs_capacity > 0 ? watch->dirs_capacity : 64);
+		while (capacity <= wd) {
+			capacity *= 2;
+		}
+		char **dirs = realloc(watch->dirs, (size_t)capacity*sizeof(char*));
+		if (dirs == NULL) {
+			inotify_rm_watch(watch->inotify, wd);
+			return;
+		}
+		memset(dirs+watch->dirs_capacity, 0, (size_t)(capacity-watch->dirs_capacity)*sizeof(char*));
+		watch->dirs = dirs;
+		watch->dirs_capacity = capacity;
+	}
+	// the same directory keeps its descriptor if it's added again, e.g. after the queue overflowed
+	free(watch->dirs[wd]);
+	watch->dirs[wd] = strdup(path);
+	
+	// files created before the watch was in place are only found this way
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		
+		char *child = watch_join_path(path, entry->d_name);
+		if (child == NULL) {
+			continue;
+		}
+		
+		unsigned char type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat info;
+			if (lstat(child, &info) != 0) {
+				type = DT_UNKNOWN;
+			} else {
+				type = (S_ISDIR(info.st_mode) ? DT_DIR : (S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN));
+			}
+		}
+		
+		if (type == DT_DIR) {
+			watch_add_dir(watch, child);
+		} else if (type == DT_REG && watch_is_source(entry->d_name)) {
+			pthread_mutex_lock(&watch->lock);
+			watch_mark(watch, child);
+			pthread_mutex_unlock(&watch->lock);
+		}
+		free(child);
+	}
+	closedir(dir);
+}
+
+
+/* stops watching the directory and everything below it, after it's been moved away */
+static void watch_remove_dirs(lexer_watch_t *watch, const char *prefix) {
+	size_t len = strlen(prefix);
+	int wd = 0;
+	for (; wd < watch->dirs_capacity; ++wd) {
+		const char *dir = watch->dirs[wd];
+		if (dir != NULL && strncmp(dir, prefix, len) == 0 && (dir[len] == 0 || dir[len] == '/')) {
+			inotify_rm_watch(watch->inotify, wd);
+			free(watch->dirs[wd]);
+			watch->dirs[wd] = NULL;
+		}
+	}
+}
+
+
+static void watch_handle_event(lexer_watch_t *watch, const struct inotify_event *event) {
+	if (event->mask & IN_Q_OVERFLOW) {
+		// events were lost, so look at everything again
+		pthread_mutex_lock(&watch->lock);
+		watch_mark_prefix(watch, watch->root);
+		pthread_mutex_unlock(&watch->lock);
+		watch_add_dir(watch, watch->root);
+		return;
+	}
+	
+	if (event->wd < 0 || event->wd >= watch->dirs_capacity || watch->dirs[event->wd] == NULL) {
+		return;
+	}
+	if (event->mask & IN_IGNORED) {
+		free(watch->dirs[event->wd]);
+		watch->dirs[event->wd] = NULL;
+		return;
+	}
+	if (event->len == 0) {
+		return;
+	}
+	
+	char *path = watch_join_path(watch->dirs[event->wd], event->name);
+	if (path == NULL) {
+		return;
+	}
+	
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watch_add_dir(watch, path);
+		} else if (event->mask & IN_MOVED_FROM) {
+			watch_remove_dirs(watch, path);
+			pthread_mutex_lock(&watch->lock);
+			watch_mark_prefix(watch, path);
+			pthread_mutex_unlock(&watch->lock);
+		}
+	} else if ((event->mask & WATCH_FILE_EVENTS) && watch_is_source(event->name)) {
+		pthread_mutex_lock(&watch->lock);
+		watch_mark(watch, path);
+		pthread_mutex_unlock(&watch->lock);
+	}
+	free(path);
+}
+
+
+static void *watch_event_main(void *arg) {
+	lexer_watch_t *watch = arg;
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	
+	for (;;) {
+		// wait for the next event, or until it's time to flush what's pending
+		int timeout = -1;
+		struct timespec now;
+		pthread_mutex_lock(&watch->lock);
+		if (watch->pending != NULL) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long quiet = watch->settle_ms-watch_ms_since(&watch->last_event, &now);
+			long overdue = WATCH_MAX_DELAY_MS-watch_ms_since(&watch->first_pending, &now);
+			long wait = (quiet < overdue ? quiet : overdue);
+			timeout = (wait > 0 ? (int)wait : 0);
+		}
+		pthread_mutex_unlock(&watch->lock);
+		
+		struct pollfd fds[2] = {
+			{ watch->inotify, POLLIN, 0 },
+			{ watch->stop_pipe[0], POLLIN, 0 },
+		};
+		int ready = poll(fds, 2, timeout);
+		if (ready < 0 && errno != EINTR) {
+			break;
+		} else if (fds[1].revents != 0) {
+			break;
+		}
+		
+		if (ready > 0 && (fds[0].revents & POLLIN)) {
+			ssize_t got = read(watch->inotify, buf, sizeof(buf));
+			char *place = buf;
+			while (got > 0 && place < buf+got) {
+				const struct inotify_event *event = (const struct inotify_event*)place;
+				watch_handle_event(watch, event);
+				place += sizeof(struct inotify_event)+event->len;
+			}
+		}
+		
+		pthread_mutex_lock(&watch->lock);
+		if (watch->pending != NULL) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (watch_ms_since(&watch->last_event, &now) >= watch->settle_ms ||
+				watch_ms_since(&watch->first_pending, &now) >= WATCH_MAX_DELAY_MS) {
+				watch_flush(watch);
+			}
+		}
+		pthread_mutex_unlock(&watch->lock);
+	}
+	
+	return NULL;
+}
+
+
+/** pool **/
+
+/* reads the file and publishes a new version if its contents changed or it's gone */
+static void watch_update(lexer_watch_t *watch, watch_file_t *file) {
+	pthread_mutex_lock(&watch->lock);
+	watch_lexed_t *current = file->current;
+	if (current != NULL) {
+		++current->refs;
+	}
+	pthread_mutex_unlock(&watch->lock);
+	
+	size_t length = 0;
+	char *source = watch_read_file(file->path, &length);
+	watch_lexed_t *lexed = NULL;
+	if (source != NULL && current != NULL && current->length == length &&
+		memcmp(current->source, source, length) == 0) {
+		// touched but not changed, e.g. by a checkout of the same contents
+		free(source);
+		watch_lexed_release(watch, current);
+		return;
+	} else if (source == NULL && current == NULL) {
+		return;
+	} else if (source != NULL) {
+		lexer_t *lexer = lexer_new(source, source+length);
+		lexed = malloc(sizeof(watch_lexed_t));
+		if (lexer == NULL || lexed == NULL) {
+			lexer_destroy(lexer);
+			free(lexed);
+			free(source);
+			watch_lexed_release(watch, current);
+			return;
+		}
+		lexer_set_options(lexer, watch->options);
+		lexer_run(lexer);
+		lexed->refs = 1;
+		lexed->source = source;
+		lexed->length = length;
+		lexed->lexer = lexer;
+	}
+	
+	pthread_mutex_lock(&watch->lock);
+	watch_lexed_t *replaced = file->current;
+	file->current = lexed;
+	uint64_t version = ++file->version;
+	if (lexed != NULL) {
+		lexed->version = version;
+	}
+	watch->generation += 1;
+	pthread_mutex_unlock(&watch->lock);
+	
+	watch_lexed_release(watch, replaced);
+	watch_lexed_release(watch, current);
+	if (watch->callback != NULL) {
+		watch->callback(watch->context, file->path, version, (lexed != NULL ? WATCH_FILE_CHANGED : WATCH_FILE_REMOVED));
+	}
+}
+
+
+static void *watch_worker_main(void *arg) {
+	lexer_watch_t *watch = arg;
+	
+	pthread_mutex_lock(&watch->lock);
+	for (;;) {
+		while (watch->queue == NULL && !watch->stopping) {
+			pthread_cond_wait(&watch->work, &watch->lock);
+		}
+		if (watch->stopping) {
+			break;
+		}
+		
+		watch_file_t *file = watch->queue;
+		watch->queue = file->next;
+		if (watch->queue == NULL) {
+			watch->queue_tail = NULL;
+		}
+		file->next = NULL;
+		file->queued = false;
+		file->running = true;
+		file->dirty = false;
+		watch->num_running += 1;
+		pthread_mutex_unlock(&watch->lock);
+		
+		watch_update(watch, file);
+		
+		pthread_mutex_lock(&watch->lock);
+		file->running = false;
+		watch->num_running -= 1;
+		if (file->dirty) {
+			// changed again while it was being lexed - wait for it to settle again
+			file->dirty = false;
+			watch_mark_file(watch, file);
+		}
+		if (watch_is_idle(watch)) {
+			pthread_cond_broadcast(&watch->idle);
+		}
+	}
+	pthread_mutex_unlock(&watch->lock);
+	
+	return NULL;
+}
+
+
+/** public API **/
+
+lexer_watch_t *lexer_watch_new(const char *root, unsigned int options, int num_threads, int settle_ms,
+		watch_callback_t callback, void *context) {
+	if (root == NULL || root[0] == 0) {
+		return NULL;
+	}
+	
+	lexer_watch_t *watch = calloc(1, sizeof(lexer_watch_t));
+	if (watch == NULL) {
+		return NULL;
+	}
+	
+	size_t root_len = strlen(root);
+	while (root_len > 1 && root[root_len-1] == '/') {
+		--root_len;
+	}
+	watch->root = strndup(root, root_len);
+	// snapshots hand out the tokens as one array
+	watch->options = (options & ~(unsigned int)LEXER_OPT_SEGMENTED_TOKENS);
+	watch->settle_ms = (settle_ms > 0 ? settle_ms : 0);
+	watch->callback = callback;
+	watch->context = context;
+	watch->num_buckets = WATCH_INITIAL_BUCKETS;
+	watch->buckets = calloc(watch->num_buckets, sizeof(watch_file_t*));
+	watch->stop_pipe[0] = watch->stop_pipe[1] = -1;
+	watch->inotify = inotify_init1(IN_CLOEXEC);
+	pthread_mutex_init(&watch->lock, NULL);
+	pthread_cond_init(&watch->work, NULL);
+	pthread_cond_init(&watch->idle, NULL);
+	
+	struct stat info;
+	if (watch->root == NULL || watch->buckets == NULL || watch->inotify == -1 || pipe(watch->stop_pipe) != 0 ||
+		stat(watch->root, &info) != 0 || !S_ISDIR(info.st_mode)) {
+		lexer_watch_destroy(watch);
+		return NULL;
+	}
+	
+	// the tree is watched before the threads start, so the first version of every file is lexed with a flush
+	watch_add_dir(watch, watch->root);
+	pthread_mutex_lock(&watch->lock);
+	watch_flush(watch);
+	pthread_mutex_unlock(&watch->lock);
+	
+	if (num_threads <= 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = (cores > 0 ? (int)cores : 1);
+	}
+	watch->threads = malloc((size_t)num_threads*sizeof(pthread_t));
+	if (watch->threads == NULL || pthread_create(&watch->events, NULL, watch_event_main, watch) != 0) {
+		free(watch->threads);
+		watch->threads = NULL;
+		lexer_watch_destroy(watch);
+		return NULL;
+	}
+	for (; watch->num_threads < num_threads; ++watch->num_threads) {
+		if (pthread_create(watch->threads+watch->num_threads, NULL, watch_worker_main, watch) != 0) {
+			break;
+		}
+	}
+	if (watch->num_threads == 0) {
+		lexer_watch_destroy(watch);
+		return NULL;
+	}
+	
+	return watch;
+}
+
+
+void lexer_watch_destroy(lexer_watch_t *watch) {
+	if (watch == NULL) {
+		return;
+	}
+	
+	if (watch->threads != NULL) {
+		ssize_t written;
+		do {
+			written = write(watch->stop_pipe[1], "", 1);
+		} while (written < 0 && errno == EINTR);
+		pthread_join(watch->events, NULL);
+		
+		pthread_mutex_lock(&watch->lock);
+		watch->stopping = true;
+		pthread_cond_broadcast(&watch->work);
+		pthread_mutex_unlock(&watch->lock);
+		int index = 0;
+		for (; index < watch->num_threads; ++index) {
+			pthread_join(watch->threads[index], NULL);
+		}
+		free(watch->threads);
+	}
+	
+	size_t index = 0;
+	for (; watch->buckets != NULL && index < watch->num_buckets; ++index) {
+		watch_file_t *file = watch->buckets[index];
+		while (file != NULL) {
+			watch_file_t *next = file->chain;
+			watch_lexed_release(watch, file->current);
+			free(file->path);
+			free(file);
+			file = next;
+		}
+	}
+	int wd = 0;
+	for (; wd < watch->dirs_capacity; ++wd) {
+		free(watch->dirs[wd]);
+	}
+	
+	if (watch->inotify != -1) {
+		close(watch->inotify);
+	}
+	if (watch->stop_pipe[0] != -1) {
+		close(watch->stop_pipe[0]);
+		close(watch->stop_pipe[1]);
+	}
+	pthread_mutex_destroy(&watch->lock);
+	pthread_cond_destroy(&watch->work);
+	pthread_cond_destroy(&watch->idle);
+	free(watch->dirs);
+	free(watch->buckets);
+	free(watch->root);
+	free(watch);
+}
+
+
+int lexer_watch_wait_idle(lexer_watch_t *watch, int timeout_ms) {
+	if (watch == NULL) {
+		return -1;
+	}
+	
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms/1000;
+	deadline.tv_nsec += (long)(timeout_ms%1000)*1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000;
+	}
+	
+	int result = 0;
+	pthread_mutex_lock(&watch->lock);
+	while (!watch_is_idle(watch) && result == 0) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&watch->idle, &watch->lock);
+		} else if (pthread_cond_timedwait(&watch->idle, &watch->lock, &deadline) == ETIMEDOUT) {
+			result = (watch_is_idle(watch) ? 0 : -1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&watch->lock);
+	return result;
+}
+
+
+uint64_t lexer_watch_get_generation(lexer_watch_t *watch) {
+	if (watch == NULL) {
+		return 0;
+	}
+	
+	pthread_mutex_lock(&watch->lock);
+	uint64_t generation = watch->generation;
+	pthread_mutex_unlock(&watch->lock);
+	return generation;
+}
+
+
+int lexer_watch_acquire(lexer_watch_t *watch, const char *path, watch_snapshot_t *snapshot) {
+	if (watch == NULL || path == NULL || snapshot == NULL) {
+		return -1;
+	}
+	
+	pthread_mutex_lock(&watch->lock);
+	watch_file_t *file = watch_find(watch, path, false);
+	watch_lexed_t *lexed = (file != NULL ? file->current : NULL);
+	if (lexed != NULL) {
+		++lexed->refs;
+	}
+	pthread_mutex_unlock(&watch->lock);
+	
+	if (lexed == NULL) {
+		return -1;
+	}
+	snapshot->version = lexed->version;
+	snapshot->source = lexed->source;
+	snapshot->source_length = lexed->length;
+	snapshot->tokens = lexer_get_tokens(lexed->lexer, &snapshot->num_tokens);
+	snapshot->error = lexer_get_error(lexed->lexer);
+	snapshot->lexed = lexed;
+	return 0;
+}
+
+
+void lexer_watch_release(lexer_watch_t *watch, watch_snapshot_t *snapshot) {
+	if (watch == NULL || snapshot == NULL) {
+		return;
+	}
+	
+	watch_lexed_release(watch, snapshot->lexed);
+	snapshot->lexed = NULL;
+}
+
+
+void lexer_watch_foreach(lexer_watch_t *watch, void (*fn)(void *context, const char *path, uint64_t version),
+		void *context) {
+	if (watch == NULL || fn == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&watch->lock);
+	size_t index = 0;
+	for (; index < watch->num_buckets; ++index) {
+		watch_file_t *file = watch->buckets[index];
+		for (; file != NULL; file = file->chain) {
+			if (file->current != NULL) {
+				fn(context, file->path, file->version);
+			}
+		}
+	}
+	pthread_mutex_unlock(&watch->lock);
+}
@@ -0,0 +1,92 @@
+/*
+	Copyright (c) 2010 Noel R. Cower
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	claim that you wrote the original software. If you use this software
+	in a product, an acknowledgment in the product documentation would be
+	appreciated but is not required.
+
+	2. Altered source versions must be plainly marked as such, and must not be
+	misrepresented as being the original software.
+
+	3. This notice may not be removed or altered from any source
+	distribution.
+*/
+
+#ifndef LEXER_WATCH_H_9BQF3NLC
+#define LEXER_WATCH_H_9BQF3NLC
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+keeps the tokens of every .bmx file under a directory up to date as files
+change, using inotify (so Linux only).  events are coalesced until the tree
+has been quiet for a moment, then only the files they touched are read again,
+and only those whose contents actually changed are lexed again, on a pool of
+threads - so a checkout that rewrites a few files only costs those files.
+*/
+typedef struct s_lexer_watch lexer_watch_t;
+
+typedef enum {
+	WATCH_FILE_CHANGED=1, /* lexed for the first time or with new contents */
+	WATCH_FILE_REMOVED, /* deleted, moved away or no longer readable */
+} watch_event_t;
+
+/* called on one of the pool's threads, possibly on several at once, after the file's new version is published -
+   it may acquire snapshots but mustn't destroy the watch */
+typedef void (*watch_callback_t)(void *context, const char *path, uint64_t version, watch_event_t event);
+
+/* a version of a file's tokens, kept valid by the watch until released however the file changes meanwhile */
+typedef struct s_watch_snapshot {
+	uint64_t version; /* starts at 1 and goes up by one with each change or removal of the file */
+	const char *source;
+	size_t source_length;
+	const token_t *tokens; /* point into source */
+	size_t num_tokens;
+	const char *error; /* the lexer's error or NULL */
+	
+	/* private */
+	void *lexed;
+} watch_snapshot_t;
+
+/* starts watching the directory and everything below it, lexing its files with the given lexer options (except
+   LEXER_OPT_SEGMENTED_TOKENS) on up to num_threads threads, or one per core if num_threads <= 0 - events are
+   coalesced until none have come in for settle_ms; callback may be NULL.  returns NULL on error */
+lexer_watch_t *lexer_watch_new(const char *root, unsigned int options, int num_threads, int settle_ms,
+		watch_callback_t callback, void *context);
+/* stops watching and releases everything - snapshots must have been released */
+void lexer_watch_destroy(lexer_watch_t *watch);
+/* waits until every file the watch has heard about has been lexed - events the kernel hasn't delivered yet don't
+   count; returns 0 once idle or -1 if timeout_ms (if not negative) passed first */
+int lexer_watch_wait_idle(lexer_watch_t *watch, int timeout_ms);
+/* returns the number of changes and removals published so far, for polling instead of a callback */
+uint64_t lexer_watch_get_generation(lexer_watch_t *watch);
+/* fills in a snapshot of the file's current tokens (path as the watch sees it, i.e. root followed by the path below
+   it) - returns 0 on success or -1 if the file isn't indexed */
+int lexer_watch_acquire(lexer_watch_t *watch, const char *path, watch_snapshot_t *snapshot);
+void lexer_watch_release(lexer_watch_t *watch, watch_snapshot_t *snapshot);
+/* calls fn with the path and version of every indexed file, holding the watch's lock - fn mustn't call back into
+   the watch */
+void lexer_watch_foreach(lexer_watch_t *watch, void (*fn)(void *context, const char *path, uint64_t version),
+		void *context);
+		
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: LEXER_WATCH_H_9BQF3NLC */